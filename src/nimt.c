@@ -8,52 +8,780 @@
 #define _GNU_SOURCE
 #define _XOPEN_SOURCE 700
 
+// Build profiles. -DNIMT_MINIMAL leaves out what a small box such as a
+// router can do without; the default, the server profile, has it all.
+// NIMT_WITH_X=0 or 1 overrides one subsystem either way. What is left
+// out is compiled out, its checks on the relay path included.
+#if defined(NIMT_MINIMAL)
+#define NIMT_PROFILE "minimal"
+#define NIMT_WITH_DEFAULT 0
+#else
+#define NIMT_PROFILE "server"
+#define NIMT_WITH_DEFAULT 1
+#endif
+#ifndef NIMT_WITH_URING
+#define NIMT_WITH_URING NIMT_WITH_DEFAULT      // io_uring event loop, NIMT_URING
+#endif
+#ifndef NIMT_WITH_EPOLL
+#define NIMT_WITH_EPOLL NIMT_WITH_DEFAULT      // epoll or kqueue rather than poll()
+#endif
+#ifndef NIMT_WITH_SHARDS
+#define NIMT_WITH_SHARDS NIMT_WITH_DEFAULT     // I/O and spawner threads, NIMT_SHARDS
+#endif
+#ifndef NIMT_WITH_STATE
+#define NIMT_WITH_STATE NIMT_WITH_DEFAULT      // scrollback files: upgrade, crash recovery
+#endif
+#ifndef NIMT_WITH_RECORD
+#define NIMT_WITH_RECORD NIMT_WITH_DEFAULT     // session recordings
+#endif
+#ifndef NIMT_WITH_SCREEN
+#define NIMT_WITH_SCREEN NIMT_WITH_DEFAULT     // terminal emulator
+#endif
+#ifndef NIMT_WITH_COMPRESS
+#define NIMT_WITH_COMPRESS NIMT_WITH_DEFAULT   // compressed attach
+#endif
+#ifndef NIMT_WITH_HIBERNATE
+#define NIMT_WITH_HIBERNATE NIMT_WITH_COMPRESS  // NIMT_HIBERNATE, packs with the compressor
+#endif
+#ifndef NIMT_WITH_METRICS
+#define NIMT_WITH_METRICS NIMT_WITH_DEFAULT    // latency and read size histograms
+#endif
+#if NIMT_WITH_HIBERNATE && !NIMT_WITH_COMPRESS
+#error "NIMT_WITH_HIBERNATE needs NIMT_WITH_COMPRESS"
+#endif
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#if defined(__APPLE__)
+#include <util.h>
+#elif defined(__FreeBSD__) || defined(__DragonFly__)
+#include <libutil.h>
+#else
 #include <pty.h>
+#endif
 #include <sched.h>
+#include <spawn.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#if __has_include(<linux/sched.h>)
+#include <linux/sched.h>  // clone3() into a cgroup
+#endif
+#if NIMT_WITH_EPOLL
+#include <sys/epoll.h>
+#define HAVE_EPOLL 1
+#endif
+#if NIMT_WITH_URING && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#elif NIMT_WITH_EPOLL && (defined(__APPLE__) || defined(__FreeBSD__) || \
+      defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__))
+#include <sys/event.h>
+#define HAVE_KQUEUE 1
+#endif
+#include <sys/file.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // SIGPIPE is ignored instead, see daemon_loop()
+#define NEED_SIGPIPE_IGNORE 1
+#endif
+
 /**********************************************************************
  *                              CONSTANTS
  **********************************************************************/
+// Paths for the default daemon; daemon_paths() points them at another.
 static const char *SOCKET_PATH = "/tmp/nimt.sock";
-static const int MAX_ATTEMPTS = 5;
+static const char *LOCK_PATH = "/tmp/nimt.lock";  // held while starting the daemon
+static const char *STATE_DIR = "/tmp/nimt.state";  // one scrollback file per session
+static const char *RECORD_DIR = "/tmp/nimt.rec";    // session recordings
+#if NIMT_WITH_RECORD
+static const uint64_t RECORD_INDEX_US = 1000000;      // index at least every second...
+static const uint64_t RECORD_INDEX_BYTES = 256 * 1024;  // ... or this much output
+#endif
 static const unsigned int ATTACH_DETACH_KEY = 0x1D; // Ctrl-]
-static const char *CGROUP_PATH = "/sys/fs/cgroup/nimt/cgroup.procs";
-static const char *CGROUP_FOLDER = "/sys/fs/cgroup/nimt";
+static const char *CGROUP_PATH = "/sys/fs/cgroup/nimt/daemon/cgroup.procs";
+static const char *CGROUP_FOLDER = "/sys/fs/cgroup/nimt";  // sessions with limits get one each
+static const char *CGROUP_DAEMON = "/sys/fs/cgroup/nimt/daemon";  // the daemon and the rest
+static const size_t SCROLLBACK_DEFAULT = 64 * 1024;  // per-session ring size
+static const size_t SCROLLBACK_MIN = 4 * 1024;
+static const size_t SCROLLBACK_MAX = 64 * 1024 * 1024;
+static const int PTY_READS_PER_WAKEUP = 16;  // keep one chatty pty from hogging the loop
+static const size_t PTY_READ_MAX = 4096;     // all a pty hands out at once
+static const size_t SPLICE_CHUNK = 64 * 1024;
+static const size_t CONN_REPLY_LIMIT = 1024 * 1024;  // unread replies per client
+static const size_t INPUT_LIMIT = 1024 * 1024;       // OP_SEND input a pty may leave unread
+static const uint64_t COALESCE_US = 4000;          // min gap between output flushes under load
+static const size_t COALESCE_BYTES = 32 * 1024;    // ... unless this much is waiting
+static const size_t COLLAPSE_BYTES = 64 * 1024;    // backlog a repaint replaces, see session_notify()
+static const uint32_t SPAWN_BATCH_MAX = 4096;
+static const uint32_t POOL_MAX = 64;  // warm sessions per command template
+#if NIMT_WITH_SHARDS
+static const int SHARD_MAX = 256;     // NIMT_SHARDS limit
+#endif
+static const int CONN_JOBS_MAX = 64;  // requests a client may have in flight
+static const uint64_t RATE_BURST_US = 100000;  // output a capped session may save up
+static const uint64_t SHUTDOWN_STEP_US = 1000000;  // SIGTERM, SIGKILL, then exit anyway
+
+/**********************************************************************
+ *                              PROTOCOL
+ **********************************************************************/
+
+// Clients speak length-prefixed binary frames. The first byte of a
+// connection tells them apart from the old text commands (SPAWN, LIST,
+// KILL, ATTACH), which are still understood, one per connection.
+//
+// Every frame starts with a FrameHeader, integers in network byte
+// order. A request carries a client-chosen req_id that its reply
+// echoes, so a client may pipeline any number of requests on one
+// connection and match the replies in whatever order they arrive.
+// A reply's status is STATUS_OK, or STATUS_ERROR with an error message
+// as payload.
+//
+//   OP_SPAWN   u32 scrollback bytes (0: default), command line
+//              -> u32 session id
+//   OP_LIST    optional: u8 LIST_* flags, u8 state mask (LIST_RUNNING...,
+//              0: any), u32 min age, u32 max age (seconds, 0: any),
+//              substring of the command line
+//              -> u32 id, u32 pid for each matching session; with
+//              LIST_DETAIL a record each instead: u32 id, u32 pid, u8
+//              state, u32 clients, u64 spawned (Unix time), u64 output
+//              bytes, u16 length and the command line. LIST_WATCH then
+//              keeps the connection: each change to a session whose
+//              command matches sends a frame under the request's req_id,
+//              u8 WATCH_* and the session's record.
+//   OP_KILL    u32 id
+//   OP_ATTACH  u32 id, u8 AttachPolicy, u16 rows, u16 cols (0: keep),
+//              optional u8 ATTACH_* flags
+//              -> u8 flags granted; after the reply the connection
+//              carries raw terminal bytes both ways, output in
+//              COMPRESSION blocks if ATTACH_COMPRESS was granted;
+//              anything pipelined behind the ATTACH is input for the
+//              session.
+//   OP_SPAWN_BATCH  u32 scrollback, u32 count, command line
+//              -> u32 session id per spawn, 0 where it failed
+//   OP_KILL_BATCH   u32 first, u32 last for each ID range
+//              -> u32 id of every session signalled
+//   OP_POOL    u32 scrollback, u32 count, command line
+//              keep count idle sessions of that command ready for
+//              OP_SPAWN to hand out (0 drains the pool)
+//   OP_UPGRADE re-exec the daemon binary in place; sessions survive,
+//              connections do not
+//   OP_RECORD  u32 id, u8 on: start or stop recording the session's
+//              output to RECORD_DIR, see RECORDING below
+//   OP_SCREEN  u32 id, u8 on: keep the session's screen in a terminal
+//              emulator, so attaching repaints it instead of replaying
+//              the scrollback
+//   OP_STATS   optional u8 STATS_* flags -> counters in the Prometheus
+//              text format, see STATISTICS
+//   OP_SEND    u32 id, bytes: typed into the session as if by a client;
+//              an error, input full, while INPUT_LIMIT waits for the child
+//   OP_READ    u32 id, optional u64 offset (0: the oldest output kept)
+//              -> u64 offset of the first byte returned, later than
+//              asked for where the scrollback has moved on, u64 offset
+//              the output has reached, then the bytes from the one to
+//              the other, at most READ_MAX of them. Offsets count every
+//              byte the session ever wrote.
+//   OP_WAIT    u32 id, u32 timeout ms (0: none), u64 offset to look from
+//              (UINT64_MAX: only output still to come), pattern, see
+//              PATTERN MATCHING
+//              -> u64 offset just past the first match, once there is
+//              one; an error once the timeout is up or the session has
+//              exited without one
+//   OP_LIMIT   u32 id, u32 cpu percent, u32 memory KiB, u16 io weight,
+//              u32 output bytes/s, each 0 to leave as is: the first three
+//              move the child into a cgroup of its own, the last caps how
+//              fast its pty is read
+//   OP_SPAWN_LIMITED  u32 scrollback, u32 count, the limits as in OP_LIMIT,
+//              command line
+//              -> as OP_SPAWN_BATCH, or for a count of 1 as OP_SPAWN; each
+//              child starts in its cgroup, so nothing it forks escapes
+//              the limits. Warm pools are not drawn from.
+#define PROTO_MAGIC 0xA7    // never the first byte of a text command
+
+enum { FRAME_HEADER_SIZE = 12 };
+static const uint32_t FRAME_MAX_PAYLOAD = 1024 * 1024;
+static const uint32_t READ_MAX = 1024 * 1024 - 16;  // output per OP_READ reply
+enum { LIMITS_SIZE = 14 };  // the limits in OP_LIMIT and OP_SPAWN_LIMITED
+
+typedef enum {
+    OP_SPAWN = 1,
+    OP_LIST = 2,
+    OP_KILL = 3,
+    OP_ATTACH = 4,
+    OP_SPAWN_BATCH = 5,
+    OP_KILL_BATCH = 6,
+    OP_POOL = 7,
+    OP_UPGRADE = 8,
+    OP_RECORD = 9,
+    OP_SCREEN = 10,
+    OP_LIMIT = 11,
+    OP_STATS = 12,
+    OP_SEND = 13,
+    OP_READ = 14,
+    OP_WAIT = 15,
+    OP_SPAWN_LIMITED = 16,
+} Opcode;
+
+enum {
+    STATUS_OK = 0,
+    STATUS_ERROR = 1,
+};
+
+enum { ATTACH_COMPRESS = 1 };  // OP_ATTACH flags
+enum { STATS_SESSIONS = 1 };   // OP_STATS flags: a line set per session too
+enum { LIST_DETAIL = 1, LIST_WATCH = 2 };  // OP_LIST flags
+enum { LIST_RUNNING = 1, LIST_ATTACHED = 2, LIST_EXITED = 4 };  // session states
+enum { WATCH_SPAWNED = 1, WATCH_EXITED = 2, WATCH_ATTACHED = 3, WATCH_DETACHED = 4 };
+enum { LIST_RECORD = 31 };     // a LIST_DETAIL record bar the command
+
+typedef struct FrameHeader {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t status;    // replies only
+    uint32_t req_id;
+    uint32_t len;       // payload bytes that follow
+} FrameHeader;
+
+/**********************************************************************
+ *                            EVENT LOOP
+ **********************************************************************/
+
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_ERROR 0x4    // hangup/error, reported whatever the interest
+
+struct EvLoop;
+
+// Every descriptor the daemon waits on is embedded in one of these. The
+// loop hands the handle back on readiness and the owner's callback
+// advances its state machine. Owners set fd to -1 once it is closed.
+//
+// Descriptors are registered once, edge-triggered, for both directions.
+// The loop remembers which directions have fired (ready) and dispatches
+// those the owner currently wants (events). Owners must call ev_clear()
+// when a read or write hits EAGAIN; readiness that is left over is
+// dispatched again on the next turn. Urgent handles are dispatched
+// ahead of the rest of their turn.
+typedef struct EvHandle {
+    int fd;
+    unsigned events;    // EV_READ | EV_WRITE currently wanted
+    unsigned ready;     // directions that fired and were not drained
+    int queued;         // on the loop's pending list
+    int urgent;         // dispatched first, e.g. keystrokes ahead of bulk output
+    int slot;           // index into pollfds (poll backend only)
+    struct EvOps *ops;  // its io_uring operations (io_uring backend only)
+    struct EvLoop *loop;
+    void (*cb)(struct EvHandle *h, unsigned revents);
+} EvHandle;
+
+// Work handed to a loop's thread, possibly from another thread; tasks
+// run in the order they were posted.
+typedef struct EvTask {
+    void (*cb)(struct EvTask *t);
+    struct EvTask *next;
+} EvTask;
+
+// A one-shot deadline on the loop's clock (CLOCK_MONOTONIC microseconds).
+typedef struct EvTimer {
+    uint64_t when;
+    int index;          // position in the loop's heap, -1 when not armed
+    void (*cb)(struct EvTimer *t);
+} EvTimer;
+
+typedef enum {
+    EV_BACKEND_POLL,
+    EV_BACKEND_EPOLL,
+    EV_BACKEND_KQUEUE,
+    EV_BACKEND_URING,
+} EvBackend;
+
+typedef struct EvLoop {
+    EvBackend backend;
+    int fd;                     // epoll, kqueue or io_uring descriptor
+    struct EvUring *uring;      // io_uring backend: the mapped rings
+    struct pollfd *pollfds;     // poll backend: registered fds
+    EvHandle **pollhandles;     // ... and their owners
+    int npoll, pollcap;
+    EvHandle **pending;         // handles to dispatch this turn
+    int npending, pendingcap;
+    void **garbage;             // slab objects freed once the turn is dispatched
+    int ngarbage, garbagecap;
+    EvTimer **timers;           // binary min-heap on when
+    int ntimers, timercap;
+    pthread_mutex_t task_lock;  // guards tasks, the only shared part
+    EvTask *tasks, **task_tail; // posted, not run yet
+    int wake[2];                // pipe a post wakes the loop with
+    EvHandle wake_ev;
+} EvLoop;
+
+#define CONTAINER_OF(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
 
 /**********************************************************************
- *                           SESSION STRUCT
+ *                          BUFFERS & STRUCTS
  **********************************************************************/
 
+enum { SLAB_PAGE = 128 * 1024, SLAB_HEADER = 64 };
+
+// Fixed-size objects carved out of SLAB_PAGE-aligned mappings, see
+// MEMORY. The page header sits at the start of the mapping, so an
+// object finds its page by rounding its address down.
+typedef struct SlabPage {
+    struct Slab *slab;
+    struct SlabPage *next, *prev;   // on the slab's partial list
+    void *free;         // chain of free objects
+    unsigned used;      // objects handed out
+} SlabPage;
+
+typedef struct Slab {
+    size_t size;        // object size
+    pthread_mutex_t lock;  // objects are freed by other threads
+    SlabPage *partial;  // pages with a free object
+    SlabPage *spare;    // an empty page kept for the next one
+    size_t objects;     // handed out
+} Slab;
+
+#define SLAB_INIT(size) {(size), PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0}
+
+// Growable byte queue: data[off..len) is pending.
+typedef struct Buf {
+    char *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+} Buf;
+
+// Header page of a scrollback file in STATE_DIR, followed by the ring
+// itself. The files double as the session journal: a restarted daemon
+// finds every session it had in them.
+typedef struct RingFile {
+    uint32_t magic;
+    uint32_t id;        // session ID, 0 while idle in a pool
+    int32_t pid;        // child_pid
+    int32_t master_fd;  // pty master, recorded only across an upgrade
+    uint64_t size;
+    uint64_t head;      // mirrors Ring.head
+    char name[32];      // file name within STATE_DIR
+    uint32_t screen;    // the session keeps a Vt
+    uint32_t rate;      // Session.rate
+    uint32_t cgroup;    // Session.cgroup
+    uint64_t started;   // Session.started
+    char command[256];  // Session.command, cut short
+} RingFile;
+
+#define RING_FILE_MAGIC 0x6e696d74  // "nimt"
+enum { RING_FILE_HEADER = 4096 };
+
+// Scrollback: a power-of-two ring the pty is read straight into. head
+// counts every byte ever written, so readers keep absolute offsets and
+// can tell by how much they have been lapped.
+typedef struct Ring {
+    char *data;
+    size_t size;
+    uint64_t head;
+    size_t reserved;    // past head, what a read with the kernel may write
+    RingFile *file;     // mapped file, NULL for a heap ring
+} Ring;
+
+// Output recording of one session, see RECORDING.
+typedef struct Recording {
+    int fd;             // <id>.nrec, the frames
+    int index_fd;       // <id>.nidx, the index
+    uint64_t start_us;  // monotonic clock when recording started
+    uint64_t off;       // bytes written to fd
+    uint64_t index_t;   // last indexed frame
+    uint64_t index_off;
+    uint32_t nindex;
+} Recording;
+
+// One character cell of an emulated screen.
+typedef struct VtCell {
+    uint32_t ch;        // code point, 0 if never written
+    uint16_t fg, bg;    // 0: default, else palette index + 1
+    uint8_t attr;       // VT_BOLD...
+} VtCell;
+
+enum { VT_BOLD = 1, VT_DIM = 2, VT_ITALIC = 4, VT_UNDERLINE = 8, VT_REVERSE = 16 };
+enum { VT_MAX_PARAMS = 16 };
+
+// Screen state of a session, see TERMINAL EMULATOR.
+typedef struct Vt {
+    int rows, cols;
+    VtCell *grid;       // grids[alt]
+    VtCell *grids[2];   // main and alternate screen
+    int alt;
+    int row, col;       // cursor
+    int wrap_pending;   // the last column was written: wrap first
+    int top, bottom;    // scrolling region, inclusive
+    VtCell pen;         // style for new characters
+    int saved_row, saved_col;
+    VtCell saved_pen;
+    int cursor_hidden, autowrap_off, graphics;
+    // parser
+    int state;
+    int params[VT_MAX_PARAMS], nparams, param_started;
+    int private_mark, intermediate, charset_target;
+    uint32_t utf8;
+    int utf8_left;
+} Vt;
+
+// A state of a compiled pattern, see PATTERN MATCHING.
+typedef struct PatState {
+    uint8_t op;         // PAT_BYTE...
+    int out, out1;      // next states, -1 for none
+    uint32_t set[8];    // PAT_BYTE: the bytes it takes
+} PatState;
+
+// An OP_WAIT pattern and how far a match has got: the states it may be
+// in after the output seen so far.
+typedef struct Pattern {
+    PatState *states;
+    int nstates, cap;
+    int start;
+    int *list, *next;   // live states, and the ones the next byte leads to
+    int nlist;
+    uint32_t *mark;     // per state: generation of the list it was last added to
+    uint32_t gen;
+    int bol;            // the last byte ended a line
+    int matched;
+} Pattern;
+
+enum {
+    LZ_WINDOW = 64 * 1024,      // history matches may reach back into
+    LZ_BLOCK = 64 * 1024,       // max raw bytes per block
+    LZ_HASH_LOG = 14,
+    LZ_MIN_MATCH = 4,
+};
+
+// One direction of a compressed attach stream, see COMPRESSION: the
+// history both ends keep alike, and (compressing end) hash chains
+// through it of where each 4-byte prefix was seen.
+typedef struct Lz {
+    char hist[LZ_WINDOW + LZ_BLOCK];
+    size_t len;
+    uint32_t table[1 << LZ_HASH_LOG];  // position + 1, 0 for none
+    uint16_t chain[LZ_WINDOW + LZ_BLOCK];  // distance to the previous
+                                           // position of that hash, 0: none
+} Lz;
+
+enum { HIST_BUCKETS = 8 };
+
+// Observations up to each of HIST_BUCKETS - 1 bounds, and above.
+typedef struct Histogram {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t sum;
+} Histogram;
+
+// Counters of one thread, see STATISTICS. Only uint64_t: they are
+// summed across threads as an array.
+typedef struct Stats {
+    uint64_t pty_reads, pty_bytes;  // output read from ptys
+    uint64_t input_bytes;       // keystrokes for ptys
+    uint64_t relay_bytes;       // scrollback sent to attached clients
+    uint64_t dropped_bytes;     // ... and skipped for those that fell behind
+    uint64_t conns;             // connections open
+    uint64_t attached;          // ... of them attached
+    uint64_t hibernating;       // sessions asleep, see HIBERNATION
+    uint64_t packed_bytes;      // ... and their compressed scrollback
+    Histogram read_size;        // bytes per pty read
+    Histogram relay_latency;    // pty read to socket, microseconds
+    Histogram spawn_time;       // spawn request to reply, microseconds
+} Stats;
+
+struct Conn;
+struct Pool;
+
+// A thread with an event loop and the connections it serves: the main
+// thread, each I/O shard and the spawner, see SHARDS.
+typedef struct Shard {
+    EvLoop loop;
+    struct Conn *conns;
+    pthread_t thread;
+    int stop;           // leave the loop after this turn
+    EvTask stop_task;
+    int sessions;       // sessions served (kept by the main thread)
+    Stats stats;        // kept by the thread itself
+} Shard;
+
 typedef struct Session {
-    int id;             // session ID
+    int id;             // session ID, 0 while idle in a warm pool
     pid_t child_pid;    // child running in the pty
     int master_fd;      // pty master FD
-    struct Session *next;
+    EvHandle ev;        // master_fd in the event loop
+    Ring scrollback;    // recent pty output, drained whether attached or not
+    uint64_t notified;  // scrollback head last pushed to subscribers
+    uint64_t last_notify;       // ... and when
+    EvTimer notify_timer;       // pending coalesced push
+    int keystroke;              // input went in since: push the echo at once
+    Buf input;          // client keystrokes the pty did not accept yet
+    struct Conn *subscribers;   // attached clients
+    struct Pool *pool;          // warm pool holding this idle session
+    struct Session *pool_next;  // next idle session of the same pool
+    Recording *rec;             // NULL unless output is being recorded
+    Vt *vt;                     // NULL unless the screen is emulated
+    Shard *shard;               // the thread serving this session
+    EvTask start, setup, teardown, shrink;  // posted to it, see SHARDS
+    size_t ring_size;           // scrollback size the main thread asked for
+    uint32_t rate;              // output cap in bytes per second, 0 for none
+    uint64_t credit;            // output the cap allows now, in millionths of a byte
+    uint64_t credited;          // ... as of then
+    EvTimer rate_timer;         // resumes reading once the cap allows
+    uint32_t cgroup;            // the child's own cgroup, see cgroup_make(); 0 for none
+    uint64_t input_bytes;       // keystrokes from clients, see STATISTICS
+    uint64_t dropped;           // output subscribers skipped
+    uint64_t attached;          // subscribers
+    uint64_t output_since;      // when output not pushed yet came in
+    char *command;              // as spawned, NULL if not known (main thread)
+    uint64_t started;           // when handed out, Unix time
+    struct Wait *waits;         // OP_WAITs on its output
+    EvTimer idle_timer;         // looks for idleness, see HIBERNATION
+    uint64_t idle_head;         // scrollback head as of its last look
+    int hibernating;            // HIBERNATE_* put away
+    Buf packed;                 // scrollback from packed_from on, compressed
+    uint64_t packed_from;
+    pid_t stopped_pgrp;         // foreground group stopped too, 0 if none
 } Session;
 
+// Idle sessions kept running for one command template. spawn_request()
+// hands them out and the daemon loop tops the pool back up between
+// turns, after the reply has gone out.
+typedef struct Pool {
+    char *command;
+    size_t scrollback;
+    uint32_t target;    // idle sessions to keep
+    uint32_t idle;      // length of the sessions list
+    uint32_t spawning;  // on their way from the spawner
+    Session *sessions;
+    struct Pool *next;
+} Pool;
+
+// Session IDs index a dense slot array; freed slots are chained through
+// next_free and reused most recently freed first.
+typedef struct SessionSlot {
+    Session *session;
+    int next_free;      // index of the next free slot, -1 ends the list
+} SessionSlot;
+
+// What happens to an attached client the pty output is about to lap.
+typedef enum {
+    POLICY_BLOCK,       // pause the pty until the client catches up
+    POLICY_DROP,        // skip the client ahead to the oldest byte kept
+    POLICY_DISCONNECT,  // hang up on the client
+} AttachPolicy;
+
+typedef enum {
+    PROTO_UNKNOWN,      // nothing received yet
+    PROTO_TEXT,         // legacy one-command-per-connection text
+    PROTO_BINARY,       // framed, pipelined requests
+} ConnProto;
+
+typedef enum {
+    CONN_COMMAND,       // waiting for requests
+    CONN_ATTACHED,      // relaying to/from a session
+    CONN_WATCHING,      // sent session changes, see OP_LIST
+    CONN_CLOSING,       // flushing the reply, then close
+} ConnState;
+
+// What an OP_LIST asks for.
+typedef struct ListFilter {
+    uint8_t states;     // LIST_RUNNING... mask, 0 for any
+    uint32_t min_age, max_age;  // seconds since spawned, 0 for no bound
+    uint32_t req_id;    // what a watch's frames carry
+    char command[256];  // substring of the command line, "" for any
+} ListFilter;
+
+// One accepted client connection.
+typedef struct Conn {
+    EvHandle ev;
+    ConnState state;
+    ConnProto proto;
+    Buf in;             // request bytes not processed yet
+    Session *session;   // attached session (CONN_ATTACHED)
+    uint64_t cursor;    // next scrollback byte to send (CONN_ATTACHED)
+    AttachPolicy policy;
+    Lz *lz;             // output compressor (ATTACH_COMPRESS)
+    struct Conn *sub_next;  // next subscriber of the same session
+    Buf out;            // replies not yet accepted by the socket
+    int jobs;           // requests being served by another thread
+    int spawns;         // of those, the ones queued on the spawner
+    struct Wait *waits; // of those, the OP_WAITs
+    int eof;            // the client is done sending
+    Shard *shard;       // the thread serving this connection
+    ListFilter *watch;  // CONN_WATCHING: what it watches
+    struct Conn *watch_next;
+    struct Conn *next;
+} Conn;
+
+// Spawns for one request or pool top-up, run by the spawner thread; the
+// main thread turns the children into sessions, see spawn_request().
+typedef struct Spawned {
+    pid_t pid;          // -1 if the spawn failed
+    int master_fd;
+    uint32_t cgroup;    // Session.cgroup
+    int id;             // session ID handed out, 0 if none
+} Spawned;
+
+// What OP_LIMIT and OP_SPAWN_LIMITED ask for, 0 for each left alone.
+typedef struct Limits {
+    uint32_t cpu;       // percent of one CPU
+    uint64_t memory;    // bytes
+    uint32_t io;        // weight
+    uint32_t rate;      // output bytes/s
+} Limits;
+
+typedef struct SpawnJob {
+    EvTask task;
+    Conn *conn;         // waiting for the reply, NULL for a pool
+    FrameHeader req;    // the request; opcode 0 for a text SPAWN
+    Pool *pool;         // topped up instead of replying
+    size_t scrollback;
+    Limits limits;      // each child starts under these
+    uint32_t count;
+    uint32_t taken;     // spawns[0, taken) came out of a warm pool
+    int err;            // errno of the last failed spawn
+    int async;          // conn counts it in jobs
+    uint64_t start_us;  // when the request came in
+    Spawned *spawns;
+    char command[4096];
+} SpawnJob;
+
+// Hands a connection to the shard of the session it attaches to.
+typedef struct AttachOp {
+    EvTask task;
+    Session *session;
+    int fd;
+    ConnProto proto;
+    Buf in, out;        // taken over from the main thread's Conn
+    FrameHeader req;    // unused for a text ATTACH
+    AttachPolicy policy;
+    struct winsize ws;
+    int flags;
+} AttachOp;
+
+// Toggles recording or the screen on a session's shard. Recording can
+// fail, so its reply goes out from the main thread once it is done.
+typedef struct SessionOp {
+    EvTask task;
+    Session *session;
+    int on;
+    uint32_t rate;      // OP_LIMIT output cap
+    uint64_t offset;    // OP_READ from here
+    Buf data;           // OP_SEND input, OP_READ reply
+    int err;
+    Conn *conn;
+    FrameHeader req;
+    int async;          // conn counts it in jobs
+} SessionOp;
+
+// An OP_WAIT, kept by the session's shard until its pattern turns up in
+// the output. The reply always goes out from the main thread, in a later
+// turn, so conn counts it in jobs even when unsharded.
+typedef struct Wait {
+    EvTask task;
+    EvTask cancel;      // its client went away, see wait_cancel()
+    Session *session;
+    Shard *shard;       // the session's, for the main thread
+    Pattern pat;
+    uint64_t offset;    // output matched so far, from the offset asked for
+    uint32_t timeout_ms;        // 0 for none
+    EvTimer timer;
+    const char *err;    // why it gave up, NULL for a match
+    Conn *conn;
+    FrameHeader req;
+    int waiting;        // on the session's list (its shard)
+    int cancelled;      // the cancel is on its way back (main thread)
+    struct Wait *next;  // next on the session
+    struct Wait *conn_next;     // next of the client's (main thread)
+} Wait;
+
+// An attach or detach seen on a shard, for the main thread's watchers.
+typedef struct WatchEvent {
+    EvTask task;
+    Session *session;
+    int id;
+    uint8_t event;      // WATCH_ATTACHED or WATCH_DETACHED
+} WatchEvent;
+
 /**********************************************************************
  *                  GLOBALS FOR THE DAEMON
  **********************************************************************/
 
-static Session *g_sessions = NULL;    // linked list of sessions
-static int g_next_session_id = 1;     // simplistic ID generator
+static SessionSlot *g_slots = NULL;   // session ID n lives in g_slots[n - 1]
+static int g_nslots, g_slotcap;
+static int g_free_slot = -1;          // head of the free slot list
+static Session **g_pid_table = NULL;  // open-addressed child_pid -> session
+static size_t g_pid_cap;              // power of two
+static size_t g_pid_count;
 static int g_server_sock = -1;        // the daemon's listening socket
-static int g_sigchld_pipe[2];         // Self-pipe for SIGCHLD handling
+static int g_signal_pipe[2];          // self-pipe: the signals the daemon handles
+static EvHandle g_server_ev;          // g_server_sock in the event loop
+static EvHandle g_signal_ev;          // g_signal_pipe[0] in the event loop
+static int g_shutdown;                // steps shutdown_begin() has taken, 0 if running
+static EvTimer g_shutdown_timer;      // the next step
+static Pool *g_pools = NULL;          // warm session pools
+static int g_pools_short;             // some pool is below its target
+#if NIMT_WITH_STATE
+static int g_state_dir = -1;          // STATE_DIR, -1 keeps scrollback on the heap
+#else
+static const int g_state_dir = -1;    // scrollback always on the heap
+#endif
+static int g_upgrade_pending;         // re-exec once the turn is over
+static char g_exe[4096];              // binary to re-exec on upgrade
+static const char *g_argv0;
+#if NIMT_WITH_RECORD
+static int g_record_dir = -1;         // RECORD_DIR, opened on first use
+#endif
+static int g_record_all;              // NIMT_RECORD: record every new session
+static int g_screen_all;              // NIMT_SCREEN: emulate every new screen
+static Conn *g_watchers;              // CONN_WATCHING connections
+static int g_nwatchers;               // ... how many, read by shards too
+
+static Shard g_main;                  // listens, answers requests, reaps
+static Shard *g_shards;               // NIMT_SHARDS I/O threads, if any
+#if NIMT_WITH_SHARDS
+static int g_nshards;
+#else
+static const int g_nshards = 0;       // folds every shard path away
+#endif
+static Shard g_spawner;               // spawns while g_nshards > 0
+
+static Slab g_session_slab = SLAB_INIT(sizeof(Session));
+static Slab g_conn_slab = SLAB_INIT(sizeof(Conn));
+static Slab g_buf_slabs[] = {SLAB_INIT(4096), SLAB_INIT(8192), SLAB_INIT(16384)};
+static size_t g_mem_used;             // bytes in slabs, buffers and scrollback
+static size_t g_mem_budget;           // NIMT_MEMORY, 0 for no limit
+#if NIMT_WITH_HIBERNATE
+static uint64_t g_hibernate_us;       // NIMT_HIBERNATE, 0 for never
+static int g_hibernate_stop;          // NIMT_HIBERNATE_STOP
+#else
+static const uint64_t g_hibernate_us = 0;
+static const int g_hibernate_stop = 0;
+#endif
+static int g_mem_shrinks;             // scrollback shrinks posted, not done yet
+static int g_mem_exhausted;           // every ring is down to SCROLLBACK_MIN
+static int g_spawns_queued;           // spawn jobs with the spawner thread
 
 /**********************************************************************
  *                           UTIL FUNCTIONS
@@ -96,6 +824,69 @@ int mkdirp(const char *folder) {
     return 0;
 }
 
+#if NIMT_WITH_STATE || NIMT_WITH_RECORD
+// Create (if need be) and open a directory only we may enter.
+static int open_private_dir(const char *path) {
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) return -1;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) fchmod(fd, 0700);  // mkdir's mode went through the umask
+    return fd;
+}
+#endif
+
+// Point the paths of CONSTANTS at one daemon. where is a name ("ci"
+// makes nimt-ci.sock, nimt-ci.state and so on), a socket path to put
+// them beside, or NULL for the default daemon. Names live in
+// $XDG_RUNTIME_DIR if there is one, /tmp otherwise. The cgroup is named
+// after the socket, and after the user too unless that is root, so no
+// two daemons share a subtree.
+static void daemon_paths(const char *where) {
+    static char sock[108], lock[128], state[128], rec[128];
+    static char folder[192], daemon[200], procs[216];
+    char prefix[96];
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !*dir) dir = "/tmp";
+    int n;
+    if (where && strchr(where, '/')) {
+        size_t len = strlen(where);
+        if (len > 5 && strcmp(where + len - 5, ".sock") == 0) len -= 5;
+        n = snprintf(prefix, sizeof(prefix), "%.*s", (int)len, where);
+    } else if (where && *where) {
+        n = snprintf(prefix, sizeof(prefix), "%s/nimt-%s", dir, where);
+    } else {
+        n = snprintf(prefix, sizeof(prefix), "%s/nimt", dir);
+    }
+    if (n < 0 || (size_t)n >= sizeof(prefix)) {
+        fprintf(stderr, "Error: socket path too long\n");
+        exit(1);
+    }
+    snprintf(sock, sizeof(sock), "%s.sock", prefix);
+    snprintf(lock, sizeof(lock), "%s.lock", prefix);
+    snprintf(state, sizeof(state), "%s.state", prefix);
+    snprintf(rec, sizeof(rec), "%s.rec", prefix);
+    const char *base = strrchr(prefix, '/');
+    base = base ? base + 1 : prefix;
+    if (getuid() == 0)
+        snprintf(folder, sizeof(folder), "/sys/fs/cgroup/%s", base);
+    else
+        snprintf(folder, sizeof(folder), "/sys/fs/cgroup/%s-%u", base, (unsigned)getuid());
+    snprintf(daemon, sizeof(daemon), "%s/daemon", folder);
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", daemon);
+    SOCKET_PATH = sock;
+    LOCK_PATH = lock;
+    STATE_DIR = state;
+    RECORD_DIR = rec;
+    CGROUP_FOLDER = folder;
+    CGROUP_DAEMON = daemon;
+    CGROUP_PATH = procs;
+}
+
+static uint64_t now_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 // Print an error message and exit
 static void perror_exit(const char *msg) {
     perror(msg);
@@ -117,433 +908,6399 @@ static int write_all(int fd, const void *buf, size_t count) {
     return 0;
 }
 
-// Add a session to the global list
-static Session *add_session(pid_t child_pid, int master_fd) {
-    Session *s = (Session *)malloc(sizeof(Session));
-    if (!s) perror_exit("malloc");
-    s->id = g_next_session_id++;
-    s->child_pid = child_pid;
-    s->master_fd = master_fd;
-    s->next = g_sessions;
-    g_sessions = s;
-    return s;
+static void set_nonblock_cloexec(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
 }
 
-// Find a session by ID
-static Session *find_session(int id) {
-    Session *p = g_sessions;
-    while (p) {
-        if (p->id == id) return p;
-        p = p->next;
-    }
-    return NULL;
+// The cgroup a session's child gets to itself, see cgroup_make().
+static void cgroup_session_dir(uint32_t cgroup, char *dir, size_t size) {
+    snprintf(dir, size, "%s/g%u", CGROUP_FOLDER, cgroup);
 }
 
-// Remove a session from the list (and free it)
-static void remove_session(Session *s) {
-    Session **pp = &g_sessions;
-    while (*pp) {
-        if (*pp == s) {
-            *pp = s->next;
-            close(s->master_fd);
-            free(s);
-            return;
-        }
-        pp = &((*pp)->next);
-    }
+// Write a value to one of a cgroup's interface files.
+static int cgroup_write(const char *dir, const char *file, const char *value) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = write_all(fd, value, strlen(value));
+    close(fd);
+    return rc;
 }
 
-// Function to move the daemon process to the parent cgroup
-static void move_self_to_parent_cgroup(void) {
-    // The parent cgroup is typically the root: /sys/fs/cgroup/
-    const char *parent_procs = "/sys/fs/cgroup/cgroup.procs";
-    int fd = open(parent_procs, O_WRONLY);
-    if (fd < 0) {
-        perror("open parent cgroup.procs");
-        return;
-    }
-    char pid_str[32];
-    snprintf(pid_str, sizeof(pid_str), "%d", getpid());
-    if (write(fd, pid_str, strlen(pid_str)) < 0) {
-        perror("write to parent cgroup.procs");
-    }
-    close(fd);
+// Parse a byte count with an optional K, M or G suffix.
+static size_t parse_size(const char *str) {
+    char *end;
+    unsigned long long n = strtoull(str, &end, 10);
+    if (*end == 'k' || *end == 'K') n <<= 10;
+    else if (*end == 'm' || *end == 'M') n <<= 20;
+    else if (*end == 'g' || *end == 'G') n <<= 30;
+    return (size_t)n;
 }
 
-static void cleanup_resources(void) {
-    Session *p = g_sessions;
-    while (p) {
-        kill(p->child_pid, SIGKILL);
-        close(p->master_fd);
-        Session *temp = p;
-        p = p->next;
-        free(temp);
-    }
-    g_sessions = NULL;
+/**********************************************************************
+ *                               MEMORY
+ **********************************************************************/
 
-    // Wait for all child processes to exit.
-    while (1) {
-        int status;
-        pid_t pid = waitpid(-1, &status, WNOHANG);
-        if (pid > 0) {
-            continue;
-        } else if (pid == 0) {
-            usleep(100000);
-            continue;
-        } else {
-            if (errno == ECHILD)
-                break;
-            else
-                break;
-        }
-    }
+// Sessions, connections and buffers up to SLAB_CLASS_MAX come out of
+// slabs: whole pages mapped for one object size, so thousands of them
+// neither fragment the heap nor pay a malloc header each, and pages
+// that empty out go back to the kernel. Larger blocks, scrollback
+// rings included, are mappings of their own. All of it is counted in
+// g_mem_used; with NIMT_MEMORY set, the daemon loop shrinks the
+// largest scrollback rings once it goes over, see mem_reclaim().
 
-    if (g_server_sock != -1) {
-        close(g_server_sock);
-        unlink(SOCKET_PATH);
-        g_server_sock = -1;
-    }
+enum { SLAB_CLASS_MAX = 16384 };
 
-    close(g_sigchld_pipe[0]);
-    close(g_sigchld_pipe[1]);
+static void mem_account(size_t n, int sign) {
+    if (sign > 0) __atomic_add_fetch(&g_mem_used, n, __ATOMIC_RELAXED);
+    else __atomic_sub_fetch(&g_mem_used, n, __ATOMIC_RELAXED);
+}
 
-    move_self_to_parent_cgroup();
+static size_t mem_used(void) {
+    return __atomic_load_n(&g_mem_used, __ATOMIC_RELAXED);
+}
 
-    if (rmdir(CGROUP_FOLDER) != 0) {
-        perror("rmdir CGROUP_FOLDER");
-    }
+static size_t mem_round(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
 }
 
+// A SLAB_PAGE-aligned page: map twice the size and trim.
+static SlabPage *slab_page_new(Slab *slab) {
+    char *p = mmap(NULL, 2 * SLAB_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) perror_exit("mmap");
+    char *page = (char *)(((uintptr_t)p + SLAB_PAGE - 1) & ~(uintptr_t)(SLAB_PAGE - 1));
+    if (page > p) munmap(p, page - p);
+    if (page < p + SLAB_PAGE) munmap(page + SLAB_PAGE, p + SLAB_PAGE - page);
+    mem_account(SLAB_PAGE, 1);
 
-static void sigterm_handler(int signo) {
-    (void)signo;  // Unused parameter.
-    cleanup_resources();
-    exit(0);
+    SlabPage *pg = (SlabPage *)page;
+    pg->slab = slab;
+    pg->used = 0;
+    pg->free = NULL;
+    size_t n = (SLAB_PAGE - SLAB_HEADER) / slab->size;
+    for (size_t i = n; i-- > 0;) {
+        void **obj = (void **)(page + SLAB_HEADER + i * slab->size);
+        *obj = pg->free;
+        pg->free = obj;
+    }
+    return pg;
 }
 
-// Add signal handlers for SIGTERM and SIGINT
-static void setup_signal_handlers(void) {
-    struct sigaction sa_term;
-    memset(&sa_term, 0, sizeof(sa_term));
-    sa_term.sa_handler = sigterm_handler;
-    sa_term.sa_flags = SA_RESTART;
-    sigaction(SIGTERM, &sa_term, NULL);
-    sigaction(SIGINT, &sa_term, NULL);
+static void slab_link(Slab *slab, SlabPage *pg) {
+    pg->prev = NULL;
+    pg->next = slab->partial;
+    if (pg->next) pg->next->prev = pg;
+    slab->partial = pg;
 }
 
-/**********************************************************************
- *                  HANDLING CHILD EXIT (SIGCHLD)
- **********************************************************************/
-static void sigchld_handler(int signo) {
-    (void)signo;
-    // Notify main loop via self-pipe
-    char c = 1;
-    if (write(g_sigchld_pipe[1], &c, 1) < 0) {
-        // Ignore errors
-    }
+static void slab_unlink(Slab *slab, SlabPage *pg) {
+    if (pg->prev) pg->prev->next = pg->next;
+    else slab->partial = pg->next;
+    if (pg->next) pg->next->prev = pg->prev;
 }
 
-static void handle_sigchld(void) {
-    int status;
-    pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        Session *p = g_sessions;
-        while (p) {
-            if (p->child_pid == pid) {
-                remove_session(p);
-                break;
-            }
-            p = p->next;
-        }
+static void *slab_alloc(Slab *slab) {
+    pthread_mutex_lock(&slab->lock);
+    SlabPage *pg = slab->partial;
+    if (!pg) {
+        pg = slab->spare ? slab->spare : slab_page_new(slab);
+        slab->spare = NULL;
+        slab_link(slab, pg);
     }
+    void **obj = pg->free;
+    pg->free = *obj;
+    pg->used++;
+    if (!pg->free) slab_unlink(slab, pg);
+    slab->objects++;
+    pthread_mutex_unlock(&slab->lock);
+    return obj;
 }
 
-/**********************************************************************
- *                     DAEMON COMMAND HANDLERS
- **********************************************************************/
-
-static void handle_spawn(int client_sock, char *cmdline) {
-    char *command_str = cmdline;
-    while (*command_str == ' ') command_str++;
-    if (*command_str == '\0') command_str = "bash";
-
-    int master_fd;
-    pid_t child_pid;
-    struct winsize ws = {24, 80, 0, 0};
-    child_pid = forkpty(&master_fd, NULL, NULL, &ws);
-    if (child_pid < 0) {
-        dprintf(client_sock, "ERROR forkpty: %s\n", strerror(errno));
-        return;
-    }
+static void *slab_calloc(Slab *slab) {
+    void *p = slab_alloc(slab);
+    memset(p, 0, slab->size);
+    return p;
+}
 
-    if (child_pid == 0) {
-        char *shell = getenv("SHELL");
-        if (!shell || !*shell) {
-            shell = "/bin/sh";
+// Return an object to its slab, from any thread. Of the pages it
+// empties one is kept, the rest are unmapped.
+static void slab_free(void *p) {
+    if (!p) return;
+    SlabPage *pg = (SlabPage *)((uintptr_t)p & ~(uintptr_t)(SLAB_PAGE - 1));
+    Slab *slab = pg->slab;
+    pthread_mutex_lock(&slab->lock);
+    if (!pg->free) slab_link(slab, pg);
+    *(void **)p = pg->free;
+    pg->free = p;
+    pg->used--;
+    slab->objects--;
+    if (pg->used == 0) {
+        slab_unlink(slab, pg);
+        if (slab->spare) {
+            munmap(pg, SLAB_PAGE);
+            mem_account(SLAB_PAGE, -1);
+        } else {
+            slab->spare = pg;
         }
-        signal(SIGHUP, SIG_IGN);
-        setsid();
-        execl(shell, "sh", "-c", command_str, (char *)NULL);
-        _exit(127);
     }
+    pthread_mutex_unlock(&slab->lock);
+}
 
-    Session *s = add_session(child_pid, master_fd);
-    dprintf(client_sock, "OK %d\n", s->id);
+// Memory for size bytes; the caller passes the same size to
+// mem_free(). Large blocks are fresh mappings, hence zero-filled.
+static void *mem_alloc(size_t size) {
+    for (size_t i = 0; i < sizeof(g_buf_slabs) / sizeof(g_buf_slabs[0]); i++)
+        if (size <= g_buf_slabs[i].size) return slab_alloc(&g_buf_slabs[i]);
+    size = mem_round(size);
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) perror_exit("mmap");
+    mem_account(size, 1);
+    return p;
 }
 
-static void handle_list(int client_sock) {
-    Session *p = g_sessions;
-    while (p) {
-        dprintf(client_sock, "SESSION %d pid=%d\n", p->id, p->child_pid);
-        p = p->next;
-    }
-    dprintf(client_sock, "DONE\n");
+#if NIMT_WITH_COMPRESS
+static void *mem_calloc(size_t size) {
+    void *p = mem_alloc(size);
+    if (size <= SLAB_CLASS_MAX) memset(p, 0, size);
+    return p;
 }
+#endif
 
-static void handle_kill(int client_sock, int session_id) {
-    Session *s = find_session(session_id);
-    if (!s) {
-        dprintf(client_sock, "ERROR no such session\n");
+static void mem_free(void *p, size_t size) {
+    if (!p) return;
+    if (size <= SLAB_CLASS_MAX) {
+        slab_free(p);
         return;
     }
-    kill(s->child_pid, SIGKILL);
-    dprintf(client_sock, "OK killing session %d\n", session_id);
+    size = mem_round(size);
+    munmap(p, size);
+    mem_account(size, -1);
 }
 
-static void handle_attach(int client_sock, int session_id) {
-    Session *s = find_session(session_id);
-    if (!s) {
-        dprintf(client_sock, "ERROR no such session\n");
-        return;
-    }
-    dprintf(client_sock, "OK ATTACH\n");
+/**********************************************************************
+ *                           BUFFER FUNCTIONS
+ **********************************************************************/
 
-    struct winsize ws;
-    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0) {
-        ioctl(s->master_fd, TIOCSWINSZ, &ws);
-    }
+static void ev_clear(EvHandle *h, unsigned bits);
 
-    while (1) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(client_sock, &rfds);
-        FD_SET(s->master_fd, &rfds);
-        int maxfd = (client_sock > s->master_fd) ? client_sock : s->master_fd;
+static size_t buf_pending(const Buf *b) {
+    return b->len - b->off;
+}
 
-        int rv = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-        if (rv < 0) {
-            if (errno == EINTR) continue;
-            break;
+static void buf_append(Buf *b, const void *data, size_t n) {
+    if (b->off == b->len) b->off = b->len = 0;
+    if (b->len + n > b->cap) {
+        if (b->off > 0) {
+            memmove(b->data, b->data + b->off, b->len - b->off);
+            b->len -= b->off;
+            b->off = 0;
+        }
+        if (b->len + n > b->cap) {
+            size_t cap = b->cap ? b->cap : 4096;
+            while (cap < b->len + n) cap *= 2;
+            char *p = mem_alloc(cap);
+            if (b->len) memcpy(p, b->data, b->len);
+            mem_free(b->data, b->cap);
+            b->data = p;
+            b->cap = cap;
         }
+    }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
 
-        if (FD_ISSET(client_sock, &rfds)) {
-            char buf[4096];
-            ssize_t n = read(client_sock, buf, sizeof(buf));
-            if (n <= 0) break;
+static void buf_free(Buf *b) {
+    mem_free(b->data, b->cap);
+    memset(b, 0, sizeof(*b));
+}
 
-            for (int i = 0; i < n; i++) {
-                if ((unsigned char)buf[i] == ATTACH_DETACH_KEY) {
-                    if (i > 0) write_all(s->master_fd, buf, i);
-                    goto detach;
-                }
-            }
-            write_all(s->master_fd, buf, n);
-        }
+#if NIMT_WITH_HIBERNATE
+// Give back the room past the buffer's bytes, for one kept a long time.
+static void buf_trim(Buf *b) {
+    size_t n = buf_pending(b);
+    char *p = n ? mem_alloc(n) : NULL;
+    if (n) memcpy(p, b->data + b->off, n);
+    mem_free(b->data, b->cap);
+    b->data = p;
+    b->off = 0;
+    b->len = b->cap = n;
+}
+#endif
 
-        if (FD_ISSET(s->master_fd, &rfds)) {
-            char buf[4096];
-            ssize_t n = read(s->master_fd, buf, sizeof(buf));
-            if (n <= 0) break;
-            write_all(client_sock, buf, n);
+// Write as much of the buffer as the handle's fd takes without
+// blocking. Returns -1 on a hard error, 0 otherwise.
+static int buf_flush(Buf *b, EvHandle *h, int is_socket) {
+    while (b->off < b->len) {
+        ssize_t n;
+        if (is_socket)
+            n = send(h->fd, b->data + b->off, b->len - b->off, MSG_NOSIGNAL);
+        else
+            n = write(h->fd, b->data + b->off, b->len - b->off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_clear(h, EV_WRITE);
+                return 0;
+            }
+            return -1;
         }
+        b->off += n;
     }
-detach:
-    return;
+    b->off = b->len = 0;
+    return 0;
+}
+
+static void buf_printf(Buf *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void buf_printf(Buf *b, const char *fmt, ...) {
+    char line[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n >= sizeof(line)) n = sizeof(line) - 1;
+    buf_append(b, line, n);
 }
 
 /**********************************************************************
- *                      DAEMON MAIN LOOP
+ *                            STATISTICS
  **********************************************************************/
 
-static void daemon_loop(void) {
-    umask(0177);
-    if (pipe(g_sigchld_pipe) == -1) perror_exit("pipe");
-    fcntl(g_sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+// Every counter has one writer, the thread owning it: a shard for its
+// sessions and connections, the main thread for spawns. Writers bump
+// them with plain relaxed stores, no lock and no locked instruction;
+// OP_STATS loads them on the main thread and adds the threads up.
 
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sigchld_handler;
-    sa.sa_flags = SA_RESTART;
-    sigaction(SIGCHLD, &sa, NULL);
+static const uint64_t LATENCY_BOUNDS_US[HIST_BUCKETS - 1] = {
+    100, 500, 1000, 5000, 20000, 100000, 1000000,
+};
+static const uint64_t READ_SIZE_BOUNDS[HIST_BUCKETS - 1] = {16, 64, 256, 512, 1024, 2048, 4096};
 
-    setup_signal_handlers();
+static void stat_add(uint64_t *v, uint64_t n) {
+    __atomic_store_n(v, *v + n, __ATOMIC_RELAXED);
+}
 
-    unlink(SOCKET_PATH);
-    g_server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (g_server_sock < 0) perror_exit("socket");
+static uint64_t stat_get(const uint64_t *v) {
+    return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
 
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+static void hist_add(Histogram *h, const uint64_t *bounds, uint64_t v) {
+    int i = 0;
+    while (i < HIST_BUCKETS - 1 && v > bounds[i]) i++;
+    stat_add(&h->count[i], 1);
+    stat_add(&h->sum, v);
+}
 
-    if (bind(g_server_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) perror_exit("bind");
-    if (listen(g_server_sock, 5) < 0) perror_exit("listen");
-    chmod(SOCKET_PATH, 0600);
+/**********************************************************************
+ *                            WIRE FORMAT
+ **********************************************************************/
 
-    while (1) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(g_server_sock, &rfds);
-        FD_SET(g_sigchld_pipe[0], &rfds);
-        int maxfd = (g_server_sock > g_sigchld_pipe[0]) ? g_server_sock : g_sigchld_pipe[0];
+static void put_u16(char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
 
-        int rv = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-        if (rv < 0) {
-            if (errno == EINTR) continue;
-            perror("select");
-            break;
-        }
+static void put_u32(char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
 
-        if (FD_ISSET(g_sigchld_pipe[0], &rfds)) {
-            char buf[16];
-            while (read(g_sigchld_pipe[0], buf, sizeof(buf)) > 0);
-            handle_sigchld();
-        }
+static uint16_t get_u16(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint16_t)(u[0] << 8 | u[1]);
+}
 
-        if (FD_ISSET(g_server_sock, &rfds)) {
-            int client_sock = accept(g_server_sock, NULL, NULL);
-            if (client_sock < 0) {
-                if (errno != EINTR) perror("accept");
-                continue;
-            }
+static uint32_t get_u32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
 
-            char line[4096];
-            ssize_t len = read(client_sock, line, sizeof(line)-1);
-            if (len <= 0) {
-                close(client_sock);
-                continue;
-            }
-            line[len] = 0;
-
-            if (strncmp(line, "SPAWN ", 6) == 0) {
-                handle_spawn(client_sock, line + 6);
-            } else if (strncmp(line, "LIST", 4) == 0) {
-                handle_list(client_sock);
-            } else if (strncmp(line, "KILL ", 5) == 0) {
-                handle_kill(client_sock, atoi(line + 5));
-            } else if (strncmp(line, "ATTACH ", 7) == 0) {
-                handle_attach(client_sock, atoi(line + 7));
-            } else {
-                dprintf(client_sock, "ERROR unknown command\n");
-            }
+static void put_u64(char *p, uint64_t v) {
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v);
+}
 
-            close(client_sock);
-        }
-    }
+static uint64_t get_u64(const char *p) {
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+static void frame_put_header(char *p, uint8_t opcode, uint16_t status,
+                             uint32_t req_id, uint32_t len) {
+    p[0] = (char)PROTO_MAGIC;
+    p[1] = opcode;
+    put_u16(p + 2, status);
+    put_u32(p + 4, req_id);
+    put_u32(p + 8, len);
+}
+
+static void frame_get_header(const char *p, FrameHeader *h) {
+    h->magic = (unsigned char)p[0];
+    h->opcode = (unsigned char)p[1];
+    h->status = get_u16(p + 2);
+    h->req_id = get_u32(p + 4);
+    h->len = get_u32(p + 8);
+}
+
+static void frame_append(Buf *b, uint8_t opcode, uint16_t status, uint32_t req_id,
+                         const void *payload, uint32_t len) {
+    char hdr[FRAME_HEADER_SIZE];
+    frame_put_header(hdr, opcode, status, req_id, len);
+    buf_append(b, hdr, sizeof(hdr));
+    if (len) buf_append(b, payload, len);
 }
 
 /**********************************************************************
- *                         CLIENT FUNCTIONS
+ *                            COMPRESSION
  **********************************************************************/
 
-static int connect_to_daemon(void) {
-    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sock < 0) return -1;
+// An attach may ask for its output compressed (ATTACH_COMPRESS), for
+// clients at the far end of a slow link. Output then travels in
+// blocks: u32 raw length, u32 body length (LZ_STORED: body is the raw
+// bytes as is), body. A body is LZ4-style sequences of a token
+// (literal count << 4 | match length - LZ_MIN_MATCH, 15 meaning more
+// follows in 255-continued bytes), the literals, and a u16
+// little-endian distance back to copy the match from; the last
+// sequence is literals only. Matches reach LZ_MAX_OFFSET back across
+// blocks, into earlier output and LZ_DICT before it; the compressor
+// takes the longest of the last LZ_CHAIN_DEPTH places the next four
+// bytes were seen. Each block is complete in itself, so whatever the
+// daemon flushes can be shown at once: the coalescing in
+// session_output() decides block sizes.
+#define LZ_STORED 0x80000000u
+enum {
+    LZ_MAX_OFFSET = 65535,
+    LZ_BOUND = LZ_BLOCK + LZ_BLOCK / 255 + 16,  // worst case body
+    LZ_CHAIN_DEPTH = 8,
+};
 
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+#if NIMT_WITH_COMPRESS
+// Both ends start from this history, so even the first screenful has
+// the usual escape sequences to refer to.
+static const char LZ_DICT[] =
+    "\033[?1049h\033[?1049l\033[?25l\033[?25h\033[?2004h\033[?2004l\033[?1h\033="
+    "\033[H\033[2J\033[J\033[K\033[0K\033[m\033[0m\033[1m\033[22m\033[7m\033[27m"
+    "\033[4m\033[24m\033[39m\033[49m\033[39;49m\033[38;5;\033[48;5;\033[38;2;"
+    "\033[30m\033[31m\033[32m\033[33m\033[34m\033[35m\033[36m\033[37m"
+    "\033[01;31m\033[01;32m\033[01;33m\033[01;34m\033[01;35m\033[01;36m\033[00m"
+    "\033[0;31m\033[0;32m\033[0;33m\033[0;34m\033[0;36m\033[1;32m\033[1;34m"
+    "\r\n\r\n                                                                "
+    "────────────────────────────────│├┤┌┐└┘┬┴┼";
 
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        close(sock);
-        return -1;
-    }
-    return sock;
+static uint32_t lz_hash(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
 }
 
-static void start_daemon(void) {
-    pid_t pid = fork();
-    if (pid < 0) perror_exit("fork");
-    if (pid == 0) {
-        setsid();
-        mkdirp(CGROUP_FOLDER);
-        move_to_cgroup(CGROUP_PATH);
+static void lz_insert(Lz *z, size_t pos) {
+    uint32_t *slot = &z->table[lz_hash(z->hist + pos)];
+    size_t dist = *slot ? pos - (*slot - 1) : 0;
+    z->chain[pos] = dist <= LZ_MAX_OFFSET ? dist : 0;
+    *slot = pos + 1;
+}
 
-        daemon_loop();
-        exit(0);
-    }
-    usleep(200000);
+static Lz *lz_new(void) {
+    Lz *z = mem_calloc(sizeof(Lz));
+    z->len = sizeof(LZ_DICT) - 1;
+    memcpy(z->hist, LZ_DICT, z->len);
+    for (size_t i = 0; i + LZ_MIN_MATCH <= z->len; i++) lz_insert(z, i);
+    return z;
 }
 
-static int connect_with_retry(void) {
-    int sock;
-    for (int i = 0; i < MAX_ATTEMPTS; i++) {
+static void lz_free(Lz *z) {
+    mem_free(z, sizeof(Lz));
+}
+
+// Make room for the next block, keeping the last LZ_WINDOW bytes.
+static void lz_slide(Lz *z) {
+    if (z->len <= LZ_WINDOW) return;
+    size_t shift = z->len - LZ_WINDOW;
+    memmove(z->hist, z->hist + shift, LZ_WINDOW);
+    memmove(z->chain, z->chain + shift, LZ_WINDOW * sizeof(z->chain[0]));
+    z->len = LZ_WINDOW;
+    for (size_t i = 0; i < (size_t)1 << LZ_HASH_LOG; i++)
+        z->table[i] = z->table[i] > shift ? z->table[i] - shift : 0;
+}
+
+static char *lz_put_len(char *op, size_t n) {
+    for (; n >= 255; n -= 255) *op++ = (char)255;
+    *op++ = (char)n;
+    return op;
+}
+
+static char *lz_put_seq(char *op, const char *lit, size_t nlit, size_t off, size_t mlen) {
+    char *token = op++;
+    *token = (char)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) op = lz_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+    *op++ = (char)off;
+    *op++ = (char)(off >> 8);
+    mlen -= LZ_MIN_MATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15) op = lz_put_len(op, mlen - 15);
+    return op;
+}
+
+// Append the iovecs (LZ_BLOCK bytes at most) to out as one block.
+static void lz_compress(Lz *z, const struct iovec *iov, int n, Buf *out) {
+    lz_slide(z);
+    size_t start = z->len, end = start;
+    for (int i = 0; i < n; i++) {
+        memcpy(z->hist + end, iov[i].iov_base, iov[i].iov_len);
+        end += iov[i].iov_len;
+    }
+    const char *h = z->hist;
+    char body[LZ_BOUND];
+    char *op = body;
+    size_t ip = start, anchor = start;
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t slot = z->table[lz_hash(h + ip)];
+        size_t cand = slot - 1, best = 0, ref = 0;
+        for (int depth = 0; slot && depth < LZ_CHAIN_DEPTH; depth++) {
+            if (ip - cand > LZ_MAX_OFFSET) break;
+            // A longer match must at least get past the best one's end.
+            if (ip + best >= end || h[cand + best] == h[ip + best]) {
+                size_t mlen = 0;
+                while (ip + mlen < end && h[cand + mlen] == h[ip + mlen]) mlen++;
+                if (mlen > best) {
+                    best = mlen;
+                    ref = cand;
+                }
+            }
+            size_t dist = z->chain[cand];
+            if (!dist || dist > cand) break;  // none, or slid out of hist
+            cand -= dist;
+        }
+        if (best < LZ_MIN_MATCH) {
+            lz_insert(z, ip);
+            ip += 1 + ((ip - anchor) >> 6);  // skip faster through noise
+            continue;
+        }
+        op = lz_put_seq(op, h + anchor, ip - anchor, ip - ref, best);
+        for (size_t i = 0; i < best; i++, ip++)
+            if (ip + LZ_MIN_MATCH <= end) lz_insert(z, ip);
+        anchor = ip;
+    }
+    op = lz_put_seq(op, h + anchor, end - anchor, 0, 0);
+    z->len = end;
+
+    char hdr[8];
+    size_t raw = end - start, len = op - body;
+    put_u32(hdr, raw);
+    put_u32(hdr + 4, len < raw ? len : raw | LZ_STORED);
+    buf_append(out, hdr, sizeof(hdr));
+    if (len < raw) buf_append(out, body, len);
+    else buf_append(out, h + start, raw);
+}
+
+// Append bytes of any length to out, compressed if z is set.
+static void lz_write(Lz *z, Buf *out, const char *data, size_t n) {
+    if (!z) {
+        buf_append(out, data, n);
+        return;
+    }
+    while (n > 0) {
+        struct iovec iov = {(void *)data, n < LZ_BLOCK ? n : LZ_BLOCK};
+        lz_compress(z, &iov, 1, out);
+        data += iov.iov_len;
+        n -= iov.iov_len;
+    }
+}
+
+static size_t lz_get_len(const char *src, size_t n, size_t *ip) {
+    size_t len = 0;
+    unsigned char b;
+    do {
+        if (*ip >= n || len > LZ_BLOCK) return LZ_BLOCK + 1;
+        b = (unsigned char)src[(*ip)++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+// Decode one block body (body_len as sent, flag included) into the
+// history. Returns its raw bytes, valid until the next block, or NULL
+// if the block is malformed.
+static const char *lz_decompress(Lz *z, const char *src, uint32_t body_len, uint32_t raw) {
+    lz_slide(z);
+    char *h = z->hist;
+    size_t op = z->len, oend = op + raw;
+    if (raw > LZ_BLOCK) return NULL;
+    if (body_len & LZ_STORED) {
+        if ((body_len & ~LZ_STORED) != raw) return NULL;
+        memcpy(h + op, src, raw);
+        z->len = oend;
+        return h + op;
+    }
+    size_t n = body_len, ip = 0;
+    while (ip < n) {
+        unsigned token = (unsigned char)src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) lit += lz_get_len(src, n, &ip);
+        if (lit > n - ip || lit > oend - op) return NULL;
+        memcpy(h + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n) break;
+        if (n - ip < 2) return NULL;
+        size_t off = (unsigned char)src[ip] | (size_t)(unsigned char)src[ip + 1] << 8;
+        ip += 2;
+        size_t mlen = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) mlen += lz_get_len(src, n, &ip);
+        if (off == 0 || off > op || mlen > oend - op) return NULL;
+        for (size_t i = 0; i < mlen; i++, op++) h[op] = h[op - off];  // may overlap
+    }
+    if (op != oend) return NULL;
+    z->len = oend;
+    return h + oend - raw;
+}
+#else
+// Built without the coder: ATTACH_COMPRESS is never asked for or granted.
+static Lz *lz_new(void) {
+    return NULL;
+}
+
+static void lz_free(Lz *z) {
+    (void)z;
+}
+
+static void lz_compress(Lz *z, const struct iovec *iov, int n, Buf *out) {
+    (void)z;
+    (void)iov;
+    (void)n;
+    (void)out;
+}
+
+static void lz_write(Lz *z, Buf *out, const char *data, size_t n) {
+    (void)z;
+    buf_append(out, data, n);
+}
+
+static const char *lz_decompress(Lz *z, const char *src, uint32_t body_len, uint32_t raw) {
+    (void)z;
+    (void)src;
+    (void)body_len;
+    (void)raw;
+    return NULL;
+}
+#endif
+
+/**********************************************************************
+ *                          RING FUNCTIONS
+ **********************************************************************/
+
+// Round a requested scrollback size to a power of two within limits.
+static size_t ring_size_for(size_t want) {
+    size_t size = SCROLLBACK_MIN;
+    while (size < want && size < SCROLLBACK_MAX) size <<= 1;
+    return size;
+}
+
+static int ring_map(Ring *r, int fd, size_t size) {
+    void *p = mmap(NULL, RING_FILE_HEADER + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) return -1;
+    r->file = p;
+    r->data = (char *)p + RING_FILE_HEADER;
+    r->size = size;
+    return 0;
+}
+
+// Back the ring with STATE_DIR/name if there is a state directory, so
+// the page cache keeps it on disk without a write per pty read.
+static void ring_init(Ring *r, size_t size, const char *name) {
+    memset(r, 0, sizeof(*r));
+    if (g_state_dir >= 0) {
+        int fd = openat(g_state_dir, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd >= 0 && ftruncate(fd, RING_FILE_HEADER + size) == 0 && ring_map(r, fd, size) == 0) {
+            close(fd);
+            r->file->magic = RING_FILE_MAGIC;
+            r->file->size = size;
+            r->file->master_fd = -1;
+            snprintf(r->file->name, sizeof(r->file->name), "%s", name);
+            mem_account(size, 1);  // tmpfs pages are memory all the same
+            return;
+        }
+        if (fd >= 0) {
+            close(fd);
+            unlinkat(g_state_dir, name, 0);
+        }
+    }
+    r->data = mem_alloc(size);
+    r->size = size;
+}
+
+// Map an existing scrollback file, as left by an earlier daemon.
+static int ring_adopt(Ring *r, const char *name) {
+    memset(r, 0, sizeof(*r));
+    int fd = openat(g_state_dir, name, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+    RingFile f;
+    struct stat st;
+    int ok = pread(fd, &f, sizeof(f), 0) == (ssize_t)sizeof(f) && fstat(fd, &st) == 0 &&
+             f.magic == RING_FILE_MAGIC && f.size >= SCROLLBACK_MIN &&
+             f.size <= SCROLLBACK_MAX && (f.size & (f.size - 1)) == 0 &&
+             (uint64_t)st.st_size == RING_FILE_HEADER + f.size &&
+             ring_map(r, fd, f.size) == 0;
+    close(fd);
+    if (!ok) return -1;
+    r->head = r->file->head;
+    r->file->name[sizeof(r->file->name) - 1] = 0;
+    mem_account(r->size, 1);
+    return 0;
+}
+
+static void ring_free(Ring *r) {
+    if (r->file) {
+        unlinkat(g_state_dir, r->file->name, 0);
+        munmap(r->file, RING_FILE_HEADER + r->size);
+        mem_account(r->size, -1);
+    } else {
+        mem_free(r->data, r->size);
+    }
+    memset(r, 0, sizeof(*r));
+}
+
+// Copy n ring bytes starting at absolute offset from into or out of
+// the ring, wrapping as need be.
+static void ring_copy(Ring *r, uint64_t from, char *buf, size_t n, int in) {
+    while (n > 0) {
+        size_t pos = from & (r->size - 1);
+        size_t k = r->size - pos < n ? r->size - pos : n;
+        if (in) memcpy(r->data + pos, buf, k);
+        else memcpy(buf, r->data + pos, k);
+        from += k;
+        buf += k;
+        n -= k;
+    }
+}
+
+// Make the ring size bytes, keeping the newest ones along with extra
+// bytes already written past head. Returns -1, leaving the ring as it
+// was, if a scrollback file cannot be resized.
+static int ring_resize(Ring *r, size_t size, size_t extra) {
+    uint64_t end = r->head + extra;
+    size_t keep = end < r->size ? end : r->size;
+    if (keep > size) keep = size;
+    char *saved = mem_alloc(keep);
+    ring_copy(r, end - keep, saved, keep, 0);
+    size_t old = r->size;
+    if (r->file) {
+        int fd = openat(g_state_dir, r->file->name, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            mem_free(saved, keep);
+            return -1;
+        }
+        RingFile *f = r->file;
+        munmap(f, RING_FILE_HEADER + old);
+        int err = ftruncate(fd, RING_FILE_HEADER + size);
+        // On failure the file still holds everything: map it back.
+        if (ring_map(r, fd, err < 0 ? old : size) < 0) perror_exit("mmap");
+        close(fd);
+        if (err < 0) {
+            mem_free(saved, keep);
+            return -1;
+        }
+        r->file->size = size;
+        mem_account(old, -1);
+        mem_account(size, 1);
+    } else {
+        mem_free(r->data, old);
+        r->data = mem_alloc(size);
+        r->size = size;
+    }
+    ring_copy(r, end - keep, saved, keep, 1);
+    mem_free(saved, keep);
+    return 0;
+}
+
+#if NIMT_WITH_HIBERNATE
+// Whether ring_release() has pages to hand back: not for a heap ring
+// small enough to live in a slab.
+static int ring_releasable(const Ring *r) {
+#if defined(MADV_REMOVE)
+    if (r->file) return 1;
+#endif
+    return !r->file && r->size > SLAB_CLASS_MAX;
+}
+
+// Hand the ring's pages back to the kernel, its bytes kept elsewhere
+// meanwhile; it reads as zeros until written again.
+static int ring_release(Ring *r) {
+    if (!ring_releasable(r)) return -1;
+#if defined(MADV_REMOVE)
+    if (r->file) return madvise(r->data, r->size, MADV_REMOVE);  // the file's pages too
+#endif
+    return madvise(r->data, r->size, MADV_DONTNEED);
+}
+#endif
+
+// Oldest offset still held by the ring, and not about to be overwritten.
+static uint64_t ring_tail(const Ring *r) {
+    uint64_t end = r->head + r->reserved;
+    return end > r->size ? end - r->size : 0;
+}
+
+// Contiguous space at head, to read into directly.
+static char *ring_write_ptr(Ring *r, size_t *len) {
+    size_t pos = r->head & (r->size - 1);
+    *len = r->size - pos;
+    return r->data + pos;
+}
+
+static void ring_commit(Ring *r, size_t n) {
+    __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELAXED);  // read by OP_STATS
+    if (NIMT_WITH_STATE && r->file) r->file->head = r->head;
+}
+
+// Describe ring bytes [from, head) as at most two iovecs; from must not
+// be older than ring_tail().
+static int ring_iov(const Ring *r, uint64_t from, struct iovec iov[2]) {
+    size_t len = r->head - from;
+    if (len == 0) return 0;
+    size_t pos = from & (r->size - 1);
+    size_t first = r->size - pos;
+    iov[0].iov_base = r->data + pos;
+    if (len <= first) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+    iov[0].iov_len = first;
+    iov[1].iov_base = r->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+/**********************************************************************
+ *                         EVENT LOOP BACKEND
+ **********************************************************************/
+
+#if defined(HAVE_IO_URING)
+static int ev_uring_open(EvLoop *loop);
+#endif
+
+// io_uring or epoll on Linux, kqueue on the BSDs and macOS, plain poll()
+// where neither is available (or the kernel predates epoll).
+static void ev_backend_open(EvLoop *loop) {
+    loop->fd = -1;
+    loop->backend = EV_BACKEND_POLL;
+#if defined(HAVE_IO_URING)
+    if (ev_uring_open(loop) == 0) return;
+#endif
+#if defined(HAVE_EPOLL)
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->fd >= 0) {
+        loop->backend = EV_BACKEND_EPOLL;
+        return;
+    }
+    if (errno != ENOSYS && errno != EINVAL) perror_exit("epoll_create1");
+#elif defined(HAVE_KQUEUE)
+    loop->fd = kqueue();
+    if (loop->fd >= 0) {
+        fcntl(loop->fd, F_SETFD, FD_CLOEXEC);
+        loop->backend = EV_BACKEND_KQUEUE;
+        return;
+    }
+#endif
+}
+
+static void ev_add(EvLoop *loop, EvHandle *h, int fd, unsigned events,
+                   void (*cb)(EvHandle *, unsigned));
+static void ev_wake_event(EvHandle *h, unsigned revents);
+
+static void ev_init(EvLoop *loop) {
+    memset(loop, 0, sizeof(*loop));
+    ev_backend_open(loop);
+    pthread_mutex_init(&loop->task_lock, NULL);
+    loop->task_tail = &loop->tasks;
+    if (pipe(loop->wake) < 0) perror_exit("pipe");
+    set_nonblock_cloexec(loop->wake[0]);
+    set_nonblock_cloexec(loop->wake[1]);
+    ev_add(loop, &loop->wake_ev, loop->wake[0], EV_READ, ev_wake_event);
+}
+
+static void ev_queue(EvHandle *h) {
+    EvLoop *loop = h->loop;
+    if (h->queued) return;
+    if (loop->npending == loop->pendingcap) {
+        loop->pendingcap = loop->pendingcap ? loop->pendingcap * 2 : 64;
+        loop->pending = realloc(loop->pending, loop->pendingcap * sizeof(*loop->pending));
+        if (!loop->pending) perror_exit("realloc");
+    }
+    loop->pending[loop->npending++] = h;
+    h->queued = 1;
+}
+
+static void ev_fired(EvHandle *h, unsigned revents) {
+    h->ready |= revents;
+    ev_queue(h);
+}
+
+#if defined(HAVE_IO_URING)
+// io_uring, spoken through the raw syscalls. Each handle keeps one
+// multishot poll armed, which stands in for epoll's edge-triggered
+// registration and is submitted with the next wait. A pty is also read
+// through the ring (ev_read()): the read waits in the kernel and lands
+// in the scrollback directly, registered as a fixed buffer where the
+// kernel allows it, so a busy pty costs no syscall of its own.
+//
+// Needs 5.13 (multishot poll); older kernels, or NIMT_URING=0, get
+// epoll. Some of the ABI postdates the oldest headers we build with.
+#ifndef IORING_FEAT_EXT_ARG
+#define IORING_FEAT_EXT_ARG (1U << 8)
+#endif
+#ifndef IORING_FEAT_RSRC_TAGS
+#define IORING_FEAT_RSRC_TAGS (1U << 10)
+#endif
+#ifndef IORING_ENTER_EXT_ARG
+#define IORING_ENTER_EXT_ARG (1U << 3)
+#endif
+#ifndef IORING_SETUP_SUBMIT_ALL
+#define IORING_SETUP_SUBMIT_ALL (1U << 7)
+#endif
+#ifndef IORING_POLL_ADD_MULTI
+#define IORING_POLL_ADD_MULTI (1U << 0)
+#endif
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+
+enum {
+    EVU_ENTRIES = 256,  // submission queue; the completion queue is 16x
+    EVU_BUFS = 1024,    // fixed buffer slots
+    EVU_POLL = 1,       // user_data tags: which operation of an EvOps
+    EVU_READ = 2,
+    EVU_REGISTER_BUFFERS2 = 15,
+    EVU_REGISTER_BUFFERS_UPDATE = 16,
+    EVU_RSRC_REGISTER_SPARSE = 1,
+};
+
+typedef struct { uint32_t nr, flags; uint64_t resv2, data, tags; } EvuRsrcRegister;
+typedef struct { uint32_t offset, resv; uint64_t data, tags; uint32_t nr, resv2; } EvuRsrcUpdate;
+typedef struct { uint64_t sigmask; uint32_t sigmask_sz, pad; uint64_t ts; } EvuGeteventsArg;
+typedef struct { int64_t tv_sec; long long tv_nsec; } EvuTimespec;
+
+// A handle's dealings with the kernel. Completions name this rather
+// than the handle, as they may come in after the handle is gone; the
+// last of them frees it.
+typedef struct EvOps {
+    EvHandle *h;        // NULL once released
+    int inflight;       // operations the kernel has yet to complete
+    int polling;        // the multishot poll is armed
+    int reading;        // a read is with the kernel...
+    int done;           // ... or came back, with res
+    int32_t res;
+    size_t readlen;
+    int sync;           // reads go straight to read(2), see ev_read_sync()
+    int buf_index;      // fixed buffer slot, -1 if none
+    char *buf;          // ... and what it covers
+    size_t buflen;
+} EvOps;
+
+typedef struct EvUring {
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail;
+    int free_bufs[EVU_BUFS];  // fixed buffer slots not in use
+    int nfree_bufs;
+} EvUring;
+
+static int ev_uring_open(EvLoop *loop) {
+    const char *env = getenv("NIMT_URING");
+    if (env && strcmp(env, "0") == 0) return -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = EVU_ENTRIES * 16;
+    int fd = syscall(__NR_io_uring_setup, EVU_ENTRIES, &p);
+    if (fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));  // SUBMIT_ALL is 5.18
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = EVU_ENTRIES * 16;
+        fd = syscall(__NR_io_uring_setup, EVU_ENTRIES, &p);
+    }
+    if (fd < 0) return -1;  // no io_uring, or not for us
+    // RSRC_TAGS came with multishot poll.
+    unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG |
+                    IORING_FEAT_RSRC_TAGS;
+    size_t ringlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqlen > ringlen) ringlen = cqlen;
+    size_t sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    char *ring = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    if ((p.features & need) == need) {
+        ring = mmap(NULL, ringlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQ_RING);
+        sqes = mmap(NULL, sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+    }
+    if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+        if (ring != MAP_FAILED) munmap(ring, ringlen);
+        if (sqes != MAP_FAILED) munmap(sqes, sqeslen);
+        close(fd);
+        return -1;
+    }
+
+    EvUring *u = calloc(1, sizeof(EvUring));
+    if (!u) perror_exit("calloc");
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_array = (unsigned *)(ring + p.sq_off.array);
+    u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    u->sqes = sqes;
+    u->sqe_tail = *u->sq_tail;
+    for (unsigned i = 0; i < p.sq_entries; i++) u->sq_array[i] = i;
+    // Fixed buffers come and go with sessions, which takes a sparse
+    // table (5.19). Without one reads just go to unregistered memory.
+    EvuRsrcRegister reg = {EVU_BUFS, EVU_RSRC_REGISTER_SPARSE, 0, 0, 0};
+    if (syscall(__NR_io_uring_register, fd, EVU_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0) {
+        for (int i = 0; i < EVU_BUFS; i++) u->free_bufs[i] = EVU_BUFS - 1 - i;
+        u->nfree_bufs = EVU_BUFS;
+    }
+    loop->fd = fd;
+    loop->uring = u;
+    loop->backend = EV_BACKEND_URING;
+    return 0;
+}
+
+static void ev_uring_enter(EvLoop *loop, int wait, int timeout_ms);
+
+// Queue an operation for the next io_uring_enter(); without SQPOLL the
+// kernel looks at the queue then and only then.
+static struct io_uring_sqe *ev_uring_sqe(EvLoop *loop, int opcode, int fd, uint64_t data) {
+    EvUring *u = loop->uring;
+    while (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+        ev_uring_enter(loop, 0, 0);
+    struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    __atomic_store_n(u->sq_tail, ++u->sqe_tail, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static void ev_uring_poll(EvLoop *loop, EvOps *ops) {
+    struct io_uring_sqe *sqe =
+        ev_uring_sqe(loop, IORING_OP_POLL_ADD, ops->h->fd, (uintptr_t)ops | EVU_POLL);
+    uint32_t mask = POLLIN | POLLOUT;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    mask = mask << 16 | mask >> 16;  // the kernel swaps the halves back
+#endif
+    sqe->poll32_events = mask;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    ops->polling = 1;
+    ops->inflight++;
+}
+
+static void ev_uring_read(EvLoop *loop, EvOps *ops, void *buf, size_t len) {
+    int fixed = ops->buf_index >= 0 && (char *)buf >= ops->buf &&
+                (char *)buf + len <= ops->buf + ops->buflen;
+    struct io_uring_sqe *sqe = ev_uring_sqe(loop, fixed ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                                            ops->h->fd, (uintptr_t)ops | EVU_READ);
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = (uint64_t)-1;  // the file position, as read(2)
+    if (fixed) sqe->buf_index = ops->buf_index;
+    ops->reading = 1;
+    ops->readlen = len;
+    ops->inflight++;
+}
+
+// Scatter one completion to the handle it is for, if still there.
+static void ev_uring_complete(EvLoop *loop, const struct io_uring_cqe *cqe) {
+    EvOps *ops = (EvOps *)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+    EvHandle *h = ops->h;
+    if ((cqe->user_data & 3) == EVU_READ) {
+        ops->inflight--;
+        ops->reading = 0;
+        ops->done = 1;
+        ops->res = cqe->res;
+        if (h) ev_fired(h, EV_READ);
+    } else {
+        int more = cqe->flags & IORING_CQE_F_MORE;
+        if (!more) {
+            ops->inflight--;
+            ops->polling = 0;
+        }
+        if (h && cqe->res > 0) {
+            unsigned r = 0;
+            // A read with the kernel reports for itself.
+            if (cqe->res & POLLIN && !ops->reading) r |= EV_READ;
+            if (cqe->res & POLLOUT) r |= EV_WRITE;
+            if (cqe->res & (POLLERR | POLLHUP)) r |= EV_ERROR;
+            if (r) ev_fired(h, r);
+        }
+        // A multishot poll stops early when the completion queue fills.
+        if (h && !more) {
+            if (cqe->res >= 0) ev_uring_poll(loop, ops);
+            else ev_fired(h, EV_ERROR);
+        }
+    }
+    if (!h && !ops->inflight) free(ops);
+}
+
+static void ev_uring_reap(EvLoop *loop) {
+    EvUring *u = loop->uring;
+    for (;;) {
+        // Consumed before it is handled, which may queue (and so
+        // submit, and reap) more.
+        unsigned head = *u->cq_head;
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) break;
+        struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (cqe.user_data) ev_uring_complete(loop, &cqe);
+    }
+}
+
+// Submit what is queued, wait for a completion if asked (at most
+// timeout_ms, -1 for no limit) and collect the completions.
+static void ev_uring_enter(EvLoop *loop, int wait, int timeout_ms) {
+    EvUring *u = loop->uring;
+    unsigned submit = u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    EvuTimespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+    EvuGeteventsArg arg = {0, 0, 0, timeout_ms >= 0 ? (uintptr_t)&ts : 0};
+    if (submit || wait) {
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+        long n = syscall(__NR_io_uring_enter, loop->fd, submit, wait ? 1 : 0, flags,
+                         wait ? &arg : NULL, sizeof(arg));
+        if (n < 0 && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY)
+            perror_exit("io_uring_enter");
+    }
+    ev_uring_reap(loop);
+}
+
+// Give up the handle's fixed buffer slot; the kernel lets go of its pages.
+static void ev_uring_unpin(EvLoop *loop, EvOps *ops) {
+    EvUring *u = loop->uring;
+    if (ops->buf_index < 0) return;
+    struct iovec none = {NULL, 0};
+    EvuRsrcUpdate up = {ops->buf_index, 0, (uintptr_t)&none, 0, 1, 0};
+    syscall(__NR_io_uring_register, loop->fd, EVU_REGISTER_BUFFERS_UPDATE, &up, sizeof(up));
+    u->free_bufs[u->nfree_bufs++] = ops->buf_index;
+    ops->buf_index = -1;
+}
+
+static void ev_uring_release(EvLoop *loop, EvHandle *h) {
+    EvOps *ops = h->ops;
+    if (ops->reading) {
+        // The kernel must be done with the buffer before its owner is.
+        struct io_uring_sqe *sqe = ev_uring_sqe(loop, IORING_OP_ASYNC_CANCEL, -1, 0);
+        sqe->addr = (uintptr_t)ops | EVU_READ;
+        while (ops->reading) ev_uring_enter(loop, 1, -1);
+    }
+    ev_uring_unpin(loop, ops);
+    if (ops->polling) {
+        struct io_uring_sqe *sqe = ev_uring_sqe(loop, IORING_OP_POLL_REMOVE, -1, 0);
+        sqe->addr = (uintptr_t)ops | EVU_POLL;
+    }
+    ops->h = NULL;
+    if (!ops->inflight) free(ops);
+    h->ops = NULL;
+}
+#endif
+
+static short ev_poll_events(unsigned events) {
+    short pe = 0;
+    if (events & EV_READ) pe |= POLLIN;
+    if (events & EV_WRITE) pe |= POLLOUT;
+    return pe;
+}
+
+static void ev_add(EvLoop *loop, EvHandle *h, int fd, unsigned events,
+                   void (*cb)(EvHandle *, unsigned)) {
+    h->fd = fd;
+    h->events = events;
+    h->ready = 0;
+    h->queued = 0;
+    h->loop = loop;
+    h->cb = cb;
+
+    switch (loop->backend) {
+#if defined(HAVE_IO_URING)
+    case EV_BACKEND_URING:
+        h->ops = calloc(1, sizeof(EvOps));
+        if (!h->ops) perror_exit("calloc");
+        h->ops->h = h;
+        h->ops->buf_index = -1;
+        ev_uring_poll(loop, h->ops);
+        return;
+#endif
+#if defined(HAVE_EPOLL)
+    case EV_BACKEND_EPOLL: {
+        struct epoll_event ee;
+        memset(&ee, 0, sizeof(ee));
+        ee.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ee.data.ptr = h;
+        if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &ee) < 0) perror_exit("epoll_ctl");
+        return;
+    }
+#elif defined(HAVE_KQUEUE)
+    case EV_BACKEND_KQUEUE: {
+        struct kevent kev[2];
+        EV_SET(&kev[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, h);
+        EV_SET(&kev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, h);
+        if (kevent(loop->fd, kev, 2, NULL, 0, NULL) < 0) perror_exit("kevent");
+        return;
+    }
+#endif
+    default:
+        break;
+    }
+
+    if (loop->npoll == loop->pollcap) {
+        loop->pollcap = loop->pollcap ? loop->pollcap * 2 : 16;
+        loop->pollfds = realloc(loop->pollfds, loop->pollcap * sizeof(*loop->pollfds));
+        loop->pollhandles = realloc(loop->pollhandles, loop->pollcap * sizeof(*loop->pollhandles));
+        if (!loop->pollfds || !loop->pollhandles) perror_exit("realloc");
+    }
+    h->slot = loop->npoll++;
+    loop->pollfds[h->slot].fd = fd;
+    loop->pollfds[h->slot].events = ev_poll_events(events);
+    loop->pollfds[h->slot].revents = 0;
+    loop->pollhandles[h->slot] = h;
+}
+
+// Change what the owner wants to hear about. No syscall on the
+// edge-triggered backends: readiness that already fired is dispatched
+// on the next turn.
+static void ev_set(EvHandle *h, unsigned events) {
+    if (h->fd < 0 || h->events == events) return;
+    h->events = events;
+    if (h->loop->backend == EV_BACKEND_POLL)
+        h->loop->pollfds[h->slot].events = ev_poll_events(events);
+    if (h->ready & events) ev_queue(h);
+}
+
+// The owner drained a direction (read or write returned EAGAIN).
+static void ev_clear(EvHandle *h, unsigned bits) {
+    h->ready &= ~bits;
+}
+
+// Unregister the handle's descriptor, leaving it open, and return it.
+static int ev_release(EvHandle *h) {
+    int fd = h->fd;
+    if (fd < 0) return -1;
+    EvLoop *loop = h->loop;
+    switch (loop->backend) {
+#if defined(HAVE_IO_URING)
+    case EV_BACKEND_URING:
+        ev_uring_release(loop, h);
+        break;
+#endif
+#if defined(HAVE_EPOLL)
+    case EV_BACKEND_EPOLL:
+        epoll_ctl(loop->fd, EPOLL_CTL_DEL, h->fd, NULL);
+        break;
+#endif
+    case EV_BACKEND_POLL: {
+        int last = --loop->npoll;
+        if (h->slot != last) {
+            loop->pollfds[h->slot] = loop->pollfds[last];
+            loop->pollhandles[h->slot] = loop->pollhandles[last];
+            loop->pollhandles[h->slot]->slot = h->slot;
+        }
+        break;
+    }
+#if defined(HAVE_KQUEUE)
+    case EV_BACKEND_KQUEUE: {
+        struct kevent kev[2];
+        EV_SET(&kev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        EV_SET(&kev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        kevent(loop->fd, kev, 2, NULL, 0, NULL);
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+    h->fd = -1;
+    return fd;
+}
+
+// Unregister and close the handle's descriptor.
+static void ev_close(EvHandle *h) {
+    if (h->fd >= 0) close(ev_release(h));
+}
+
+// read(2) from the handle's descriptor. The io_uring backend leaves the
+// read with the kernel instead and fails with EAGAIN; EV_READ fires once
+// it is done and the next call returns what it got. Until then buf must
+// stay put and be the buffer passed again.
+static ssize_t ev_read(EvHandle *h, void *buf, size_t len) {
+#if defined(HAVE_IO_URING)
+    EvOps *ops = h->ops;
+    if (ops && ops->done) {
+        ops->done = 0;
+        if (ops->res >= 0) return ops->res;
+        errno = -ops->res;
+        return -1;
+    }
+    if (ops && !ops->sync) {
+        if (!ops->reading) ev_uring_read(h->loop, ops, buf, len);
+        errno = EAGAIN;
+        return -1;
+    }
+#endif
+    return read(h->fd, buf, len);
+}
+
+// How much of the buffer given to ev_read() the kernel may be writing,
+// or has written without it being returned yet.
+static size_t ev_read_pending(const EvHandle *h) {
+#if defined(HAVE_IO_URING)
+    if (h->ops && h->ops->reading) return h->ops->readlen;
+    if (h->ops && h->ops->done && h->ops->res > 0) return h->ops->res;
+#endif
+    (void)h;
+    return 0;
+}
+
+// Call back a read left with the kernel, and wait for it. Whatever it
+// got is returned by the next ev_read(), and EV_READ fires either way.
+static void ev_read_pause(EvHandle *h) {
+#if defined(HAVE_IO_URING)
+    EvOps *ops = h->ops;
+    if (!ops || !ops->reading) return;
+    struct io_uring_sqe *sqe = ev_uring_sqe(h->loop, IORING_OP_ASYNC_CANCEL, -1, 0);
+    sqe->addr = (uintptr_t)ops | EVU_READ;
+    while (ops->reading) ev_uring_enter(h->loop, 1, -1);
+    if (ops->res == -ECANCELED) ops->done = 0;
+#else
+    (void)h;
+#endif
+}
+
+// Have ev_read() read directly from now on.
+static void ev_read_sync(EvHandle *h) {
+    ev_read_pause(h);
+#if defined(HAVE_IO_URING)
+    if (h->ops) h->ops->sync = 1;
+#endif
+}
+
+// Let the kernel keep buf pinned for the handle's reads rather than pin
+// it on each; it is let go with the handle, or replaced by the next
+// buffer registered. A hint: it may decline. No read may be in flight.
+static void ev_register_buffer(EvHandle *h, void *buf, size_t len) {
+#if defined(HAVE_IO_URING)
+    EvOps *ops = h->ops;
+    EvUring *u = h->loop->uring;
+    if (!ops || (ops->buf_index < 0 && !u->nfree_bufs)) return;
+    int slot = ops->buf_index >= 0 ? ops->buf_index : u->free_bufs[--u->nfree_bufs];
+    ops->buf_index = -1;
+    struct iovec iov = {buf, len};
+    EvuRsrcUpdate up = {slot, 0, (uintptr_t)&iov, 0, 1, 0};
+    // Mapped files other than tmpfs cannot be pinned for long.
+    if (syscall(__NR_io_uring_register, h->loop->fd, EVU_REGISTER_BUFFERS_UPDATE, &up,
+                sizeof(up)) != 1) {
+        struct iovec none = {NULL, 0};
+        up.data = (uintptr_t)&none;
+        syscall(__NR_io_uring_register, h->loop->fd, EVU_REGISTER_BUFFERS_UPDATE, &up, sizeof(up));
+        u->free_bufs[u->nfree_bufs++] = slot;
+        return;
+    }
+    ops->buf_index = slot;
+    ops->buf = buf;
+    ops->buflen = len;
+#else
+    (void)h;
+    (void)buf;
+    (void)len;
+#endif
+}
+
+#if NIMT_WITH_HIBERNATE
+// Undo ev_register_buffer(), so the buffer's pages can be given back.
+// No read may be in flight.
+static void ev_unregister_buffer(EvHandle *h) {
+#if defined(HAVE_IO_URING)
+    if (h->ops) ev_uring_unpin(h->loop, h->ops);
+#else
+    (void)h;
+#endif
+}
+#endif
+
+// Free a slab object that may still be referenced by the turn being
+// dispatched.
+static void ev_defer_free(EvLoop *loop, void *p) {
+    if (loop->ngarbage == loop->garbagecap) {
+        loop->garbagecap = loop->garbagecap ? loop->garbagecap * 2 : 16;
+        loop->garbage = realloc(loop->garbage, loop->garbagecap * sizeof(*loop->garbage));
+        if (!loop->garbage) perror_exit("realloc");
+    }
+    loop->garbage[loop->ngarbage++] = p;
+}
+
+// Collect readiness from the kernel into the pending list.
+static void ev_backend_wait(EvLoop *loop, int timeout_ms) {
+    enum { MAX_EVENTS = 64 };
+
+    switch (loop->backend) {
+#if defined(HAVE_IO_URING)
+    case EV_BACKEND_URING:
+        ev_uring_enter(loop, 1, timeout_ms);
+        return;
+#endif
+#if defined(HAVE_EPOLL)
+    case EV_BACKEND_EPOLL: {
+        struct epoll_event ee[MAX_EVENTS];
+        int n = epoll_wait(loop->fd, ee, MAX_EVENTS, timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR) return;
+            perror_exit("epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            unsigned r = 0;
+            if (ee[i].events & EPOLLIN) r |= EV_READ;
+            if (ee[i].events & EPOLLOUT) r |= EV_WRITE;
+            if (ee[i].events & (EPOLLERR | EPOLLHUP)) r |= EV_ERROR;
+            ev_fired(ee[i].data.ptr, r);
+        }
+        return;
+    }
+#elif defined(HAVE_KQUEUE)
+    case EV_BACKEND_KQUEUE: {
+        struct kevent kev[MAX_EVENTS];
+        struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        int n = kevent(loop->fd, NULL, 0, kev, MAX_EVENTS, timeout_ms < 0 ? NULL : &ts);
+        if (n < 0) {
+            if (errno == EINTR) return;
+            perror_exit("kevent");
+        }
+        for (int i = 0; i < n; i++) {
+            unsigned r = kev[i].filter == EVFILT_READ ? EV_READ : EV_WRITE;
+            if (kev[i].flags & (EV_EOF | EV_ERROR)) r |= EV_ERROR;
+            ev_fired(kev[i].udata, r);
+        }
+        return;
+    }
+#endif
+    default:
+        break;
+    }
+
+    int n = poll(loop->pollfds, loop->npoll, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return;
+        perror_exit("poll");
+    }
+    for (int i = 0; i < loop->npoll && n > 0; i++) {
+        short pe = loop->pollfds[i].revents;
+        if (!pe) continue;
+        n--;
+        unsigned r = 0;
+        if (pe & POLLIN) r |= EV_READ;
+        if (pe & POLLOUT) r |= EV_WRITE;
+        if (pe & (POLLERR | POLLHUP | POLLNVAL)) r |= EV_ERROR;
+        ev_fired(loop->pollhandles[i], r);
+    }
+}
+
+static void ev_timer_swap(EvLoop *loop, int i, int j) {
+    EvTimer *t = loop->timers[i];
+    loop->timers[i] = loop->timers[j];
+    loop->timers[j] = t;
+    loop->timers[i]->index = i;
+    loop->timers[j]->index = j;
+}
+
+static void ev_timer_sift(EvLoop *loop, int i) {
+    while (i > 0 && loop->timers[(i - 1) / 2]->when > loop->timers[i]->when) {
+        ev_timer_swap(loop, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < loop->ntimers && loop->timers[l]->when < loop->timers[min]->when) min = l;
+        if (r < loop->ntimers && loop->timers[r]->when < loop->timers[min]->when) min = r;
+        if (min == i) return;
+        ev_timer_swap(loop, i, min);
+        i = min;
+    }
+}
+
+static void ev_timer_init(EvTimer *t, void (*cb)(EvTimer *t)) {
+    t->index = -1;
+    t->cb = cb;
+}
+
+static void ev_timer_stop(EvLoop *loop, EvTimer *t) {
+    int i = t->index;
+    if (i < 0) return;
+    t->index = -1;
+    if (i != --loop->ntimers) {
+        loop->timers[i] = loop->timers[loop->ntimers];
+        loop->timers[i]->index = i;
+        ev_timer_sift(loop, i);
+    }
+}
+
+// Arm (or move) t to fire at when.
+static void ev_timer_start(EvLoop *loop, EvTimer *t, uint64_t when) {
+    t->when = when;
+    if (t->index >= 0) {
+        ev_timer_sift(loop, t->index);
+        return;
+    }
+    if (loop->ntimers == loop->timercap) {
+        loop->timercap = loop->timercap ? loop->timercap * 2 : 16;
+        loop->timers = realloc(loop->timers, loop->timercap * sizeof(*loop->timers));
+        if (!loop->timers) perror_exit("realloc");
+    }
+    t->index = loop->ntimers++;
+    loop->timers[t->index] = t;
+    ev_timer_sift(loop, t->index);
+}
+
+// How long the backend may sleep: not past the next deadline.
+static int ev_timeout_ms(EvLoop *loop) {
+    if (loop->npending) return 0;
+    if (!loop->ntimers) return -1;
+    uint64_t now = now_us(CLOCK_MONOTONIC), when = loop->timers[0]->when;
+    return when <= now ? 0 : (int)((when - now + 999) / 1000);
+}
+
+static void ev_run_timers(EvLoop *loop) {
+    if (!loop->ntimers) return;
+    uint64_t now = now_us(CLOCK_MONOTONIC);
+    while (loop->ntimers && loop->timers[0]->when <= now) {
+        EvTimer *t = loop->timers[0];
+        ev_timer_stop(loop, t);
+        t->cb(t);
+    }
+}
+
+static void ev_dispatch(EvLoop *loop, int i) {
+    EvHandle *h = loop->pending[i];
+    loop->pending[i] = NULL;
+    h->queued = 0;
+    // A callback earlier in the turn may have closed this one.
+    if (h->fd < 0) return;
+    unsigned r = h->ready & (h->events | EV_ERROR);
+    if (!r) return;
+    h->cb(h, r);
+    if (h->fd >= 0 && (h->ready & h->events)) ev_queue(h);
+}
+
+// Wait once and dispatch every ready handle, urgent ones first. A
+// handle whose owner did not drain what it wanted goes to the back of
+// the line for next turn, so one busy descriptor cannot starve the
+// others.
+static void ev_run_once(EvLoop *loop) {
+    ev_backend_wait(loop, ev_timeout_ms(loop));
+
+    int n = loop->npending;
+    for (int i = 0; i < n; i++) {
+        if (loop->pending[i]->urgent) ev_dispatch(loop, i);
+    }
+    for (int i = 0; i < n; i++) {
+        if (loop->pending[i]) ev_dispatch(loop, i);
+    }
+
+    ev_run_timers(loop);
+
+    // Keep what was queued during the turn, minus anything since closed,
+    // timers included: the garbage is freed below.
+    int kept = 0;
+    for (int i = n; i < loop->npending; i++) {
+        EvHandle *h = loop->pending[i];
+        if (h->fd >= 0) loop->pending[kept++] = h;
+        else h->queued = 0;
+    }
+    loop->npending = kept;
+
+    for (int i = 0; i < loop->ngarbage; i++) slab_free(loop->garbage[i]);
+    loop->ngarbage = 0;
+}
+
+// Queue t to run on the loop's own thread; callable from any thread.
+static void ev_post(EvLoop *loop, EvTask *t) {
+    t->next = NULL;
+    pthread_mutex_lock(&loop->task_lock);
+    int idle = !loop->tasks;
+    *loop->task_tail = t;
+    loop->task_tail = &t->next;
+    pthread_mutex_unlock(&loop->task_lock);
+    if (idle && write(loop->wake[1], "", 1) < 0) {
+        // A full pipe already has the loop woken.
+    }
+}
+
+// Run whatever has been posted so far.
+static void ev_run_tasks(EvLoop *loop) {
+    pthread_mutex_lock(&loop->task_lock);
+    EvTask *t = loop->tasks;
+    loop->tasks = NULL;
+    loop->task_tail = &loop->tasks;
+    pthread_mutex_unlock(&loop->task_lock);
+    while (t) {
+        EvTask *next = t->next;
+        t->cb(t);
+        t = next;
+    }
+}
+
+static void ev_wake_event(EvHandle *h, unsigned revents) {
+    (void)revents;
+    char buf[64];
+    while (read(h->fd, buf, sizeof(buf)) > 0);
+    ev_clear(h, EV_READ);
+    ev_run_tasks(CONTAINER_OF(h, EvLoop, wake_ev));
+}
+
+/**********************************************************************
+ *                           SESSION TABLE
+ **********************************************************************/
+
+static int slot_grow(void) {
+    if (g_nslots == g_slotcap) {
+        g_slotcap = g_slotcap ? g_slotcap * 2 : 16;
+        g_slots = realloc(g_slots, g_slotcap * sizeof(*g_slots));
+        if (!g_slots) perror_exit("realloc");
+    }
+    return g_nslots++;
+}
+
+// Take a free slot (or grow the array) and return its session ID.
+static int slot_alloc(Session *s) {
+    int i = g_free_slot;
+    if (i >= 0) {
+        g_free_slot = g_slots[i].next_free;
+    } else {
+        i = slot_grow();
+    }
+    g_slots[i].session = s;
+    g_slots[i].next_free = -1;
+    return i + 1;
+}
+
+static void slot_release(int id) {
+    g_slots[id - 1].session = NULL;
+    g_slots[id - 1].next_free = g_free_slot;
+    g_free_slot = id - 1;
+}
+
+// Give s the ID it had before a restart. Returns -1 if that ID is taken.
+static int slot_adopt(int id, Session *s) {
+    while (g_nslots < id) {
+        int i = slot_grow();
+        g_slots[i].session = NULL;
+        g_slots[i].next_free = g_free_slot;
+        g_free_slot = i;
+    }
+    if (g_slots[id - 1].session) return -1;
+    int *pp = &g_free_slot;
+    while (*pp != id - 1) pp = &g_slots[*pp].next_free;
+    *pp = g_slots[id - 1].next_free;
+    g_slots[id - 1].session = s;
+    g_slots[id - 1].next_free = -1;
+    return 0;
+}
+
+static size_t pid_hash(pid_t pid) {
+    return ((uint32_t)pid * 2654435761u) & (g_pid_cap - 1);
+}
+
+static void pid_insert(Session *s);
+
+static void pid_grow(void) {
+    Session **old = g_pid_table;
+    size_t old_cap = g_pid_cap;
+    g_pid_cap = old_cap ? old_cap * 2 : 64;
+    g_pid_table = calloc(g_pid_cap, sizeof(*g_pid_table));
+    if (!g_pid_table) perror_exit("calloc");
+    g_pid_count = 0;
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i]) pid_insert(old[i]);
+    free(old);
+}
+
+// Linear probing, kept at most half full.
+static void pid_insert(Session *s) {
+    if ((g_pid_count + 1) * 2 > g_pid_cap) pid_grow();
+    size_t i = pid_hash(s->child_pid);
+    while (g_pid_table[i]) i = (i + 1) & (g_pid_cap - 1);
+    g_pid_table[i] = s;
+    g_pid_count++;
+}
+
+static Session *pid_lookup(pid_t pid) {
+    if (!g_pid_cap) return NULL;
+    size_t i = pid_hash(pid);
+    while (g_pid_table[i]) {
+        if (g_pid_table[i]->child_pid == pid) return g_pid_table[i];
+        i = (i + 1) & (g_pid_cap - 1);
+    }
+    return NULL;
+}
+
+// Backward-shift deletion: no tombstones, probes stay short.
+static void pid_remove(pid_t pid) {
+    if (!g_pid_cap) return;
+    size_t mask = g_pid_cap - 1;
+    size_t i = pid_hash(pid);
+    while (g_pid_table[i] && g_pid_table[i]->child_pid != pid) i = (i + 1) & mask;
+    if (!g_pid_table[i]) return;
+    g_pid_count--;
+    for (size_t j = (i + 1) & mask; g_pid_table[j]; j = (j + 1) & mask) {
+        size_t home = pid_hash(g_pid_table[j]->child_pid);
+        // Move j into the hole at i unless its home lies in (i, j].
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            g_pid_table[i] = g_pid_table[j];
+            i = j;
+        }
+    }
+    g_pid_table[i] = NULL;
+}
+
+/**********************************************************************
+ *                             RECORDING
+ **********************************************************************/
+
+// A recording is two files in RECORD_DIR, integers big-endian:
+//
+//   <id>.nrec  "NREC", u32 version, u32 session id, u32 pid,
+//              u64 start (wall clock, microseconds since the epoch),
+//              then one frame per pty wakeup:
+//              u64 microseconds since the start, u32 len, len bytes
+//   <id>.nidx  u64 time, u64 .nrec offset of a frame; one entry per
+//              second or RECORD_INDEX_BYTES of output, whichever comes
+//              first, so a reader finds any time by binary search
+//
+// Once the session ends both are renamed to <id>-<pid>.*, so a reused ID
+// starts a new recording instead of overwriting the old one.
+
+enum { RECORD_HEADER_SIZE = 24, RECORD_FRAME_HEADER = 12, RECORD_INDEX_ENTRY = 16 };
+
+#if NIMT_WITH_RECORD
+static void record_path(char *buf, size_t size, const Session *s, int done, const char *ext) {
+    if (done) snprintf(buf, size, "%d-%d.%s", s->id, (int)s->child_pid, ext);
+    else snprintf(buf, size, "%d.%s", s->id, ext);
+}
+
+static int record_start(Session *s) {
+    if (s->rec) return 0;
+    if (__atomic_load_n(&g_record_dir, __ATOMIC_ACQUIRE) < 0) {
+        // Shards may race to open it; the loser closes its copy.
+        int fd = open_private_dir(RECORD_DIR), none = -1;
+        if (fd < 0) return -1;
+        if (!__atomic_compare_exchange_n(&g_record_dir, &none, fd, 0, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE))
+            close(fd);
+    }
+    Recording *r = calloc(1, sizeof(Recording));
+    if (!r) perror_exit("calloc");
+    char name[64];
+    record_path(name, sizeof(name), s, 0, "nrec");
+    r->fd = openat(g_record_dir, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    record_path(name, sizeof(name), s, 0, "nidx");
+    r->index_fd = openat(g_record_dir, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    char hdr[RECORD_HEADER_SIZE];
+    memcpy(hdr, "NREC", 4);
+    put_u32(hdr + 4, 1);
+    put_u32(hdr + 8, s->id);
+    put_u32(hdr + 12, s->child_pid);
+    put_u64(hdr + 16, now_us(CLOCK_REALTIME));
+    if (r->fd < 0 || r->index_fd < 0 || write_all(r->fd, hdr, sizeof(hdr)) < 0) {
+        int err = errno;
+        if (r->fd >= 0) close(r->fd);
+        if (r->index_fd >= 0) close(r->index_fd);
+        free(r);
+        errno = err;
+        return -1;
+    }
+    r->start_us = now_us(CLOCK_MONOTONIC);
+    r->off = RECORD_HEADER_SIZE;
+    s->rec = r;
+    return 0;
+}
+
+static void record_stop(Session *s) {
+    Recording *r = s->rec;
+    if (!r) return;
+    close(r->fd);
+    close(r->index_fd);
+    free(r);
+    s->rec = NULL;
+    const char *exts[] = {"nrec", "nidx"};
+    for (int i = 0; i < 2; i++) {
+        char from[64], to[64];
+        record_path(from, sizeof(from), s, 0, exts[i]);
+        record_path(to, sizeof(to), s, 1, exts[i]);
+        renameat(g_record_dir, from, g_record_dir, to);
+    }
+}
+
+// Append scrollback [from, head) as one frame, straight from the ring.
+static void record_output(Session *s, uint64_t from) {
+    Recording *r = s->rec;
+    uint64_t t = now_us(CLOCK_MONOTONIC) - r->start_us;
+    size_t len = s->scrollback.head - from;
+
+    if (!r->nindex || t - r->index_t >= RECORD_INDEX_US ||
+        r->off - r->index_off >= RECORD_INDEX_BYTES) {
+        char entry[RECORD_INDEX_ENTRY];
+        put_u64(entry, t);
+        put_u64(entry + 8, r->off);
+        if (write_all(r->index_fd, entry, sizeof(entry)) == 0) {
+            r->index_t = t;
+            r->index_off = r->off;
+            r->nindex++;
+        }
+    }
+
+    char hdr[RECORD_FRAME_HEADER];
+    put_u64(hdr, t);
+    put_u32(hdr + 8, len);
+    struct iovec iov[3] = {{hdr, sizeof(hdr)}};
+    int n = 1 + ring_iov(&s->scrollback, from, iov + 1);
+    ssize_t w;
+    do {
+        w = writev(r->fd, iov, n);
+    } while (w < 0 && errno == EINTR);
+    if (w != (ssize_t)(sizeof(hdr) + len)) {
+        perror("record");
+        record_stop(s);
+        return;
+    }
+    r->off += w;
+}
+#else
+// Built without recordings; replay still reads them.
+static int record_start(Session *s) {
+    (void)s;
+    errno = ENOTSUP;
+    return -1;
+}
+
+static void record_stop(Session *s) {
+    (void)s;
+}
+
+static void record_output(Session *s, uint64_t from) {
+    (void)s;
+    (void)from;
+}
+#endif
+
+/**********************************************************************
+ *                         TERMINAL EMULATOR
+ **********************************************************************/
+
+// Enough of a VT100/xterm to know what the screen looks like: cursor
+// motion, erasing, scrolling regions, insert/delete, SGR colours and
+// the alternate screen. Everything else is parsed and dropped. An
+// attach then gets a repaint of the grid instead of the raw scrollback.
+
+#if NIMT_WITH_SCREEN
+enum {
+    VT_GROUND,
+    VT_ESC,
+    VT_ESC_SKIP,    // ESC ( B, ESC # 8 ...: one more byte to eat
+    VT_CSI,
+    VT_STRING,      // OSC, DCS, APC...: everything up to BEL or ST
+    VT_STRING_ESC,
+};
+
+static const VtCell VT_BLANK = {0, 0, 0, 0};
+
+static VtCell *vt_cell(Vt *vt, int row, int col) {
+    return &vt->grid[row * vt->cols + col];
+}
+
+// Erased cells keep the current background, as xterm does.
+static void vt_erase(Vt *vt, VtCell *c, int n) {
+    VtCell blank = VT_BLANK;
+    blank.bg = vt->pen.bg;
+    for (int i = 0; i < n; i++) c[i] = blank;
+}
+
+static void vt_reset(Vt *vt) {
+    vt->grid = vt->grids[0];
+    vt->alt = 0;
+    vt->row = vt->col = 0;
+    vt->wrap_pending = 0;
+    vt->top = 0;
+    vt->bottom = vt->rows - 1;
+    vt->pen = VT_BLANK;
+    vt->saved_row = vt->saved_col = 0;
+    vt->saved_pen = VT_BLANK;
+    vt->cursor_hidden = 0;
+    vt->autowrap_off = 0;
+    vt->graphics = 0;
+    for (int i = 0; i < 2; i++)
+        for (int j = 0; j < vt->rows * vt->cols; j++) vt->grids[i][j] = VT_BLANK;
+}
+
+static Vt *vt_new(int rows, int cols) {
+    Vt *vt = calloc(1, sizeof(Vt));
+    if (!vt) perror_exit("calloc");
+    vt->rows = rows;
+    vt->cols = cols;
+    for (int i = 0; i < 2; i++) {
+        vt->grids[i] = malloc(rows * cols * sizeof(VtCell));
+        if (!vt->grids[i]) perror_exit("malloc");
+    }
+    vt_reset(vt);
+    return vt;
+}
+
+static void vt_free(Vt *vt) {
+    if (!vt) return;
+    free(vt->grids[0]);
+    free(vt->grids[1]);
+    free(vt);
+}
+
+// Keep the top-left of each screen, shifted up if the cursor would
+// otherwise fall off the bottom.
+static void vt_resize(Vt *vt, int rows, int cols) {
+    if (rows < 1 || cols < 1 || (rows == vt->rows && cols == vt->cols)) return;
+    int shift = vt->row >= rows ? vt->row - rows + 1 : 0;
+    for (int i = 0; i < 2; i++) {
+        VtCell *grid = malloc(rows * cols * sizeof(VtCell));
+        if (!grid) perror_exit("malloc");
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < cols; c++) {
+                int from = r + shift;
+                grid[r * cols + c] = from < vt->rows && c < vt->cols
+                    ? vt->grids[i][from * vt->cols + c] : VT_BLANK;
+            }
+        }
+        free(vt->grids[i]);
+        vt->grids[i] = grid;
+    }
+    vt->grid = vt->grids[vt->alt];
+    vt->rows = rows;
+    vt->cols = cols;
+    vt->row -= shift;
+    if (vt->col >= cols) vt->col = cols - 1;
+    if (vt->saved_row >= rows) vt->saved_row = rows - 1;
+    if (vt->saved_col >= cols) vt->saved_col = cols - 1;
+    vt->top = 0;
+    vt->bottom = rows - 1;
+    vt->wrap_pending = 0;
+}
+
+// Move rows [top, bottom] up by n (down if n < 0), blanking what opens up.
+static void vt_scroll(Vt *vt, int top, int bottom, int n) {
+    int height = bottom - top + 1;
+    if (n > height) n = height;
+    if (n < -height) n = -height;
+    size_t row = vt->cols * sizeof(VtCell);
+    if (n > 0) {
+        memmove(vt_cell(vt, top, 0), vt_cell(vt, top + n, 0), (height - n) * row);
+        vt_erase(vt, vt_cell(vt, bottom - n + 1, 0), n * vt->cols);
+    } else if (n < 0) {
+        n = -n;
+        memmove(vt_cell(vt, top + n, 0), vt_cell(vt, top, 0), (height - n) * row);
+        vt_erase(vt, vt_cell(vt, top, 0), n * vt->cols);
+    }
+}
+
+static void vt_linefeed(Vt *vt) {
+    if (vt->row == vt->bottom) vt_scroll(vt, vt->top, vt->bottom, 1);
+    else if (vt->row < vt->rows - 1) vt->row++;
+}
+
+static void vt_move(Vt *vt, int row, int col) {
+    vt->row = row < 0 ? 0 : row >= vt->rows ? vt->rows - 1 : row;
+    vt->col = col < 0 ? 0 : col >= vt->cols ? vt->cols - 1 : col;
+    vt->wrap_pending = 0;
+}
+
+// DEC special graphics, as selected by ESC ( 0, for '`' to '~'.
+static const uint16_t VT_GRAPHICS[31] = {
+    0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0, 0x00b1,
+    0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c, 0x23ba,
+    0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534, 0x252c,
+    0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7,
+};
+
+static void vt_print(Vt *vt, uint32_t ch) {
+    if (vt->graphics && ch >= '`' && ch <= '~') ch = VT_GRAPHICS[ch - '`'];
+    if (vt->wrap_pending) {
+        vt->col = 0;
+        vt_linefeed(vt);
+        vt->wrap_pending = 0;
+    }
+    VtCell *c = vt_cell(vt, vt->row, vt->col);
+    *c = vt->pen;
+    c->ch = ch;
+    if (vt->col < vt->cols - 1) vt->col++;
+    else if (!vt->autowrap_off) vt->wrap_pending = 1;
+}
+
+static void vt_switch_screen(Vt *vt, int alt, int save) {
+    if (alt == vt->alt) return;
+    if (alt && save) {
+        vt->saved_row = vt->row;
+        vt->saved_col = vt->col;
+        vt->saved_pen = vt->pen;
+    }
+    vt->alt = alt;
+    vt->grid = vt->grids[alt];
+    if (alt) vt_erase(vt, vt->grid, vt->rows * vt->cols);
+    if (!alt && save) {
+        vt_move(vt, vt->saved_row, vt->saved_col);
+        vt->pen = vt->saved_pen;
+    }
+}
+
+static void vt_mode(Vt *vt, int on) {
+    for (int i = 0; i < vt->nparams; i++) {
+        if (vt->private_mark != '?') continue;
+        switch (vt->params[i]) {
+        case 7: vt->autowrap_off = !on; break;
+        case 25: vt->cursor_hidden = !on; break;
+        case 47: case 1047: vt_switch_screen(vt, on, 0); break;
+        case 1049: vt_switch_screen(vt, on, 1); break;
+        }
+    }
+}
+
+static uint16_t vt_rgb_to_palette(int r, int g, int b) {
+    return 16 + 36 * (r * 5 / 255) + 6 * (g * 5 / 255) + b * 5 / 255;
+}
+
+static void vt_sgr(Vt *vt) {
+    if (vt->nparams == 0) vt->params[vt->nparams++] = 0;
+    for (int i = 0; i < vt->nparams; i++) {
+        int p = vt->params[i];
+        if (p == 38 || p == 48) {
+            uint16_t color = 0;
+            if (i + 2 < vt->nparams && vt->params[i + 1] == 5) {
+                color = (vt->params[i + 2] & 0xff) + 1;
+                i += 2;
+            } else if (i + 4 < vt->nparams && vt->params[i + 1] == 2) {
+                color = vt_rgb_to_palette(vt->params[i + 2] & 0xff, vt->params[i + 3] & 0xff,
+                                          vt->params[i + 4] & 0xff) + 1;
+                i += 4;
+            }
+            if (p == 38) vt->pen.fg = color;
+            else vt->pen.bg = color;
+        } else if (p == 0) {
+            vt->pen = VT_BLANK;
+        } else if (p == 1) {
+            vt->pen.attr |= VT_BOLD;
+        } else if (p == 2) {
+            vt->pen.attr |= VT_DIM;
+        } else if (p == 3) {
+            vt->pen.attr |= VT_ITALIC;
+        } else if (p == 4) {
+            vt->pen.attr |= VT_UNDERLINE;
+        } else if (p == 7) {
+            vt->pen.attr |= VT_REVERSE;
+        } else if (p == 22) {
+            vt->pen.attr &= ~(VT_BOLD | VT_DIM);
+        } else if (p == 23) {
+            vt->pen.attr &= ~VT_ITALIC;
+        } else if (p == 24) {
+            vt->pen.attr &= ~VT_UNDERLINE;
+        } else if (p == 27) {
+            vt->pen.attr &= ~VT_REVERSE;
+        } else if (p >= 30 && p <= 37) {
+            vt->pen.fg = p - 30 + 1;
+        } else if (p == 39) {
+            vt->pen.fg = 0;
+        } else if (p >= 40 && p <= 47) {
+            vt->pen.bg = p - 40 + 1;
+        } else if (p == 49) {
+            vt->pen.bg = 0;
+        } else if (p >= 90 && p <= 97) {
+            vt->pen.fg = p - 90 + 9;
+        } else if (p >= 100 && p <= 107) {
+            vt->pen.bg = p - 100 + 9;
+        }
+    }
+}
+
+static void vt_csi(Vt *vt, unsigned char final) {
+    int n = vt->nparams > 0 && vt->params[0] > 0 ? vt->params[0] : 1;
+    int p0 = vt->nparams > 0 ? vt->params[0] : 0;
+    if (vt->private_mark && final != 'h' && final != 'l') return;
+    switch (final) {
+    case 'A': vt_move(vt, vt->row - n, vt->col); break;
+    case 'B': case 'e': vt_move(vt, vt->row + n, vt->col); break;
+    case 'C': case 'a': vt_move(vt, vt->row, vt->col + n); break;
+    case 'D': vt_move(vt, vt->row, vt->col - n); break;
+    case 'E': vt_move(vt, vt->row + n, 0); break;
+    case 'F': vt_move(vt, vt->row - n, 0); break;
+    case 'G': case '`': vt_move(vt, vt->row, n - 1); break;
+    case 'd': vt_move(vt, n - 1, vt->col); break;
+    case 'H': case 'f': {
+        int col = vt->nparams > 1 && vt->params[1] > 0 ? vt->params[1] : 1;
+        vt_move(vt, n - 1, col - 1);
+        break;
+    }
+    case 'J': {
+        VtCell *cur = vt_cell(vt, vt->row, vt->col);
+        VtCell *end = vt->grid + vt->rows * vt->cols;
+        if (p0 == 0) vt_erase(vt, cur, end - cur);
+        else if (p0 == 1) vt_erase(vt, vt->grid, cur - vt->grid + 1);
+        else vt_erase(vt, vt->grid, vt->rows * vt->cols);
+        break;
+    }
+    case 'K': {
+        VtCell *line = vt_cell(vt, vt->row, 0);
+        if (p0 == 0) vt_erase(vt, line + vt->col, vt->cols - vt->col);
+        else if (p0 == 1) vt_erase(vt, line, vt->col + 1);
+        else vt_erase(vt, line, vt->cols);
+        break;
+    }
+    case 'L': case 'M':
+        if (vt->row >= vt->top && vt->row <= vt->bottom) {
+            vt_scroll(vt, vt->row, vt->bottom, final == 'L' ? -n : n);
+            vt->col = 0;
+        }
+        break;
+    case '@': case 'P': {
+        VtCell *line = vt_cell(vt, vt->row, 0);
+        int left = vt->cols - vt->col;
+        if (n > left) n = left;
+        if (final == '@') {
+            memmove(line + vt->col + n, line + vt->col, (left - n) * sizeof(VtCell));
+            vt_erase(vt, line + vt->col, n);
+        } else {
+            memmove(line + vt->col, line + vt->col + n, (left - n) * sizeof(VtCell));
+            vt_erase(vt, line + vt->cols - n, n);
+        }
+        break;
+    }
+    case 'X': {
+        int left = vt->cols - vt->col;
+        vt_erase(vt, vt_cell(vt, vt->row, vt->col), n < left ? n : left);
+        break;
+    }
+    case 'S': vt_scroll(vt, vt->top, vt->bottom, n); break;
+    case 'T': vt_scroll(vt, vt->top, vt->bottom, -n); break;
+    case 'm': vt_sgr(vt); break;
+    case 'r': {
+        int top = vt->nparams > 0 && vt->params[0] > 0 ? vt->params[0] - 1 : 0;
+        int bottom = vt->nparams > 1 && vt->params[1] > 0 ? vt->params[1] - 1 : vt->rows - 1;
+        if (bottom >= vt->rows) bottom = vt->rows - 1;
+        if (top < bottom) {
+            vt->top = top;
+            vt->bottom = bottom;
+            vt_move(vt, 0, 0);
+        }
+        break;
+    }
+    case 's':
+        vt->saved_row = vt->row;
+        vt->saved_col = vt->col;
+        break;
+    case 'u': vt_move(vt, vt->saved_row, vt->saved_col); break;
+    case 'h': vt_mode(vt, 1); break;
+    case 'l': vt_mode(vt, 0); break;
+    }
+}
+
+static void vt_esc(Vt *vt, unsigned char ch) {
+    vt->state = VT_GROUND;
+    switch (ch) {
+    case '[':
+        vt->state = VT_CSI;
+        vt->nparams = 0;
+        vt->private_mark = 0;
+        vt->intermediate = 0;
+        vt->param_started = 0;
+        break;
+    case ']': case 'P': case 'X': case '^': case '_':
+        vt->state = VT_STRING;
+        break;
+    case '(': case ')': case '*': case '+': case '#': case '%': case ' ':
+        vt->charset_target = ch;
+        vt->state = VT_ESC_SKIP;
+        break;
+    case '7':
+        vt->saved_row = vt->row;
+        vt->saved_col = vt->col;
+        vt->saved_pen = vt->pen;
+        break;
+    case '8':
+        vt_move(vt, vt->saved_row, vt->saved_col);
+        vt->pen = vt->saved_pen;
+        break;
+    case 'D': vt_linefeed(vt); break;
+    case 'E':
+        vt->col = 0;
+        vt_linefeed(vt);
+        break;
+    case 'M':
+        if (vt->row == vt->top) vt_scroll(vt, vt->top, vt->bottom, -1);
+        else if (vt->row > 0) vt->row--;
+        break;
+    case 'c': vt_reset(vt); break;
+    }
+}
+
+// C0 controls act in the middle of escape sequences too.
+static void vt_control(Vt *vt, unsigned char ch) {
+    switch (ch) {
+    case '\b':
+        if (vt->col > 0) vt->col--;
+        vt->wrap_pending = 0;
+        break;
+    case '\t': {
+        int col = (vt->col / 8 + 1) * 8;
+        vt_move(vt, vt->row, col < vt->cols ? col : vt->cols - 1);
+        break;
+    }
+    case '\n': case '\v': case '\f':
+        vt_linefeed(vt);
+        vt->wrap_pending = 0;
+        break;
+    case '\r':
+        vt->col = 0;
+        vt->wrap_pending = 0;
+        break;
+    case 0x18: case 0x1a:   // CAN, SUB
+        vt->state = VT_GROUND;
+        break;
+    case 0x1b:
+        vt->state = VT_ESC;
+        break;
+    }
+}
+
+static void vt_feed(Vt *vt, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = data[i];
+        if (vt->state == VT_STRING) {
+            if (ch == 0x07) vt->state = VT_GROUND;
+            else if (ch == 0x1b) vt->state = VT_STRING_ESC;
+            continue;
+        }
+        if (vt->state == VT_STRING_ESC) {
+            // ESC \ ends the string; any other ESC starts a new sequence.
+            vt->state = VT_ESC;
+            if (ch == '\\') {
+                vt->state = VT_GROUND;
+                continue;
+            }
+        }
+        if (ch < 0x20 || ch == 0x7f) {
+            if (ch != 0x7f) vt_control(vt, ch);
+            continue;
+        }
+        switch (vt->state) {
+        case VT_GROUND:
+            if (ch < 0x80) {
+                vt->utf8_left = 0;
+                vt_print(vt, ch);
+            } else if (ch < 0xc0) {
+                if (vt->utf8_left == 0) continue;  // stray continuation byte
+                vt->utf8 = vt->utf8 << 6 | (ch & 0x3f);
+                if (--vt->utf8_left == 0) vt_print(vt, vt->utf8);
+            } else {
+                vt->utf8_left = ch < 0xe0 ? 1 : ch < 0xf0 ? 2 : 3;
+                vt->utf8 = ch & (0x3f >> vt->utf8_left);
+            }
+            break;
+        case VT_ESC:
+            vt_esc(vt, ch);
+            break;
+        case VT_ESC_SKIP:
+            if (vt->charset_target == '(') vt->graphics = ch == '0';
+            vt->state = VT_GROUND;
+            break;
+        case VT_CSI:
+            if (ch >= '0' && ch <= '9') {
+                if (!vt->param_started) {
+                    if (vt->nparams == VT_MAX_PARAMS) continue;
+                    vt->params[vt->nparams++] = 0;
+                    vt->param_started = 1;
+                }
+                int *p = &vt->params[vt->nparams - 1];
+                if (*p < 65536) *p = *p * 10 + (ch - '0');
+            } else if (ch == ';' || ch == ':') {
+                if (!vt->param_started && vt->nparams < VT_MAX_PARAMS)
+                    vt->params[vt->nparams++] = 0;
+                vt->param_started = 0;
+            } else if (ch >= '<' && ch <= '?') {
+                vt->private_mark = ch;
+            } else if (ch >= 0x20 && ch <= 0x2f) {
+                vt->intermediate = ch;
+            } else if (ch >= 0x40 && ch <= 0x7e) {
+                if (!vt->intermediate) vt_csi(vt, ch);
+                vt->state = VT_GROUND;
+            } else {
+                vt->state = VT_GROUND;
+            }
+            break;
+        }
+    }
+}
+
+static void vt_put_utf8(Buf *b, uint32_t ch) {
+    char u[4];
+    int n;
+    if (ch < 0x80) {
+        u[0] = ch;
+        n = 1;
+    } else if (ch < 0x800) {
+        u[0] = 0xc0 | ch >> 6;
+        u[1] = 0x80 | (ch & 0x3f);
+        n = 2;
+    } else if (ch < 0x10000) {
+        u[0] = 0xe0 | ch >> 12;
+        u[1] = 0x80 | (ch >> 6 & 0x3f);
+        u[2] = 0x80 | (ch & 0x3f);
+        n = 3;
+    } else {
+        u[0] = 0xf0 | ch >> 18;
+        u[1] = 0x80 | (ch >> 12 & 0x3f);
+        u[2] = 0x80 | (ch >> 6 & 0x3f);
+        u[3] = 0x80 | (ch & 0x3f);
+        n = 4;
+    }
+    buf_append(b, u, n);
+}
+
+static void vt_printf(Buf *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void vt_printf(Buf *b, const char *fmt, ...) {
+    char tmp[64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n > 0) buf_append(b, tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+static void vt_put_color(Buf *b, int base, uint16_t color) {
+    int i = color - 1;
+    if (i < 8) vt_printf(b, ";%d", base + i);
+    else if (i < 16) vt_printf(b, ";%d", base + 60 + i - 8);
+    else vt_printf(b, ";%d;5;%d", base + 8, i);
+}
+
+static void vt_put_sgr(Buf *b, const VtCell *c) {
+    buf_append(b, "\033[0", 3);
+    if (c->attr & VT_BOLD) buf_append(b, ";1", 2);
+    if (c->attr & VT_DIM) buf_append(b, ";2", 2);
+    if (c->attr & VT_ITALIC) buf_append(b, ";3", 2);
+    if (c->attr & VT_UNDERLINE) buf_append(b, ";4", 2);
+    if (c->attr & VT_REVERSE) buf_append(b, ";7", 2);
+    if (c->fg) vt_put_color(b, 30, c->fg);
+    if (c->bg) vt_put_color(b, 40, c->bg);
+    buf_append(b, "m", 1);
+}
+
+static int vt_same_style(const VtCell *a, const VtCell *b) {
+    return a->fg == b->fg && a->bg == b->bg && a->attr == b->attr;
+}
+
+// Draw the screen from scratch: clear, then each row up to its last
+// non-blank cell, then put the cursor and modes back.
+static void vt_repaint(const Vt *vt, Buf *out) {
+    VtCell style = VT_BLANK;
+    buf_append(out, "\033[0m", 4);
+    if (vt->alt) buf_append(out, "\033[?1049h", 8);
+    buf_append(out, "\033[H\033[2J", 7);
+    for (int r = 0; r < vt->rows; r++) {
+        const VtCell *line = vt->grid + r * vt->cols;
+        int end = vt->cols;
+        while (end > 0 && !line[end - 1].ch && !line[end - 1].bg && !line[end - 1].attr) end--;
+        if (end == 0) continue;
+        vt_printf(out, "\033[%d;1H", r + 1);
+        for (int c = 0; c < end; c++) {
+            if (!vt_same_style(&line[c], &style)) {
+                vt_put_sgr(out, &line[c]);
+                style = line[c];
+            }
+            vt_put_utf8(out, line[c].ch ? line[c].ch : ' ');
+        }
+    }
+    if (vt->top != 0 || vt->bottom != vt->rows - 1)
+        vt_printf(out, "\033[%d;%dr", vt->top + 1, vt->bottom + 1);
+    vt_printf(out, "\033[%d;%dH", vt->row + 1, vt->col + 1);
+    if (!vt_same_style(&vt->pen, &style)) vt_put_sgr(out, &vt->pen);
+    if (vt->cursor_hidden) buf_append(out, "\033[?25l", 6);
+    if (vt->autowrap_off) buf_append(out, "\033[?7l", 5);
+    if (vt->graphics) buf_append(out, "\033(0", 3);
+}
+#else
+// Built without the emulator: no session ever gets a Vt.
+static Vt *vt_new(int rows, int cols) {
+    (void)rows;
+    (void)cols;
+    return NULL;
+}
+
+static void vt_free(Vt *vt) {
+    (void)vt;
+}
+
+static void vt_resize(Vt *vt, int rows, int cols) {
+    (void)vt;
+    (void)rows;
+    (void)cols;
+}
+
+static void vt_feed(Vt *vt, const char *data, size_t len) {
+    (void)vt;
+    (void)data;
+    (void)len;
+}
+
+static void vt_repaint(const Vt *vt, Buf *out) {
+    (void)vt;
+    (void)out;
+}
+#endif
+
+/**********************************************************************
+ *                          PATTERN MATCHING
+ **********************************************************************/
+
+// OP_WAIT patterns: literal bytes, ., [...] (ranges, ^ to negate), the
+// escapes \d \w \s and \D \W \S, \t \r \n \e, * + ?, | and ( ). ^ and
+// $ match at the start and the end of a line. A pattern compiles to a
+// Thompson NFA that is stepped one byte at a time over the set of states
+// a match may be in: each byte of output costs at most one visit per
+// state, and a match split across pty reads is found all the same.
+
+enum { PAT_BYTE, PAT_SPLIT, PAT_BOL, PAT_EOL, PAT_MATCH };
+enum { PAT_MAX = 1024 };  // pattern bytes
+
+// While parsing: a fragment's first state, and its outs still to be
+// pointed at whatever comes next. Those are chained through the outs
+// themselves, each naming the next as state * 2 + 1 for out1.
+typedef struct PatFrag {
+    int start, dangling;
+} PatFrag;
+
+typedef struct PatParser {
+    Pattern *p;
+    const char *s, *end;
+    const char *err;
+} PatParser;
+
+static void pat_set(uint32_t *set, int c) {
+    set[c >> 5] |= 1u << (c & 31);
+}
+
+static int pat_has(const uint32_t *set, int c) {
+    return set[c >> 5] >> (c & 31) & 1;
+}
+
+static int pat_state(Pattern *p, int op, int out, int out1) {
+    if (p->nstates == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 32;
+        p->states = realloc(p->states, p->cap * sizeof(*p->states));
+        if (!p->states) perror_exit("realloc");
+    }
+    PatState *st = &p->states[p->nstates];
+    memset(st, 0, sizeof(*st));
+    st->op = op;
+    st->out = out;
+    st->out1 = out1;
+    return p->nstates++;
+}
+
+static int *pat_out(Pattern *p, int ref) {
+    PatState *st = &p->states[ref >> 1];
+    return ref & 1 ? &st->out1 : &st->out;
+}
+
+static void pat_patch(Pattern *p, int dangling, int to) {
+    while (dangling >= 0) {
+        int *out = pat_out(p, dangling);
+        dangling = *out;
+        *out = to;
+    }
+}
+
+static int pat_join(Pattern *p, int a, int b) {
+    if (a < 0) return b;
+    int ref = a;
+    while (*pat_out(p, ref) >= 0) ref = *pat_out(p, ref);
+    *pat_out(p, ref) = b;
+    return a;
+}
+
+static PatFrag pat_single(Pattern *p, int op) {
+    int s = pat_state(p, op, -1, -1);
+    return (PatFrag){s, s * 2};
+}
+
+// Add the bytes a backslash escape stands for to set.
+static int pat_escape(PatParser *pp, uint32_t *set) {
+    if (pp->s == pp->end) {
+        pp->err = "trailing backslash";
+        return -1;
+    }
+    int c = (unsigned char)*pp->s++;
+    uint32_t cls[8] = {0};
+    switch (c) {
+    case 'd': case 'D':
+        for (int i = '0'; i <= '9'; i++) pat_set(cls, i);
+        break;
+    case 'w': case 'W':
+        for (int i = 0; i < 256; i++)
+            if ((i >= '0' && i <= '9') || (i >= 'A' && i <= 'Z') || (i >= 'a' && i <= 'z') || i == '_')
+                pat_set(cls, i);
+        break;
+    case 's': case 'S':
+        for (const char *w = " \t\r\n\f\v"; *w; w++) pat_set(cls, *w);
+        break;
+    case 't': pat_set(cls, '\t'); break;
+    case 'r': pat_set(cls, '\r'); break;
+    case 'n': pat_set(cls, '\n'); break;
+    case 'e': pat_set(cls, 0x1B); break;
+    default: pat_set(cls, c); break;
+    }
+    int negate = c == 'D' || c == 'W' || c == 'S';
+    for (int i = 0; i < 8; i++) set[i] |= negate ? ~cls[i] : cls[i];
+    return 0;
+}
+
+// [...], the opening bracket already taken.
+static int pat_class(PatParser *pp, uint32_t *set) {
+    uint32_t cls[8] = {0};
+    int negate = pp->s < pp->end && *pp->s == '^';
+    pp->s += negate;
+    for (int first = 1;; first = 0) {
+        if (pp->s == pp->end) {
+            pp->err = "unterminated [";
+            return -1;
+        }
+        int c = (unsigned char)*pp->s++;
+        if (c == ']' && !first) break;
+        if (c == '\\') {
+            if (pat_escape(pp, cls) < 0) return -1;
+            continue;
+        }
+        int last = c;
+        if (pp->end - pp->s >= 2 && pp->s[0] == '-' && pp->s[1] != ']') {
+            last = (unsigned char)pp->s[1];
+            pp->s += 2;
+            if (last < c) {
+                pp->err = "bad range in [";
+                return -1;
+            }
+        }
+        for (int i = c; i <= last; i++) pat_set(cls, i);
+    }
+    for (int i = 0; i < 8; i++) set[i] = negate ? ~cls[i] : cls[i];
+    return 0;
+}
+
+static PatFrag pat_alt(PatParser *pp);
+
+static PatFrag pat_atom(PatParser *pp) {
+    Pattern *p = pp->p;
+    PatFrag f = {-1, -1};
+    int c = (unsigned char)*pp->s++;
+    uint32_t set[8] = {0};
+    switch (c) {
+    case '(':
+        f = pat_alt(pp);
+        if (!pp->err && (pp->s == pp->end || *pp->s != ')')) pp->err = "unmatched (";
+        pp->s++;
+        return f;
+    case '*': case '+': case '?':
+        pp->err = "nothing to repeat";
+        return f;
+    case '^':
+        return pat_single(p, PAT_BOL);
+    case '$':
+        return pat_single(p, PAT_EOL);
+    case '.':
+        for (int i = 0; i < 256; i++)
+            if (i != '\n') pat_set(set, i);
+        break;
+    case '[':
+        if (pat_class(pp, set) < 0) return f;
+        break;
+    case '\\':
+        if (pat_escape(pp, set) < 0) return f;
+        break;
+    default:
+        pat_set(set, c);
+        break;
+    }
+    f = pat_single(p, PAT_BYTE);
+    memcpy(p->states[f.start].set, set, sizeof(set));
+    return f;
+}
+
+static PatFrag pat_repeat(PatParser *pp) {
+    Pattern *p = pp->p;
+    PatFrag f = pat_atom(pp);
+    while (!pp->err && pp->s < pp->end && (*pp->s == '*' || *pp->s == '+' || *pp->s == '?')) {
+        char q = *pp->s++;
+        int s = pat_state(p, PAT_SPLIT, f.start, -1);
+        if (q == '?') {
+            f = (PatFrag){s, pat_join(p, f.dangling, s * 2 + 1)};
+        } else {
+            pat_patch(p, f.dangling, s);  // loop back
+            f = (PatFrag){q == '*' ? s : f.start, s * 2 + 1};
+        }
+    }
+    return f;
+}
+
+static PatFrag pat_concat(PatParser *pp) {
+    PatFrag f = {-1, -1};
+    while (!pp->err && pp->s < pp->end && *pp->s != '|' && *pp->s != ')') {
+        PatFrag g = pat_repeat(pp);
+        if (pp->err) break;
+        if (f.start < 0) {
+            f = g;
+        } else {
+            pat_patch(pp->p, f.dangling, g.start);
+            f.dangling = g.dangling;
+        }
+    }
+    // The empty string: a split that only goes on.
+    if (f.start < 0) f = pat_single(pp->p, PAT_SPLIT);
+    return f;
+}
+
+static PatFrag pat_alt(PatParser *pp) {
+    PatFrag f = pat_concat(pp);
+    while (!pp->err && pp->s < pp->end && *pp->s == '|') {
+        pp->s++;
+        PatFrag g = pat_concat(pp);
+        int s = pat_state(pp->p, PAT_SPLIT, f.start, g.start);
+        f = (PatFrag){s, pat_join(pp->p, f.dangling, g.dangling)};
+    }
+    return f;
+}
+
+static void pat_free(Pattern *p) {
+    free(p->states);
+    free(p->list);
+    free(p->next);
+    free(p->mark);
+    memset(p, 0, sizeof(*p));
+}
+
+// Returns -1 with *err saying why if src does not parse.
+static int pat_compile(Pattern *p, const char *src, size_t len, const char **err) {
+    memset(p, 0, sizeof(*p));
+    PatParser pp = {p, src, src + len, NULL};
+    PatFrag f = pat_alt(&pp);
+    if (!pp.err && pp.s < pp.end) pp.err = "unmatched )";
+    if (pp.err) {
+        *err = pp.err;
+        pat_free(p);
+        return -1;
+    }
+    pat_patch(p, f.dangling, pat_state(p, PAT_MATCH, -1, -1));
+    p->start = f.start;
+    p->list = malloc(p->nstates * sizeof(int));
+    p->next = malloc(p->nstates * sizeof(int));
+    p->mark = calloc(p->nstates, sizeof(uint32_t));
+    if (!p->list || !p->next || !p->mark) perror_exit("malloc");
+    return 0;
+}
+
+// Start building a list of states.
+static void pat_generation(Pattern *p) {
+    if (++p->gen == 0) {
+        memset(p->mark, 0, p->nstates * sizeof(uint32_t));
+        p->gen = 1;
+    }
+}
+
+// Add state s and all it leads to without taking a byte.
+static void pat_add(Pattern *p, int *list, int *n, int s, int bol) {
+    if (s < 0 || p->mark[s] == p->gen) return;
+    p->mark[s] = p->gen;
+    PatState *st = &p->states[s];
+    if (st->op == PAT_SPLIT) {
+        pat_add(p, list, n, st->out, bol);
+        pat_add(p, list, n, st->out1, bol);
+    } else if (st->op == PAT_BOL) {
+        if (bol) pat_add(p, list, n, st->out, bol);
+    } else {
+        // A byte to take, a line end to see first or a match.
+        if (st->op == PAT_MATCH) p->matched = 1;
+        list[(*n)++] = s;
+    }
+}
+
+// Look for a match from here on; bol: the output so far ended a line.
+static void pat_begin(Pattern *p, int bol) {
+    pat_generation(p);
+    p->nlist = 0;
+    p->matched = 0;
+    p->bol = bol;
+    pat_add(p, p->list, &p->nlist, p->start, bol);
+}
+
+// Run output through p. Returns how many bytes it took to complete the
+// first match, -1 if none did.
+static ssize_t pat_feed(Pattern *p, const char *data, size_t len) {
+    if (p->matched) return 0;
+    for (size_t i = 0; i < len; i++) {
+        int c = (unsigned char)data[i];
+        // $ holds right before a line ending.
+        if (c == '\r' || c == '\n') {
+            for (int j = 0; j < p->nlist; j++) {
+                PatState *st = &p->states[p->list[j]];
+                if (st->op == PAT_EOL) pat_add(p, p->list, &p->nlist, st->out, p->bol);
+            }
+            if (p->matched) return i;
+        }
+        pat_generation(p);
+        int n = 0, bol = c == '\n';
+        for (int j = 0; j < p->nlist; j++) {
+            PatState *st = &p->states[p->list[j]];
+            if (st->op == PAT_BYTE && pat_has(st->set, c)) pat_add(p, p->next, &n, st->out, bol);
+        }
+        pat_add(p, p->next, &n, p->start, bol);  // or one starting here
+        int *list = p->list;
+        p->list = p->next;
+        p->next = list;
+        p->nlist = n;
+        p->bol = bol;
+        if (p->matched) return i + 1;
+    }
+    return -1;
+}
+
+/**********************************************************************
+ *                              SHARDS
+ **********************************************************************/
+
+// One thread runs everything unless NIMT_SHARDS=N asks for N I/O
+// shards, each a thread with its own event loop. A session belongs to
+// one shard: its pty, timers, recording, emulator and attached clients
+// are only touched there. The main thread listens, answers requests,
+// owns the session table, pools and pid map, and reaps children; it
+// has a shard act on a session by posting it an EvTask (start, setup,
+// teardown, a SessionOp), and an ATTACH moves the connection itself
+// over (AttachOp). Spawns run on the spawner thread, which posts the
+// children back (SpawnJob), so neither requests nor relaying wait on
+// fork. Without shards each of these runs inline on the main thread.
+//
+// A session is freed by its teardown, posted once the main thread has
+// dropped it from the table; whatever was posted to it before runs
+// first, so no task outlives its session.
+
+static void *shard_main(void *arg) {
+    Shard *sh = arg;
+    while (!sh->stop) ev_run_once(&sh->loop);
+    return NULL;
+}
+
+static void shard_stop(EvTask *t) {
+    CONTAINER_OF(t, Shard, stop_task)->stop = 1;
+}
+
+// Run t on sh: posted to its thread, or at once on the main thread.
+static void shard_call(Shard *sh, EvTask *t) {
+    if (sh == &g_main) t->cb(t);
+    else ev_post(&sh->loop, t);
+}
+
+// The least loaded shard, for a new session.
+static Shard *shard_pick(void) {
+    if (!g_nshards) return &g_main;
+    Shard *best = &g_shards[0];
+    for (int i = 1; i < g_nshards; i++)
+        if (g_shards[i].sessions < best->sessions) best = &g_shards[i];
+    return best;
+}
+
+#if NIMT_WITH_SHARDS
+static void shards_init(int n) {
+    g_nshards = n;
+    g_shards = calloc(n, sizeof(Shard));
+    if (!g_shards) perror_exit("calloc");
+    for (int i = 0; i < n; i++) ev_init(&g_shards[i].loop);
+    ev_init(&g_spawner.loop);
+}
+#endif
+
+// Threads start with every signal blocked, so handlers run on the main
+// thread.
+static void shards_start(void) {
+    if (!g_nshards) return;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i <= g_nshards; i++) {
+        Shard *sh = i < g_nshards ? &g_shards[i] : &g_spawner;
+        sh->stop = 0;
+        int err = pthread_create(&sh->thread, NULL, shard_main, sh);
+        if (err) {
+            errno = err;
+            perror_exit("pthread_create");
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Join every thread once it has run what was posted to it, then take
+// in what they posted back.
+static void shards_stop(void) {
+    if (!g_nshards) return;
+    for (int i = 0; i <= g_nshards; i++) {
+        Shard *sh = i < g_nshards ? &g_shards[i] : &g_spawner;
+        sh->stop_task.cb = shard_stop;
+        ev_post(&sh->loop, &sh->stop_task);
+    }
+    for (int i = 0; i <= g_nshards; i++)
+        pthread_join(i < g_nshards ? g_shards[i].thread : g_spawner.thread, NULL);
+    ev_run_tasks(&g_main.loop);
+}
+
+/**********************************************************************
+ *                          SESSION FUNCTIONS
+ **********************************************************************/
+
+static void session_event(EvHandle *h, unsigned revents);
+static void session_notify_timer(EvTimer *t);
+static void watch_notify(Session *s, uint8_t event);
+static void watch_post(Session *s, uint8_t event);
+static void session_rate_timer(EvTimer *t);
+static void session_idle_timer(EvTimer *t);
+static void session_idle_arm(Session *s);
+static void session_thaw(Session *s, size_t extra);
+static void session_wake(Session *s);
+static void conn_update_interest(Conn *c);
+static int conn_flush(Conn *c);
+static int conn_has_output(const Conn *c);
+static void conn_close(Conn *c);
+static void wait_cancel_all(Wait *w);
+static void pool_unlink(Session *s);
+static int wait_feed(Wait *w, uint64_t from);
+static void wait_done(Wait *w, const char *err);
+
+// Oldest scrollback offset a reader at from can have. A read with the
+// kernel keeps the ring's oldest bytes from readers, which it may be
+// writing over; one that wants them has it called back.
+static uint64_t session_tail(Session *s, uint64_t from) {
+    Ring *r = &s->scrollback;
+    if (from < ring_tail(r) && r->reserved) {
+        ev_read_pause(&s->ev);
+        r->reserved = ev_read_pending(&s->ev);
+    }
+    return ring_tail(r);
+}
+
+// Start or stop emulating the screen; a new Vt is brought up to date
+// from what the scrollback still holds.
+static void session_set_screen(Session *s, int on) {
+    if (s->scrollback.file) s->scrollback.file->screen = on;
+    if (!on) {
+        vt_free(s->vt);
+        s->vt = NULL;
+        return;
+    }
+    if (s->vt) return;
+    struct winsize ws = {24, 80, 0, 0};
+    if (s->master_fd >= 0) ioctl(s->master_fd, TIOCGWINSZ, &ws);
+    s->vt = vt_new(ws.ws_row ? ws.ws_row : 24, ws.ws_col ? ws.ws_col : 80);
+    session_wake(s);
+    struct iovec iov[2];
+    int n = ring_iov(&s->scrollback, session_tail(s, 0), iov);
+    for (int i = 0; i < n; i++) vt_feed(s->vt, iov[i].iov_base, iov[i].iov_len);
+}
+
+static void session_resize(Session *s, const struct winsize *ws) {
+    ioctl(s->master_fd, TIOCSWINSZ, ws);
+    if (s->vt) vt_resize(s->vt, ws->ws_row, ws->ws_col);
+}
+
+// Whether the pty is still up: the main thread asks while the session's
+// shard may be hanging it up.
+static int session_alive(Session *s) {
+    return __atomic_load_n(&s->master_fd, __ATOMIC_RELAXED) >= 0;
+}
+
+static void session_start(EvTask *t) {
+    Session *s = CONTAINER_OF(t, Session, start);
+    ev_add(&s->shard->loop, &s->ev, s->master_fd, EV_READ, session_event);
+    ev_register_buffer(&s->ev, s->scrollback.data, s->scrollback.size);
+    if (g_hibernate_us) session_idle_arm(s);
+}
+
+// Put a session on a shard; it starts reading its pty there.
+static void session_place(Session *s) {
+    s->shard = shard_pick();
+    s->shard->sessions++;
+    if (s->master_fd < 0) return;
+    s->start.cb = session_start;
+    shard_call(s->shard, &s->start);
+}
+
+// Start tracking a child and its pty, without giving it an ID yet. Its
+// scrollback is made smaller if it would not fit in NIMT_MEMORY.
+static Session *new_session(pid_t child_pid, int master_fd, size_t scrollback) {
+    while (g_mem_budget && scrollback > SCROLLBACK_MIN && mem_used() + scrollback > g_mem_budget)
+        scrollback >>= 1;
+    if (scrollback > SCROLLBACK_MIN) g_mem_exhausted = 0;
+    Session *s = slab_calloc(&g_session_slab);
+    s->ring_size = scrollback;
+    s->child_pid = child_pid;
+    s->master_fd = master_fd;
+    ev_timer_init(&s->notify_timer, session_notify_timer);
+    ev_timer_init(&s->rate_timer, session_rate_timer);
+    ev_timer_init(&s->idle_timer, session_idle_timer);
+    char name[32];
+    snprintf(name, sizeof(name), "%d.ring", (int)child_pid);
+    ring_init(&s->scrollback, scrollback, name);
+    if (s->scrollback.file) s->scrollback.file->pid = child_pid;
+    set_nonblock_cloexec(master_fd);
+    pid_insert(s);
+    session_place(s);
+    return s;
+}
+
+static void session_set_id(Session *s, int id) {
+    s->id = id;
+    if (s->scrollback.file) s->scrollback.file->id = id;
+}
+
+// Add a session to the table
+static Session *add_session(pid_t child_pid, int master_fd, size_t scrollback) {
+    Session *s = new_session(child_pid, master_fd, scrollback);
+    session_set_id(s, slot_alloc(s));
+    return s;
+}
+
+// Find a session by ID
+static Session *find_session(int id) {
+    if (id < 1 || id > g_nslots) return NULL;
+    return g_slots[id - 1].session;
+}
+
+// How much the pty may still put into the scrollback before it laps a
+// client that asked not to be lapped.
+static size_t session_output_room(const Session *s) {
+    size_t room = s->scrollback.size;
+    for (Conn *c = s->subscribers; c; c = c->sub_next) {
+        if (c->policy != POLICY_BLOCK) continue;
+        size_t left = s->scrollback.size - (s->scrollback.head - c->cursor);
+        if (left < room) room = left;
+    }
+    return room;
+}
+
+// How much output the session's cap lets through now. The allowance
+// builds up at rate, to at most RATE_BURST_US worth; once it is spent
+// reading pauses, and the child blocks on a full pty, until a pty
+// read's worth has built up again.
+static size_t session_allowance(Session *s) {
+    if (!s->rate) return SIZE_MAX;
+    if (s->rate_timer.index >= 0) return 0;
+    uint64_t now = now_us(CLOCK_MONOTONIC);
+    uint64_t burst = s->rate * RATE_BURST_US;
+    if (burst < 1000000) burst = 1000000;
+    uint64_t elapsed = now - s->credited;
+    s->credit += elapsed < RATE_BURST_US ? elapsed * s->rate : burst;
+    if (s->credit > burst) s->credit = burst;
+    s->credited = now;
+    if (s->credit >= 1000000) return s->credit / 1000000;
+    uint64_t resume = PTY_READ_MAX * 1000000 < burst ? PTY_READ_MAX * 1000000 : burst;
+    if (s->master_fd >= 0)
+        ev_timer_start(&s->shard->loop, &s->rate_timer, now + (resume - s->credit) / s->rate);
+    return 0;
+}
+
+// The pty is always read unless a blocking subscriber is a full ring
+// behind or the output cap is spent, and written only while keystrokes
+// are queued for it.
+static void session_update_interest(Session *s) {
+    unsigned events = 0;
+    if (session_output_room(s) > 0 && session_allowance(s) > 0)
+        events |= EV_READ;
+    if (buf_pending(&s->input) > 0)
+        events |= EV_WRITE;
+    ev_set(&s->ev, events);
+}
+
+static void session_rate_timer(EvTimer *t) {
+    session_update_interest(CONTAINER_OF(t, Session, rate_timer));
+}
+
+// Queue output that is not in the scrollback for a subscriber.
+static void subscriber_send(Conn *c, const void *data, size_t n) {
+    lz_write(c->lz, &c->out, data, n);
+}
+
+static void subscriber_repaint(Session *s, Conn *c) {
+    if (!c->lz) {
+        vt_repaint(s->vt, &c->out);
+        return;
+    }
+    Buf screen = {0};
+    vt_repaint(s->vt, &screen);
+    subscriber_send(c, screen.data + screen.off, buf_pending(&screen));
+    buf_free(&screen);
+}
+
+// NIMT_RECORD and NIMT_SCREEN, for a session just handed out.
+static void session_setup(EvTask *t) {
+    Session *s = CONTAINER_OF(t, Session, setup);
+    session_wake(s);  // a warm child may have been stopped
+    if (g_record_all && record_start(s) < 0) perror("record");
+    if (g_screen_all) session_set_screen(s, 1);
+}
+
+static void session_subscribe(Session *s, Conn *c, AttachPolicy policy) {
+    session_wake(s);
+    c->state = CONN_ATTACHED;
+    c->session = s;
+    c->policy = policy;
+    c->ev.urgent = 1;  // its keystrokes before anyone's output
+    if (s->vt) {
+        // Constant-size repaint instead of a replay of the scrollback.
+        subscriber_repaint(s, c);
+        c->cursor = s->scrollback.head;
+    } else {
+        c->cursor = session_tail(s, 0);  // replay what we have
+    }
+    c->sub_next = s->subscribers;
+    s->subscribers = c;
+    stat_add(&s->attached, 1);
+    stat_add(&s->shard->stats.attached, 1);
+    session_update_interest(s);
+    watch_post(s, WATCH_ATTACHED);
+}
+
+static void session_unsubscribe(Session *s, Conn *c) {
+    Conn **pp = &s->subscribers;
+    while (*pp && *pp != c) pp = &(*pp)->sub_next;
+    if (*pp) *pp = c->sub_next;
+    c->session = NULL;
+    stat_add(&s->attached, -1);
+    stat_add(&s->shard->stats.attached, -1);
+    session_update_interest(s);
+    watch_post(s, WATCH_DETACHED);
+}
+
+// Hand scrollback [from, head) to the recording, the emulator and the
+// waits on the session.
+static void session_consume(Session *s, uint64_t from) {
+    if (NIMT_WITH_RECORD && s->rec) record_output(s, from);
+    if (NIMT_WITH_SCREEN && s->vt) {
+        struct iovec iov[2];
+        int n = ring_iov(&s->scrollback, from, iov);
+        for (int i = 0; i < n; i++) vt_feed(s->vt, iov[i].iov_base, iov[i].iov_len);
+    }
+    for (Wait *w = s->waits, *next; w; w = next) {
+        next = w->next;
+        if (wait_feed(w, from)) wait_done(w, NULL);
+    }
+}
+
+// Drain the pty into the scrollback. Returns -1 once it has hung up.
+static int session_read_pty(Session *s) {
+    Stats *st = &s->shard->stats;
+    uint64_t start = s->scrollback.head;
+    uint64_t unseen = start;
+    int consumed = (NIMT_WITH_RECORD && s->rec) || (NIMT_WITH_SCREEN && s->vt) || s->waits;
+    int rc = 0;
+    for (int i = 0; i < PTY_READS_PER_WAKEUP; i++) {
+        size_t room = session_output_room(s);
+        size_t allowed = session_allowance(s);
+        if (allowed < room) room = allowed;
+        if (room == 0) break;
+        size_t len;
+        char *p = ring_write_ptr(&s->scrollback, &len);
+        if (len > room) len = room;
+        if (len > PTY_READ_MAX) len = PTY_READ_MAX;
+        // Consumers take the whole wakeup at once (one recording
+        // frame), unless this read could overwrite some of it first.
+        if (consumed && s->scrollback.head - unseen + len > s->scrollback.size) {
+            session_consume(s, unseen);
+            unseen = s->scrollback.head;
+        }
+        ssize_t n = ev_read(&s->ev, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_clear(&s->ev, EV_READ);
+                break;
+            }
+            rc = -1;  // EIO: the slave side is gone
+            break;
+        }
+        if (n == 0) {
+            rc = -1;
+            break;
+        }
+        if (NIMT_WITH_HIBERNATE && s->hibernating) session_thaw(s, n);
+        ring_commit(&s->scrollback, n);
+        stat_add(&st->pty_reads, 1);
+        stat_add(&st->pty_bytes, n);
+        if (NIMT_WITH_METRICS) hist_add(&st->read_size, READ_SIZE_BOUNDS, n);
+        if (s->rate) s->credit -= s->credit < (uint64_t)n * 1000000 ? s->credit : (uint64_t)n * 1000000;
+    }
+    s->scrollback.reserved = ev_read_pending(&s->ev);
+    if (consumed && s->scrollback.head > unseen) session_consume(s, unseen);
+    if (NIMT_WITH_METRICS && start == s->notified && s->scrollback.head > start)
+        s->output_since = now_us(CLOCK_MONOTONIC);
+    return rc;
+}
+
+// Skip a client over output it has fallen behind on.
+static void session_drop(Session *s, Conn *c, uint64_t to) {
+    stat_add(&s->dropped, to - c->cursor);
+    stat_add(&s->shard->stats.dropped_bytes, to - c->cursor);
+    c->cursor = to;
+}
+
+// The current screen replaces all the client has not been sent. CAN
+// first aborts any escape sequence the skipped bytes left half sent.
+static void session_collapse(Session *s, Conn *c) {
+    session_drop(s, c, s->scrollback.head);
+    subscriber_send(c, "\x18", 1);
+    subscriber_repaint(s, c);
+}
+
+// Fan new scrollback out to every subscriber, each at its own pace.
+// A dropping subscriber of an emulated screen that falls behind gets
+// the screen as it is now instead of every state in between.
+static void session_notify(Session *s) {
+    int fresh = s->scrollback.head > s->notified && s->subscribers;
+    s->notified = s->scrollback.head;
+    s->last_notify = now_us(CLOCK_MONOTONIC);
+    s->keystroke = 0;
+    ev_timer_stop(&s->shard->loop, &s->notify_timer);
+    Conn *next;
+    for (Conn *c = s->subscribers; c; c = next) {
+        next = c->sub_next;
+        uint64_t tail = session_tail(s, c->cursor);
+        if (c->cursor < tail) {
+            if (c->policy == POLICY_DISCONNECT) {
+                conn_close(c);
+                continue;
+            }
+            if (s->vt) session_collapse(s, c);
+            else session_drop(s, c, tail);
+        } else if (c->policy == POLICY_DROP && s->vt && !buf_pending(&c->out) &&
+                   s->scrollback.head - c->cursor > COLLAPSE_BYTES) {
+            session_collapse(s, c);
+        }
+        if (conn_flush(c) < 0) {
+            conn_close(c);
+            continue;
+        }
+        conn_update_interest(c);
+    }
+    if (NIMT_WITH_METRICS && fresh)
+        hist_add(&s->shard->stats.relay_latency, LATENCY_BOUNDS_US,
+                 now_us(CLOCK_MONOTONIC) - s->output_since);
+}
+
+static void session_notify_timer(EvTimer *t) {
+    session_notify(CONTAINER_OF(t, Session, notify_timer));
+}
+
+// Push new output at once if the session was quiet or a keystroke is
+// waiting for its echo. Under a flood, push at most every COALESCE_US
+// unless COALESCE_BYTES pile up first, so a burst of tiny pty writes
+// leaves as one socket write.
+static void session_output(Session *s) {
+    if (s->scrollback.head == s->notified) return;
+    uint64_t now = now_us(CLOCK_MONOTONIC);
+    if (s->keystroke || now - s->last_notify >= COALESCE_US ||
+        s->scrollback.head - s->notified >= COALESCE_BYTES)
+        session_notify(s);
+    else if (s->notify_timer.index < 0)
+        ev_timer_start(&s->shard->loop, &s->notify_timer, s->last_notify + COALESCE_US);
+}
+
+// The child closed the terminal: hand each client what it has not seen
+// yet and drop the master; the reaper removes the session once the
+// child is waited for.
+static void session_hangup(Session *s) {
+    ev_read_sync(&s->ev);  // nothing may land in the ring behind us
+    // Output held back for coalescing may have lapped a client: deal
+    // with it by its policy first, the ring no longer has its cursor.
+    if (s->subscribers) session_notify(s);
+    while (s->subscribers) {
+        Conn *c = s->subscribers;
+        struct iovec iov[2];
+        int n = ring_iov(&s->scrollback, c->cursor, iov);
+        for (int i = 0; i < n; i++) subscriber_send(c, iov[i].iov_base, iov[i].iov_len);
+        session_unsubscribe(s, c);
+        c->state = CONN_CLOSING;
+        if (conn_flush(c) < 0 || !conn_has_output(c))
+            conn_close(c);
+        else
+            conn_update_interest(c);
+    }
+    while (s->waits) wait_done(s->waits, "session exited");
+    ev_close(&s->ev);
+    __atomic_store_n(&s->master_fd, -1, __ATOMIC_RELAXED);
+}
+
+static void session_event(EvHandle *h, unsigned revents) {
+    Session *s = CONTAINER_OF(h, Session, ev);
+
+    if (revents & EV_WRITE) {
+        if (buf_flush(&s->input, &s->ev, 0) < 0) {
+            session_hangup(s);
+            return;
+        }
+        if (buf_pending(&s->input) == 0) {
+            for (Conn *c = s->subscribers; c; c = c->sub_next)
+                conn_update_interest(c);
+        }
+    }
+
+    if (revents & (EV_READ | EV_ERROR)) {
+        int rc = session_read_pty(s);
+        session_output(s);
+        if (rc < 0) {
+            session_hangup(s);
+            return;
+        }
+    }
+    session_update_interest(s);
+}
+
+static void session_teardown(EvTask *t) {
+    Session *s = CONTAINER_OF(t, Session, teardown);
+    session_wake(s);  // the ring's accounting and the packed copy
+    ev_timer_stop(&s->shard->loop, &s->notify_timer);
+    ev_timer_stop(&s->shard->loop, &s->rate_timer);
+    ev_timer_stop(&s->shard->loop, &s->idle_timer);
+    if (s->master_fd >= 0) {
+        ev_read_sync(&s->ev);
+        session_read_pty(s);
+    }
+    session_hangup(s);
+    record_stop(s);
+    vt_free(s->vt);
+    buf_free(&s->input);
+    ring_free(&s->scrollback);
+    ev_defer_free(&s->shard->loop, s);
+}
+
+// Whether l asks for a cgroup, not just an output cap.
+static int limits_cgroup(const Limits *l) {
+    return l->cpu || l->memory || l->io;
+}
+
+// Make a new cgroup under CGROUP_FOLDER for one child, with the
+// controllers limits need, and put its path in dir. A spawn makes it
+// before there is a pid, so groups are numbered instead: the first
+// free number, as an upgraded daemon's sessions may hold some. Returns
+// the number, 0 on failure.
+static uint32_t cgroup_make(char *dir, size_t size) {
+    static uint32_t last;  // main and spawner thread
+    // Each controller on its own: the kernel may lack some.
+    cgroup_write(CGROUP_FOLDER, "cgroup.subtree_control", "+cpu");
+    cgroup_write(CGROUP_FOLDER, "cgroup.subtree_control", "+memory");
+    cgroup_write(CGROUP_FOLDER, "cgroup.subtree_control", "+io");
+    for (;;) {
+        uint32_t n = __atomic_add_fetch(&last, 1, __ATOMIC_RELAXED);
+        if (!n) continue;
+        cgroup_session_dir(n, dir, size);
+        if (mkdir(dir, 0755) == 0) return n;
+        if (errno != EEXIST) return 0;
+    }
+}
+
+// Apply the cgroup limits in l that are not 0: cpu in percent of one
+// CPU, memory in bytes, io as a weight.
+static int cgroup_set_limits(const char *dir, const Limits *l) {
+    char value[64];
+    if (l->cpu) {
+        snprintf(value, sizeof(value), "%llu 100000", (unsigned long long)l->cpu * 1000);
+        if (cgroup_write(dir, "cpu.max", value) < 0) return -1;
+    }
+    if (l->memory) {
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)l->memory);
+        if (cgroup_write(dir, "memory.max", value) < 0) return -1;
+    }
+    if (l->io) {
+        snprintf(value, sizeof(value), "default %u", l->io);
+        if (cgroup_write(dir, "io.weight", value) < 0) return -1;
+    }
+    return 0;
+}
+
+// Note the child's own cgroup, for remove_session(); its shard reads it
+// to reclaim memory.
+static void session_mark_cgroup(Session *s, uint32_t cgroup) {
+    __atomic_store_n(&s->cgroup, cgroup, __ATOMIC_RELAXED);
+    if (s->scrollback.file) s->scrollback.file->cgroup = cgroup;
+}
+
+// Give a running child a cgroup of its own under CGROUP_FOLDER, with
+// l's limits. Processes it started before are left where they are; a
+// spawn with OP_SPAWN_LIMITED has none outside.
+static int session_set_cgroup(Session *s, const Limits *l) {
+    char dir[256], value[32];
+    if (!s->child_pid) {
+        errno = ESRCH;
+        return -1;
+    }
+    if (s->cgroup) {
+        cgroup_session_dir(s->cgroup, dir, sizeof(dir));
+    } else {
+        uint32_t cgroup = cgroup_make(dir, sizeof(dir));
+        if (!cgroup) return -1;
+        session_mark_cgroup(s, cgroup);
+    }
+    if (cgroup_set_limits(dir, l) < 0) return -1;
+    snprintf(value, sizeof(value), "%d", (int)s->child_pid);
+    return cgroup_write(dir, "cgroup.procs", value);
+}
+
+// Remove a session from the table; its shard frees it.
+static void remove_session(Session *s) {
+    if (s->cgroup) {
+        // Fails while something the child left behind still runs there.
+        char dir[256];
+        cgroup_session_dir(s->cgroup, dir, sizeof(dir));
+        rmdir(dir);
+    }
+    if (s->child_pid) pid_remove(s->child_pid);
+    if (s->id) watch_notify(s, WATCH_EXITED);
+    free(s->command);
+    s->command = NULL;
+    if (s->pool) pool_unlink(s);
+    else if (s->id) slot_release(s->id);
+    s->shard->sessions--;
+    s->teardown.cb = session_teardown;
+    shard_call(s->shard, &s->teardown);
+}
+
+// Shrink the scrollback to the size the main thread asked for, see
+// mem_reclaim(). Subscribers it drops output for are treated as if
+// the pty had lapped them.
+static void session_shrink(EvTask *t) {
+    Session *s = CONTAINER_OF(t, Session, shrink);
+    Ring *r = &s->scrollback;
+    session_wake(s);
+    if (s->ring_size < r->size) {
+        size_t extra = 0;
+        if (s->master_fd >= 0) {
+            ev_read_pause(&s->ev);  // the kernel must be done with the old ring
+            extra = ev_read_pending(&s->ev);
+        }
+        if (ring_resize(r, s->ring_size, extra) == 0 && s->master_fd >= 0) {
+            r->reserved = extra;
+            ev_register_buffer(&s->ev, r->data, r->size);
+            if (s->subscribers) session_notify(s);
+            session_update_interest(s);
+        }
+    }
+    __atomic_sub_fetch(&g_mem_shrinks, 1, __ATOMIC_RELEASE);
+}
+
+// Bytes capping s's scrollback at cap would give back, and with apply
+// have its shard do so.
+static size_t session_cap_ring(Session *s, size_t cap, int apply) {
+    if (s->ring_size <= cap) return 0;
+    size_t freed = s->ring_size - cap;
+    if (apply) {
+        s->ring_size = cap;
+        __atomic_add_fetch(&g_mem_shrinks, 1, __ATOMIC_RELAXED);
+        s->shrink.cb = session_shrink;
+        shard_call(s->shard, &s->shrink);
+    }
+    return freed;
+}
+
+static size_t mem_cap_rings(size_t cap, int apply) {
+    size_t freed = 0;
+    for (int i = 0; i < g_nslots; i++)
+        if (g_slots[i].session) freed += session_cap_ring(g_slots[i].session, cap, apply);
+    for (Pool *p = g_pools; p; p = p->next)
+        for (Session *s = p->sessions; s; s = s->pool_next) freed += session_cap_ring(s, cap, apply);
+    return freed;
+}
+
+// Over NIMT_MEMORY, cap every scrollback ring at the largest size that
+// gives back the excess; the largest rings lose their oldest output
+// first, and none goes below SCROLLBACK_MIN. Runs between turns of the
+// main loop, and waits for the shrinks it posted before going again.
+static void mem_reclaim(void) {
+    if (!g_mem_budget || g_mem_exhausted || __atomic_load_n(&g_mem_shrinks, __ATOMIC_ACQUIRE))
+        return;
+    size_t used = mem_used();
+    if (used <= g_mem_budget) return;
+    size_t cap = SCROLLBACK_MAX;
+    while (cap > SCROLLBACK_MIN && mem_cap_rings(cap, 0) < used - g_mem_budget) cap >>= 1;
+    if (!mem_cap_rings(cap, 1)) g_mem_exhausted = 1;
+}
+
+// Kill the child; the reaper removes the session. A session recovered
+// after a crash has no child of ours left and goes at once.
+static void session_kill(Session *s) {
+    if (s->child_pid) kill(s->child_pid, SIGKILL);
+    else remove_session(s);
+}
+
+/**********************************************************************
+ *                            HIBERNATION
+ **********************************************************************/
+
+// With NIMT_HIBERNATE=SECONDS, a session that has written nothing for
+// that long, with no one attached or waiting on it, hibernates on its
+// shard: its scrollback is compressed (the COMPRESSION coder) and the
+// ring's pages handed back, so the daemon holds what idle sessions
+// wrote, compressed, not a ring each. NIMT_HIBERNATE_STOP also stops the
+// child (its process group and the pty's foreground one) and, if it has
+// a cgroup of its own, has the kernel push its memory out to swap. That
+// is for shells left open: a job that is quiet for a while is stopped
+// too. Whatever needs the scrollback or the child wakes the session
+// first: pty output, an attach, OP_READ, OP_SEND, OP_WAIT, an upgrade.
+// A crash while hibernating loses the scrollback, not the session.
+
+enum { HIBERNATE_RING = 1, HIBERNATE_CHILD = 2 };
+
+#if NIMT_WITH_HIBERNATE
+static void session_idle_arm(Session *s) {
+    ev_timer_start(&s->shard->loop, &s->idle_timer, now_us(CLOCK_MONOTONIC) + g_hibernate_us);
+}
+
+// Ask the child's own cgroup to give back all it uses.
+static void session_reclaim(Session *s) {
+    char dir[256], path[300], current[32];
+    uint32_t cgroup = __atomic_load_n(&s->cgroup, __ATOMIC_RELAXED);
+    if (!cgroup) return;  // none of its own
+    cgroup_session_dir(cgroup, dir, sizeof(dir));
+    snprintf(path, sizeof(path), "%s/memory.current", dir);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    ssize_t n = read(fd, current, sizeof(current) - 1);
+    close(fd);
+    if (n <= 0) return;
+    current[n] = 0;
+    cgroup_write(dir, "memory.reclaim", current);  // EAGAIN: it got back less, fine
+}
+
+static void session_hibernate(Session *s) {
+    Ring *r = &s->scrollback;
+    Stats *st = &s->shard->stats;
+    ev_read_pause(&s->ev);  // the kernel must be done with the ring
+    if (ev_read_pending(&s->ev)) return;  // output after all
+    r->reserved = 0;
+    if (ring_releasable(r)) {
+        uint64_t from = ring_tail(r);
+        Lz *z = lz_new();
+        struct iovec iov[2];
+        int n = ring_iov(r, from, iov);
+        for (int i = 0; i < n; i++) lz_write(z, &s->packed, iov[i].iov_base, iov[i].iov_len);
+        lz_free(z);
+        buf_trim(&s->packed);
+        ev_unregister_buffer(&s->ev);
+        if (ring_release(r) == 0) {
+            s->packed_from = from;
+            s->hibernating |= HIBERNATE_RING;
+            mem_account(r->size, -1);
+            stat_add(&st->packed_bytes, s->packed.len);
+        } else {
+            buf_free(&s->packed);
+            ev_register_buffer(&s->ev, r->data, r->size);
+        }
+    }
+    if (g_hibernate_stop && s->child_pid > 0) {
+        pid_t fg = tcgetpgrp(s->master_fd);
+        kill(-s->child_pid, SIGSTOP);
+        if (fg > 0 && fg != s->child_pid && kill(-fg, SIGSTOP) == 0) s->stopped_pgrp = fg;
+        session_reclaim(s);
+        s->hibernating |= HIBERNATE_CHILD;
+    }
+    if (s->hibernating) stat_add(&st->hibernating, 1);
+}
+
+// Bring a hibernating session back. extra bytes have been read past
+// head into the ring since; the oldest scrollback they wrapped over
+// stays lost.
+static void session_thaw(Session *s, size_t extra) {
+    Ring *r = &s->scrollback;
+    Stats *st = &s->shard->stats;
+    if (s->hibernating & HIBERNATE_RING) {
+        uint64_t end = r->head + extra;
+        uint64_t keep = end > r->size ? end - r->size : 0;
+        uint64_t off = s->packed_from;
+        Lz *z = lz_new();
+        for (size_t pos = 0; pos + 8 <= s->packed.len;) {
+            const char *p = s->packed.data + pos;
+            uint32_t raw = get_u32(p), body = get_u32(p + 4);
+            const char *out = lz_decompress(z, p + 8, body, raw);
+            if (!out) break;  // we wrote it ourselves
+            size_t skip = keep > off ? keep - off : 0;
+            if (skip < raw) ring_copy(r, off + skip, (char *)out + skip, raw - skip, 1);
+            off += raw;
+            pos += 8 + (body & LZ_STORED ? body & ~LZ_STORED : body);
+        }
+        lz_free(z);
+        stat_add(&st->packed_bytes, -(uint64_t)s->packed.len);
+        buf_free(&s->packed);
+        mem_account(r->size, 1);
+        if (s->master_fd >= 0) ev_register_buffer(&s->ev, r->data, r->size);
+    }
+    if (s->hibernating & HIBERNATE_CHILD) {
+        if (s->stopped_pgrp) kill(-s->stopped_pgrp, SIGCONT);
+        kill(-s->child_pid, SIGCONT);
+        s->stopped_pgrp = 0;
+    }
+    s->hibernating = 0;
+    stat_add(&st->hibernating, -1);
+    s->idle_head = r->head;
+    if (s->master_fd >= 0) session_idle_arm(s);
+}
+
+// Before anything touches a session's scrollback or child.
+static void session_wake(Session *s) {
+    if (!s->hibernating) return;
+    size_t extra = 0;
+    if (s->master_fd >= 0) {
+        ev_read_pause(&s->ev);
+        extra = ev_read_pending(&s->ev);
+    }
+    session_thaw(s, extra);
+}
+
+// Every NIMT_HIBERNATE: hibernate if nothing happened since the last look.
+static void session_idle_timer(EvTimer *t) {
+    Session *s = CONTAINER_OF(t, Session, idle_timer);
+    if (s->master_fd < 0) return;
+    if (s->scrollback.head == s->idle_head && !s->subscribers && !s->waits &&
+        !buf_pending(&s->input))
+        session_hibernate(s);
+    s->idle_head = s->scrollback.head;
+    if (!s->hibernating) session_idle_arm(s);
+}
+#else
+// Built without hibernation: no session ever sleeps.
+static void session_idle_arm(Session *s) {
+    (void)s;
+}
+
+static void session_thaw(Session *s, size_t extra) {
+    (void)s;
+    (void)extra;
+}
+
+static void session_wake(Session *s) {
+    (void)s;
+}
+
+static void session_idle_timer(EvTimer *t) {
+    (void)t;
+}
+#endif
+
+/**********************************************************************
+ *                        CONNECTION FUNCTIONS
+ **********************************************************************/
+
+static void conn_event(EvHandle *h, unsigned revents);
+
+static Conn *conn_new(Shard *sh, int fd) {
+    Conn *c = slab_calloc(&g_conn_slab);
+    c->state = CONN_COMMAND;
+    c->shard = sh;
+    set_nonblock_cloexec(fd);
+    ev_add(&sh->loop, &c->ev, fd, EV_READ, conn_event);
+    c->next = sh->conns;
+    sh->conns = c;
+    stat_add(&sh->stats.conns, 1);
+    return c;
+}
+
+// Free a connection; one with jobs in flight is freed by the last of
+// them, see conn_job_done().
+static void conn_close(Conn *c) {
+    if (c->session) session_unsubscribe(c->session, c);
+    Conn **pp = &c->shard->conns;
+    while (*pp && *pp != c) pp = &(*pp)->next;
+    if (*pp) *pp = c->next;
+    if (c->watch) {
+        for (pp = &g_watchers; *pp && *pp != c; pp = &(*pp)->watch_next);
+        if (*pp) *pp = c->watch_next;
+        __atomic_sub_fetch(&g_nwatchers, 1, __ATOMIC_RELAXED);
+        free(c->watch);
+        c->watch = NULL;
+    }
+    wait_cancel_all(c->waits);
+    stat_add(&c->shard->stats.conns, -1);
+    ev_close(&c->ev);
+    buf_free(&c->in);
+    buf_free(&c->out);
+    lz_free(c->lz);
+    c->lz = NULL;
+    c->state = CONN_CLOSING;
+    if (!c->jobs) ev_defer_free(&c->shard->loop, c);
+}
+
+static void conn_printf(Conn *c, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void conn_printf(Conn *c, const char *fmt, ...) {
+    char line[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n >= sizeof(line)) n = sizeof(line) - 1;
+    buf_append(&c->out, line, n);
+}
+
+static int conn_has_output(const Conn *c) {
+    if (buf_pending(&c->out) > 0) return 1;
+    return c->session && c->cursor < c->session->scrollback.head;
+}
+
+// Send queued replies, then whatever scrollback the client has not seen.
+// Returns -1 when the client is gone.
+static int conn_flush(Conn *c) {
+    if (buf_flush(&c->out, &c->ev, 1) < 0) return -1;
+    if (buf_pending(&c->out) > 0 || !c->session) return 0;
+
+    Ring *r = &c->session->scrollback;
+    // Lapped: session_notify() decides what it gets instead.
+    if (c->cursor < session_tail(c->session, c->cursor)) return 0;
+    // Compressed, a block at a time: the backlog of a slow client stays
+    // in the ring, where its policy sees it.
+    while (NIMT_WITH_COMPRESS && c->lz && c->cursor < r->head) {
+        struct iovec iov[2];
+        int n = ring_iov(r, c->cursor, iov);
+        size_t len = 0;
+        for (int i = 0; i < n; i++) {
+            if (iov[i].iov_len > LZ_BLOCK - len) iov[i].iov_len = LZ_BLOCK - len;
+            len += iov[i].iov_len;
+        }
+        lz_compress(c->lz, iov, n, &c->out);
+        c->cursor += len;
+        stat_add(&c->shard->stats.relay_bytes, len);
+        if (buf_flush(&c->out, &c->ev, 1) < 0) return -1;
+        if (buf_pending(&c->out) > 0) return 0;
+    }
+    while (c->cursor < r->head) {
+        struct msghdr msg;
+        struct iovec iov[2];
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = ring_iov(r, c->cursor, iov);
+        ssize_t n = sendmsg(c->ev.fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_clear(&c->ev, EV_WRITE);
+                return 0;
+            }
+            return -1;
+        }
+        c->cursor += n;
+        stat_add(&c->shard->stats.relay_bytes, n);
+    }
+    return 0;
+}
+
+// Stop taking requests from a client that does not read replies, or
+// past what jobs in flight hold back.
+static int conn_wants_requests(const Conn *c) {
+    return !c->eof && buf_pending(&c->out) < CONN_REPLY_LIMIT && c->jobs < CONN_JOBS_MAX &&
+           (!c->jobs || buf_pending(&c->in) < CONN_REPLY_LIMIT);
+}
+
+static void conn_update_interest(Conn *c) {
+    unsigned events = 0;
+    switch (c->state) {
+    case CONN_COMMAND:
+        if (conn_wants_requests(c)) events = EV_READ;
+        break;
+    case CONN_ATTACHED:
+        // Stop reading keystrokes while the pty is still chewing on some.
+        if (buf_pending(&c->session->input) == 0) events = EV_READ;
+        break;
+    case CONN_WATCHING:
+        events = EV_READ;  // to see it hang up
+        break;
+    case CONN_CLOSING:
+        break;
+    }
+    if (conn_has_output(c)) events |= EV_WRITE;
+    ev_set(&c->ev, events);
+}
+
+/**********************************************************************
+ *                         LISTING & WATCHING
+ **********************************************************************/
+
+// Main thread; the attached count comes from the session's shard.
+static uint8_t session_state(Session *s) {
+    if (!session_alive(s)) return LIST_EXITED;
+    return stat_get(&s->attached) ? LIST_ATTACHED : LIST_RUNNING;
+}
+
+static int list_match_command(const ListFilter *f, const Session *s) {
+    return !f->command[0] || (s->command && strstr(s->command, f->command));
+}
+
+static int list_match(const ListFilter *f, Session *s, uint64_t now) {
+    uint64_t age = now > s->started ? now - s->started : 0;
+    if (f->states && !(f->states & session_state(s))) return 0;
+    if (f->min_age && age < f->min_age) return 0;
+    if (f->max_age && age > f->max_age) return 0;
+    return list_match_command(f, s);
+}
+
+// A LIST_DETAIL record of s.
+static void list_record(Buf *b, Session *s) {
+    size_t len = s->command ? strlen(s->command) : 0;
+    char rec[LIST_RECORD];
+    put_u32(rec, s->id);
+    put_u32(rec + 4, s->child_pid);
+    rec[8] = session_state(s);
+    put_u32(rec + 9, stat_get(&s->attached));
+    put_u64(rec + 13, s->started);
+    put_u64(rec + 21, __atomic_load_n(&s->scrollback.head, __ATOMIC_RELAXED));
+    put_u16(rec + 29, len);
+    buf_append(b, rec, sizeof(rec));
+    if (len) buf_append(b, s->command, len);
+}
+
+// Tell every watcher whose filter takes s what just happened to it.
+// One that stops reading is hung up on; it can list again.
+static void watch_notify(Session *s, uint8_t event) {
+    Buf rec = {0};
+    Conn *next;
+    for (Conn *c = g_watchers; c; c = next) {
+        next = c->watch_next;
+        if (!list_match_command(c->watch, s)) continue;
+        if (!rec.len) {
+            buf_append(&rec, &event, 1);
+            list_record(&rec, s);
+            if (event == WATCH_EXITED) rec.data[1 + 8] = LIST_EXITED;  // pty not closed yet
+        }
+        frame_append(&c->out, OP_LIST, STATUS_OK, c->watch->req_id, rec.data, rec.len);
+        if (buf_pending(&c->out) > CONN_REPLY_LIMIT || conn_flush(c) < 0) {
+            conn_close(c);
+            continue;
+        }
+        conn_update_interest(c);
+    }
+    buf_free(&rec);
+}
+
+static void watch_event_run(EvTask *t) {
+    WatchEvent *w = CONTAINER_OF(t, WatchEvent, task);
+    // Unless it exited meanwhile, and watchers have heard so.
+    if (find_session(w->id) == w->session) watch_notify(w->session, w->event);
+    free(w);
+}
+
+// Called on s's shard, which may not be the main thread.
+static void watch_post(Session *s, uint8_t event) {
+    if (!__atomic_load_n(&g_nwatchers, __ATOMIC_RELAXED) || !s->id) return;
+    if (s->shard == &g_main) {
+        watch_notify(s, event);
+        return;
+    }
+    WatchEvent *w = malloc(sizeof(*w));
+    if (!w) perror_exit("malloc");
+    w->task.cb = watch_event_run;
+    w->session = s;
+    w->id = s->id;
+    w->event = event;
+    ev_post(&g_main.loop, &w->task);
+}
+
+/**********************************************************************
+ *                      CLEANUP & SIGNAL HANDLING
+ **********************************************************************/
+
+// Function to move the daemon process to the parent cgroup
+static void move_self_to_parent_cgroup(void) {
+    // The parent cgroup is typically the root: /sys/fs/cgroup/
+    const char *parent_procs = "/sys/fs/cgroup/cgroup.procs";
+    int fd = open(parent_procs, O_WRONLY);
+    if (fd < 0) {
+        perror("open parent cgroup.procs");
+        return;
+    }
+    char pid_str[32];
+    snprintf(pid_str, sizeof(pid_str), "%d", getpid());
+    if (write(fd, pid_str, strlen(pid_str)) < 0) {
+        perror("write to parent cgroup.procs");
+    }
+    close(fd);
+}
+
+static void pool_trim(Pool *p, uint32_t keep);
+
+// Sessions still being served, idle pool ones included.
+static int sessions_running(void) {
+    int n = g_main.sessions;
+    for (int i = 0; i < g_nshards; i++) n += g_shards[i].sessions;
+    return n;
+}
+
+// Once the last child is reaped, or the deadline is up: take down what
+// the daemon set up, and exit.
+static void shutdown_finish(void) {
+    shards_stop();
+    // Children that outlived SIGKILL keep running; their files go.
+    for (int i = 0; i < g_nslots; i++) {
+        Session *p = g_slots[i].session;
+        if (p && p->scrollback.file) unlinkat(g_state_dir, p->scrollback.file->name, 0);
+    }
+
+    close(g_server_sock);
+    unlink(SOCKET_PATH);
+    close(g_signal_pipe[0]);
+    close(g_signal_pipe[1]);
+
+    move_self_to_parent_cgroup();
+
+    // The daemon's own group and those of sessions, empty by now.
+    DIR *d = opendir(CGROUP_FOLDER);
+    if (d) {
+        struct dirent *e;
+        while ((e = readdir(d))) {
+            if (e->d_type == DT_DIR && e->d_name[0] != '.')
+                unlinkat(dirfd(d), e->d_name, AT_REMOVEDIR);
+        }
+        closedir(d);
+    }
+    if (rmdir(CGROUP_FOLDER) != 0) {
+        perror("rmdir CGROUP_FOLDER");
+    }
+    exit(0);
+}
+
+// Done once every child is reaped and no spawn is on its way back.
+static void shutdown_check(void) {
+    if (g_shutdown && !sessions_running() && !g_spawns_queued) shutdown_finish();
+}
+
+static void shutdown_signal(int sig) {
+    for (int i = 0; i < g_nslots; i++) {
+        Session *p = g_slots[i].session;
+        if (!p) continue;
+        if (!p->child_pid) {
+            remove_session(p);  // left from before an upgrade, nothing to reap
+            continue;
+        }
+        if (kill(-p->child_pid, sig) < 0) kill(p->child_pid, sig);
+        if (sig != SIGKILL) kill(-p->child_pid, SIGCONT);  // hibernating ones too
+    }
+}
+
+// Each step signals the sessions harder, SHUTDOWN_STEP_US apart; the
+// one after SIGKILL gives up on them. No SIGHUP: sessions inherit it
+// ignored, so they outlive their pty, and could not even trap it.
+static void shutdown_step(EvTimer *t) {
+    static const int signals[] = {SIGTERM, SIGKILL};
+    (void)t;
+    if (g_shutdown == (int)(sizeof(signals) / sizeof(signals[0]))) shutdown_finish();
+    shutdown_signal(signals[g_shutdown++]);
+    ev_timer_start(&g_main.loop, &g_shutdown_timer,
+                   now_us(CLOCK_MONOTONIC) + SHUTDOWN_STEP_US);
+    shutdown_check();
+}
+
+// SIGTERM or SIGINT: stop taking clients and drain the sessions, with
+// their exits reaped as always. Asked again, it skips to the next step.
+static void shutdown_begin(void) {
+    if (g_shutdown) {
+        shutdown_step(&g_shutdown_timer);
+        return;
+    }
+    // The socket stays bound, so clients wait rather than start a new
+    // daemon while this one is still here.
+    ev_release(&g_server_ev);
+    while (g_main.conns) conn_close(g_main.conns);
+    for (Pool *pool = g_pools; pool; pool = pool->next) {
+        pool->target = 0;
+        pool_trim(pool, 0);
+    }
+    ev_timer_init(&g_shutdown_timer, shutdown_step);
+    shutdown_step(&g_shutdown_timer);
+}
+
+// Signals only tell the event loop, through the self-pipe, which one came.
+static void signal_handler(int signo) {
+    int saved = errno;
+    char c = (char)signo;
+    if (write(g_signal_pipe[1], &c, 1) < 0) {
+        // Full: a wakeup is pending already.
+    }
+    errno = saved;
+}
+
+// Add signal handlers for SIGTERM and SIGINT
+static void setup_signal_handlers(void) {
+    struct sigaction sa_term;
+    memset(&sa_term, 0, sizeof(sa_term));
+    sa_term.sa_handler = signal_handler;
+    sa_term.sa_flags = SA_RESTART;
+    sigaction(SIGTERM, &sa_term, NULL);
+    sigaction(SIGINT, &sa_term, NULL);
+}
+
+/**********************************************************************
+ *                  HANDLING CHILD EXIT (SIGCHLD)
+ **********************************************************************/
+static void handle_sigchld(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        Session *p = pid_lookup(pid);
+        if (p) remove_session(p);
+    }
+    shutdown_check();
+}
+
+static void signal_event(EvHandle *h, unsigned revents) {
+    (void)revents;
+    char buf[16];
+    ssize_t n;
+    int stop = 0;
+    while ((n = read(h->fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) stop |= buf[i] == SIGTERM || buf[i] == SIGINT;
+    }
+    ev_clear(h, EV_READ);
+    handle_sigchld();
+    if (stop) shutdown_begin();
+}
+
+/**********************************************************************
+ *                     DAEMON COMMAND HANDLERS
+ **********************************************************************/
+
+#define SPAWN_MAX_ARGS 64
+
+// Split a plain command into argv so it can be exec'd without a shell.
+// Anything a shell would interpret leaves argv empty and returns 0.
+static int split_command(char *words, char **argv) {
+    if (strpbrk(words, "|&;<>()$`\\\"'*?[]#~=%{}!\n")) return 0;
+    int argc = 0;
+    char *save;
+    for (char *w = strtok_r(words, " \t", &save); w; w = strtok_r(NULL, " \t", &save)) {
+        if (argc == SPAWN_MAX_ARGS) return 0;
+        argv[argc++] = w;
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+// Build the argv for command_str: the words themselves when no shell is
+// needed, $SHELL -c otherwise. words must outlive argv.
+static void command_argv(const char *command_str, char *words, size_t size, char **argv) {
+    snprintf(words, size, "%s", command_str);
+    if (strlen(command_str) < size && split_command(words, argv) > 0) return;
+    char *shell = getenv("SHELL");
+    argv[0] = shell && *shell ? shell : "/bin/sh";
+    argv[1] = "-c";
+    argv[2] = (char *)command_str;
+    argv[3] = NULL;
+}
+
+// Join the cgroup open at cgroup_fd, from a child about to exec.
+static int cgroup_join(int cgroup_fd) {
+    int fd = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = write(fd, "0", 1) == 1 ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+#if defined(__linux__)
+// Fork the child straight into the cgroup open at cgroup_fd, with
+// clone3(); where the kernel cannot, the child joins it before exec.
+// Either way the command never runs outside its limits. This copies the
+// daemon's page tables, unlike posix_spawn, so only limited spawns pay.
+// exec errors come back over a pipe that exec closes.
+static pid_t spawn_pty_cgroup(char **argv, const char *slave, int cgroup_fd) {
+    int err_pipe[2];
+    if (pipe2(err_pipe, O_CLOEXEC) < 0) return -1;
+    int joined = 0;
+    pid_t child_pid = -1;
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    struct clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = cgroup_fd;
+    child_pid = syscall(SYS_clone3, &args, sizeof(args));
+    joined = child_pid >= 0;
+#endif
+    if (child_pid < 0) child_pid = fork();
+    if (child_pid == 0) {
+        int err = 0;
+        if (!joined && cgroup_join(cgroup_fd) < 0) err = errno;
+        if (!err) {
+            // The spawner thread runs with every signal blocked.
+            sigset_t none;
+            sigemptyset(&none);
+            signal(SIGPIPE, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            setsid();
+            int tty = open(slave, O_RDWR);  // the first after setsid(): controlling
+            if (tty >= 0) {
+                dup2(tty, STDIN_FILENO);
+                dup2(tty, STDOUT_FILENO);
+                dup2(tty, STDERR_FILENO);
+                if (tty > STDERR_FILENO) close(tty);
+                execvp(argv[0], argv);
+            }
+            err = errno;
+        }
+        if (write(err_pipe[1], &err, sizeof(err)) < 0) {
+            // The parent sees the exit either way.
+        }
+        _exit(127);
+    }
+    int saved = errno;
+    close(err_pipe[1]);
+    if (child_pid < 0) {
+        close(err_pipe[0]);
+        errno = saved;
+        return -1;
+    }
+    int err;
+    ssize_t n;
+    while ((n = read(err_pipe[0], &err, sizeof(err))) < 0 && errno == EINTR);
+    close(err_pipe[0]);
+    if (n == sizeof(err)) {
+        waitpid(child_pid, NULL, 0);
+        errno = err;
+        return -1;
+    }
+    return child_pid;
+}
+
+// Open a pty pair and posix_spawn the child onto the slave. glibc spawns
+// with CLONE_VM|CLONE_VFORK, so unlike forkpty() the cost does not grow
+// with the daemon's heap. Opening the slave after POSIX_SPAWN_SETSID makes
+// it the child's controlling terminal. With cgroup_fd the child starts in
+// that cgroup instead, see spawn_pty_cgroup().
+static pid_t spawn_pty(const char *command_str, int *master_fd, int cgroup_fd) {
+    char words[4096], *argv[SPAWN_MAX_ARGS + 1];
+    command_argv(command_str, words, sizeof(words), argv);
+
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    char slave[64];
+    struct winsize ws = {24, 80, 0, 0};
+    if (grantpt(fd) < 0 || unlockpt(fd) < 0 || ptsname_r(fd, slave, sizeof(slave)) != 0) {
+        close(fd);
+        return -1;
+    }
+    ioctl(fd, TIOCSWINSZ, &ws);
+
+    if (cgroup_fd >= 0) {
+        pid_t child_pid = spawn_pty_cgroup(argv, slave, cgroup_fd);
+        if (child_pid < 0) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        *master_fd = fd;
+        return child_pid;
+    }
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t mask, def;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, slave, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, STDERR_FILENO);
+    posix_spawnattr_init(&attr);
+    sigemptyset(&mask);
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK |
+                                    POSIX_SPAWN_SETSIGDEF);
+
+    pid_t child_pid;
+    int err = posix_spawnp(&child_pid, argv[0], &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    *master_fd = fd;
+    return child_pid;
+}
+#else
+// Start command_str in a new pty, directly or under $SHELL -c; with
+// cgroup_fd, in that cgroup.
+static pid_t spawn_pty(const char *command_str, int *master_fd, int cgroup_fd) {
+    char words[4096], *argv[SPAWN_MAX_ARGS + 1];
+    command_argv(command_str, words, sizeof(words), argv);
+
+    struct winsize ws = {24, 80, 0, 0};
+    pid_t child_pid = forkpty(master_fd, NULL, NULL, &ws);
+    if (child_pid == 0) {
+        if (cgroup_fd >= 0 && cgroup_join(cgroup_fd) < 0) _exit(127);
+        // The spawner thread runs with every signal blocked.
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return child_pid;
+}
+#endif
+
+/**********************************************************************
+ *                          WARM SESSION POOLS
+ **********************************************************************/
+
+static Pool *pool_find(const char *command, size_t scrollback) {
+    for (Pool *p = g_pools; p; p = p->next) {
+        if (p->scrollback == scrollback && strcmp(p->command, command) == 0) return p;
+    }
+    return NULL;
+}
+
+static void pool_unlink(Session *s) {
+    Pool *p = s->pool;
+    Session **pp = &p->sessions;
+    while (*pp != s) pp = &(*pp)->pool_next;
+    *pp = s->pool_next;
+    p->idle--;
+    s->pool = NULL;
+}
+
+// Hand out an idle session of this template, if one is ready.
+static Session *pool_take(const char *command, size_t scrollback) {
+    Pool *p = pool_find(command, scrollback);
+    if (!p) return NULL;
+    for (Session *s = p->sessions; s; s = s->pool_next) {
+        if (!session_alive(s)) continue;  // hung up, the reaper will have it
+        pool_unlink(s);
+        session_set_id(s, slot_alloc(s));
+        g_pools_short = 1;
+        return s;
+    }
+    return NULL;
+}
+
+// Kill idle sessions beyond keep, unlinked now so that none can be
+// handed out while it is dying.
+static void pool_trim(Pool *p, uint32_t keep) {
+    while (p->idle > keep) {
+        Session *s = p->sessions;
+        pool_unlink(s);
+        kill(s->child_pid, SIGKILL);
+    }
+}
+
+static void pool_configure(const char *command, size_t scrollback, uint32_t target) {
+    Pool *p = pool_find(command, scrollback);
+    if (!p) {
+        if (target == 0) return;
+        p = calloc(1, sizeof(Pool));
+        if (!p || !(p->command = strdup(command))) perror_exit("calloc");
+        p->scrollback = scrollback;
+        p->next = g_pools;
+        g_pools = p;
+    }
+    p->target = target;
+    pool_trim(p, target);
+    g_pools_short = 1;
+}
+
+static void conn_job_done(Conn *c);
+static void session_set_rate(Session *s, uint32_t rate);
+static void reply_ok(Conn *c, const FrameHeader *req, const void *payload, uint32_t len);
+static void reply_error(Conn *c, const FrameHeader *req, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+static void conn_printf(Conn *c, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Warm sessions are set up when they are handed out, not when spawned.
+static void session_hand_out(Session *s, const char *command) {
+    s->command = strdup(command);
+    if (!s->command) perror_exit("strdup");
+    s->started = time(NULL);
+    RingFile *f = s->scrollback.file;
+    if (f) {
+        f->started = s->started;
+        snprintf(f->command, sizeof(f->command), "%s", command);
+    }
+    watch_notify(s, WATCH_SPAWNED);
+    if (!g_record_all && !g_screen_all && !g_hibernate_stop) return;
+    s->setup.cb = session_setup;
+    shard_call(s->shard, &s->setup);
+}
+
+static SpawnJob *spawn_job_new(const char *command, size_t scrollback, uint32_t count) {
+    SpawnJob *job = calloc(1, sizeof(SpawnJob));
+    if (!job || !(job->spawns = calloc(count ? count : 1, sizeof(Spawned)))) perror_exit("calloc");
+    snprintf(job->command, sizeof(job->command), "%s", command);
+    job->scrollback = scrollback;
+    job->count = count;
+    return job;
+}
+
+// Spawn into a new cgroup with the job's limits; it has to exist before
+// the child does.
+static pid_t spawn_limited(SpawnJob *job, Spawned *sp) {
+    char dir[256];
+    sp->cgroup = cgroup_make(dir, sizeof(dir));
+    if (!sp->cgroup) return -1;
+    int fd = -1;
+    pid_t child_pid = -1;
+    if (cgroup_set_limits(dir, &job->limits) == 0 &&
+        (fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0)
+        child_pid = spawn_pty(job->command, &sp->master_fd, fd);
+    int saved = errno;
+    if (fd >= 0) close(fd);
+    if (child_pid < 0) {
+        rmdir(dir);
+        sp->cgroup = 0;
+        errno = saved;
+    }
+    return child_pid;
+}
+
+static void spawn_job_free(SpawnJob *job) {
+    free(job->spawns);
+    free(job);
+}
+
+// Fork what the pools could not hand out. Runs on the spawner thread.
+static void spawn_job_run(SpawnJob *job) {
+    int give_up = 0;
+    for (uint32_t i = job->taken; i < job->count; i++) {
+        Spawned *sp = &job->spawns[i];
+        if (give_up) sp->pid = -1;
+        else if (limits_cgroup(&job->limits)) sp->pid = spawn_limited(job, sp);
+        else sp->pid = spawn_pty(job->command, &sp->master_fd, -1);
+        if (sp->pid >= 0 || give_up) continue;
+        job->err = errno;
+        give_up = job->pool != NULL;  // retried once the pool is drawn from
+    }
+}
+
+// Turn the children into sessions, back on the main thread.
+static void spawn_job_adopt(SpawnJob *job) {
+    for (uint32_t i = job->taken; i < job->count; i++) {
+        Spawned *sp = &job->spawns[i];
+        if (sp->pid < 0) continue;
+        if (job->pool) {
+            Session *s = new_session(sp->pid, sp->master_fd, job->scrollback);
+            s->pool = job->pool;
+            s->pool_next = job->pool->sessions;
+            job->pool->sessions = s;
+            job->pool->idle++;
+            continue;
+        }
+        Session *s = add_session(sp->pid, sp->master_fd, job->scrollback);
+        if (sp->cgroup) session_mark_cgroup(s, sp->cgroup);
+        if (job->limits.rate) session_set_rate(s, job->limits.rate);
+        session_hand_out(s, job->command);
+        sp->id = s->id;
+    }
+    if (!job->pool) return;
+    job->pool->spawning -= job->count;
+    pool_trim(job->pool, job->pool->target);
+}
+
+static void spawn_job_reply(SpawnJob *job) {
+    Conn *c = job->conn;
+    int id = job->spawns[0].id;
+    switch (job->req.opcode) {
+    case 0:
+        if (id) conn_printf(c, "OK %d\n", id);
+        else conn_printf(c, "ERROR spawn: %s\n", strerror(job->err));
+        break;
+    case OP_SPAWN: {
+        char rec[4];
+        put_u32(rec, id);
+        if (id) reply_ok(c, &job->req, rec, sizeof(rec));
+        else reply_error(c, &job->req, "spawn: %s", strerror(job->err));
+        break;
+    }
+    default: {
+        // A limited spawn of one fails as OP_SPAWN does, saying why.
+        if (job->req.opcode == OP_SPAWN_LIMITED && job->count == 1 && !id) {
+            reply_error(c, &job->req, "spawn: %s", strerror(job->err));
+            break;
+        }
+        char *ids = malloc(job->count * 4 + 1);
+        if (!ids) perror_exit("malloc");
+        for (uint32_t i = 0; i < job->count; i++) put_u32(ids + i * 4, job->spawns[i].id);
+        reply_ok(c, &job->req, ids, job->count * 4);
+        free(ids);
+        break;
+    }
+    }
+}
+
+static void spawn_job_done(EvTask *t) {
+    SpawnJob *job = CONTAINER_OF(t, SpawnJob, task);
+    spawn_job_adopt(job);
+    if (NIMT_WITH_METRICS && job->conn)
+        hist_add(&g_main.stats.spawn_time, LATENCY_BOUNDS_US,
+                 now_us(CLOCK_MONOTONIC) - job->start_us);
+    if (job->conn && job->conn->ev.fd >= 0) spawn_job_reply(job);
+    g_spawns_queued -= job->async;
+    if (job->async && job->conn) {
+        job->conn->spawns--;
+        conn_job_done(job->conn);
+    }
+    spawn_job_free(job);
+}
+
+static void spawn_job_thread(EvTask *t) {
+    spawn_job_run(CONTAINER_OF(t, SpawnJob, task));
+    t->cb = spawn_job_done;
+    ev_post(&g_main.loop, t);
+}
+
+// Spawn a job: on the spawner thread if there is one, with replies and
+// pool top-ups following whenever it is done; inline otherwise.
+static void spawn_job_start(SpawnJob *job) {
+    // Behind other spawns even a job with nothing left to spawn queues,
+    // to keep its reply in order.
+    int queued = job->conn && job->conn->spawns;
+    if (!g_nshards || (job->taken == job->count && !queued)) {
+        spawn_job_run(job);
+        spawn_job_done(&job->task);
+        return;
+    }
+    job->async = 1;
+    g_spawns_queued++;
+    if (job->conn) {
+        job->conn->jobs++;
+        job->conn->spawns++;
+    }
+    job->task.cb = spawn_job_thread;
+    ev_post(&g_spawner.loop, &job->task);
+}
+
+// Serve a spawn request, warm sessions first unless it wants cgroups:
+// those are running outside one already. req is NULL for the text
+// protocol, limits for none.
+static void spawn_request(Conn *c, const FrameHeader *req, const char *command_str,
+                          size_t scrollback, uint32_t count, const Limits *limits) {
+    SpawnJob *job = spawn_job_new(command_str, scrollback, count);
+    job->conn = c;
+    job->start_us = now_us(CLOCK_MONOTONIC);
+    if (req) job->req = *req;
+    if (limits) job->limits = *limits;
+    while (job->taken < count && !limits_cgroup(&job->limits)) {
+        Session *s = pool_take(command_str, scrollback);
+        if (!s) break;
+        session_hand_out(s, command_str);
+        job->spawns[job->taken++].id = s->id;
+    }
+    spawn_job_start(job);
+}
+
+// Top every pool up to its target. Warm sessions that die while idle
+// are not replaced until the pool is next drawn from, so a template
+// that exits at once cannot keep the daemon spawning.
+static void pool_refill(void) {
+    if (!g_pools_short) return;
+    g_pools_short = 0;
+    for (Pool *p = g_pools; p; p = p->next) {
+        if (p->idle + p->spawning >= p->target) continue;
+        SpawnJob *job = spawn_job_new(p->command, p->scrollback, p->target - p->idle - p->spawning);
+        job->pool = p;
+        p->spawning += job->count;
+        spawn_job_start(job);
+    }
+}
+
+// Attach c to s, on the session's shard. req is NULL for a text ATTACH.
+static void attach_run(Session *s, Conn *c, const FrameHeader *req, AttachPolicy policy,
+                       const struct winsize *ws, int flags) {
+    if (s->master_fd < 0) {
+        c->state = CONN_CLOSING;
+        if (!req) {
+            conn_printf(c, "ERROR no such session\n");
+            return;
+        }
+        // Nothing left to relay: hand over the final output and hang up.
+        reply_ok(c, req, "", 1);
+        struct iovec iov[2];
+        int n = ring_iov(&s->scrollback, ring_tail(&s->scrollback), iov);
+        for (int i = 0; i < n; i++) buf_append(&c->out, iov[i].iov_base, iov[i].iov_len);
+        return;
+    }
+    if (ws->ws_row && ws->ws_col) session_resize(s, ws);
+    if (req) {
+        char granted = NIMT_WITH_COMPRESS ? flags & ATTACH_COMPRESS : 0;
+        reply_ok(c, req, &granted, 1);
+        if (granted & ATTACH_COMPRESS) c->lz = lz_new();
+    } else {
+        conn_printf(c, "OK ATTACH\n");
+    }
+    session_subscribe(s, c, policy);
+}
+
+static int conn_process(Conn *c);
+
+// The connection arrives on the session's shard: it carries on here.
+static void attach_moved(EvTask *t) {
+    AttachOp *op = CONTAINER_OF(t, AttachOp, task);
+    Conn *c = conn_new(op->session->shard, op->fd);
+    c->proto = op->proto;
+    c->in = op->in;
+    c->out = op->out;
+    attach_run(op->session, c, c->proto == PROTO_TEXT ? NULL : &op->req, op->policy,
+               &op->ws, op->flags);
+    free(op);
+    if (conn_process(c) < 0 || conn_flush(c) < 0 ||
+        (c->state == CONN_CLOSING && !conn_has_output(c))) {
+        conn_close(c);
+        return;
+    }
+    conn_update_interest(c);
+}
+
+// Attach c to s. A session on another shard takes the descriptor and
+// whatever is buffered with it; c itself closes after this turn.
+static void session_attach(Session *s, Conn *c, const FrameHeader *req, AttachPolicy policy,
+                           const struct winsize *ws, int flags) {
+    if (s->shard == &g_main) {
+        attach_run(s, c, req, policy, ws, flags);
+        return;
+    }
+    AttachOp *op = calloc(1, sizeof(AttachOp));
+    if (!op) perror_exit("calloc");
+    op->session = s;
+    op->proto = c->proto;
+    if (req) op->req = *req;
+    op->policy = policy;
+    op->ws = *ws;
+    op->flags = flags;
+    op->in = c->in;
+    op->out = c->out;
+    memset(&c->in, 0, sizeof(c->in));
+    memset(&c->out, 0, sizeof(c->out));
+    op->fd = ev_release(&c->ev);
+    c->state = CONN_CLOSING;
+    op->task.cb = attach_moved;
+    ev_post(&s->shard->loop, &op->task);
+}
+
+static Session *find_live_session(int id) {
+    Session *s = find_session(id);
+    return s && session_alive(s) ? s : NULL;
+}
+
+static void handle_spawn(Conn *c, char *cmdline) {
+    char *command_str = cmdline;
+    size_t scrollback = SCROLLBACK_DEFAULT;
+    while (*command_str == ' ') command_str++;
+    if (strncmp(command_str, "-b ", 3) == 0) {
+        scrollback = ring_size_for(strtoul(command_str + 3, &command_str, 10));
+        while (*command_str == ' ') command_str++;
+    }
+    if (*command_str == '\0') command_str = "bash";
+
+    spawn_request(c, NULL, command_str, scrollback, 1, NULL);
+}
+
+static void handle_list(Conn *c) {
+    for (int i = 0; i < g_nslots; i++) {
+        Session *p = g_slots[i].session;
+        if (p) conn_printf(c, "SESSION %d pid=%d\n", p->id, p->child_pid);
+    }
+    conn_printf(c, "DONE\n");
+}
+
+static void handle_kill(Conn *c, int session_id) {
+    Session *s = find_session(session_id);
+    if (!s) {
+        conn_printf(c, "ERROR no such session\n");
+        return;
+    }
+    session_kill(s);
+    conn_printf(c, "OK killing session %d\n", session_id);
+}
+
+// Switch the connection into relay mode; conn_event does the rest.
+static void handle_attach(Conn *c, char *args) {
+    char *end;
+    int session_id = strtol(args, &end, 10);
+    AttachPolicy policy = POLICY_BLOCK;
+    while (*end == ' ') end++;
+    if (strncmp(end, "drop", 4) == 0) policy = POLICY_DROP;
+    else if (strncmp(end, "disconnect", 10) == 0) policy = POLICY_DISCONNECT;
+
+    Session *s = find_live_session(session_id);
+    if (!s) {
+        conn_printf(c, "ERROR no such session\n");
+        return;
+    }
+    struct winsize ws;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) != 0) memset(&ws, 0, sizeof(ws));
+    session_attach(s, c, NULL, policy, &ws, 0);
+}
+
+static void handle_command(Conn *c, char *line) {
+    if (strncmp(line, "SPAWN ", 6) == 0) {
+        handle_spawn(c, line + 6);
+    } else if (strncmp(line, "LIST", 4) == 0) {
+        handle_list(c);
+    } else if (strncmp(line, "KILL ", 5) == 0) {
+        handle_kill(c, atoi(line + 5));
+    } else if (strncmp(line, "ATTACH ", 7) == 0) {
+        handle_attach(c, line + 7);
+    } else {
+        conn_printf(c, "ERROR unknown command\n");
+    }
+}
+
+/**********************************************************************
+ *                      BINARY REQUEST HANDLERS
+ **********************************************************************/
+
+static void reply_error(Conn *c, const FrameHeader *req, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void reply_error(Conn *c, const FrameHeader *req, const char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (n < 0) n = 0;
+    if ((size_t)n >= sizeof(msg)) n = sizeof(msg) - 1;
+    frame_append(&c->out, req->opcode, STATUS_ERROR, req->req_id, msg, n);
+}
+
+static void reply_ok(Conn *c, const FrameHeader *req, const void *payload, uint32_t len) {
+    frame_append(&c->out, req->opcode, STATUS_OK, req->req_id, payload, len);
+}
+
+// Copy the command line that ends a spawn request.
+static void get_command(const char *p, size_t len, char *command_str, size_t size) {
+    if (len >= size) len = size - 1;
+    memcpy(command_str, p, len);
+    command_str[len] = 0;
+    if (!*command_str) snprintf(command_str, size, "bash");
+}
+
+static void op_spawn(Conn *c, const FrameHeader *req, const char *p) {
+    if (req->len < 4) {
+        reply_error(c, req, "short request");
+        return;
+    }
+    uint32_t want = get_u32(p);
+    char command_str[4096];
+    get_command(p + 4, req->len - 4, command_str, sizeof(command_str));
+
+    spawn_request(c, req, command_str, want ? ring_size_for(want) : SCROLLBACK_DEFAULT, 1, NULL);
+}
+
+static void op_spawn_batch(Conn *c, const FrameHeader *req, const char *p) {
+    if (req->len < 8) {
+        reply_error(c, req, "short request");
+        return;
+    }
+    uint32_t want = get_u32(p);
+    uint32_t count = get_u32(p + 4);
+    if (count > SPAWN_BATCH_MAX) {
+        reply_error(c, req, "at most %u sessions per batch", SPAWN_BATCH_MAX);
+        return;
+    }
+    char command_str[4096];
+    get_command(p + 8, req->len - 8, command_str, sizeof(command_str));
+    spawn_request(c, req, command_str, want ? ring_size_for(want) : SCROLLBACK_DEFAULT, count,
+                  NULL);
+}
+
+// The limits of an OP_LIMIT or OP_SPAWN_LIMITED, LIMITS_SIZE bytes at p.
+static void get_limits(const char *p, Limits *l) {
+    l->cpu = get_u32(p);
+    l->memory = (uint64_t)get_u32(p + 4) << 10;
+    l->io = get_u16(p + 8);
+    l->rate = get_u32(p + 10);
+}
+
+static void op_spawn_limited(Conn *c, const FrameHeader *req, const char *p) {
+    if (req->len < 8 + LIMITS_SIZE) {
+        reply_error(c, req, "short request");
+        return;
+    }
+    uint32_t want = get_u32(p);
+    uint32_t count = get_u32(p + 4);
+    if (count > SPAWN_BATCH_MAX) {
+        reply_error(c, req, "at most %u sessions per batch", SPAWN_BATCH_MAX);
+        return;
+    }
+    Limits limits;
+    get_limits(p + 8, &limits);
+    char command_str[4096];
+    get_command(p + 8 + LIMITS_SIZE, req->len - 8 - LIMITS_SIZE, command_str, sizeof(command_str));
+    spawn_request(c, req, command_str, want ? ring_size_for(want) : SCROLLBACK_DEFAULT, count,
+                  &limits);
+}
+
+static void op_pool(Conn *c, const FrameHeader *req, const char *p) {
+    if (req->len < 8) {
+        reply_error(c, req, "short request");
+        return;
+    }
+    uint32_t want = get_u32(p);
+    uint32_t count = get_u32(p + 4);
+    if (count > POOL_MAX) {
+        reply_error(c, req, "at most %u warm sessions per pool", POOL_MAX);
+        return;
+    }
+    char command_str[4096];
+    get_command(p + 8, req->len - 8, command_str, sizeof(command_str));
+    pool_configure(command_str, want ? ring_size_for(want) : SCROLLBACK_DEFAULT, count);
+    reply_ok(c, req, NULL, 0);
+}
+
+static SessionOp *session_op_new(Session *s, int on, void (*cb)(EvTask *t)) {
+    SessionOp *op = calloc(1, sizeof(SessionOp));
+    if (!op) perror_exit("calloc");
+    op->session = s;
+    op->on = on;
+    op->task.cb = cb;
+    return op;
+}
+
+static void record_replied(EvTask *t) {
+    SessionOp *op = CONTAINER_OF(t, SessionOp, task);
+    if (op->conn->ev.fd >= 0) {
+        if (op->err) reply_error(op->conn, &op->req, "record: %s", strerror(op->err));
+        else reply_ok(op->conn, &op->req, NULL, 0);
+    }
+    if (op->async) conn_job_done(op->conn);
+    free(op);
+}
+
+static void record_toggled(EvTask *t) {
+    SessionOp *op = CONTAINER_OF(t, SessionOp, task);
+    if (!op->on) record_stop(op->session);
+    else if (record_start(op->session) < 0) op->err = errno;
+    t->cb = record_replied;
+    if (op->async) ev_post(&g_main.loop, t);
+    else record_replied(t);
+}
+
+static void op_record(Conn *c, const FrameHeader *req, const char *p) {
+    Session *s = req->len >= 5 ? find_live_session(get_u32(p)) : NULL;
+    if (!s) {
+        reply_error(c, req, "no such session");
+        return;
+    }
+    SessionOp *op = session_op_new(s, p[4] != 0, record_toggled);
+    op->conn = c;
+    op->req = *req;
+    op->async = s->shard != &g_main;
+    c->jobs += op->async;
+    shard_call(s->shard, &op->task);
+}
+
+static void screen_toggled(EvTask *t) {
+    SessionOp *op = CONTAINER_OF(t, SessionOp, task);
+    session_set_screen(op->session, op->on);
+    free(op);
+}
+
+static void op_screen(Conn *c, const FrameHeader *req, const char *p) {
+    Session *s = req->len >= 5 ? find_session(get_u32(p)) : NULL;
+    if (!s) {
+        reply_error(c, req, "no such session");
+        return;
+    }
+    if (!NIMT_WITH_SCREEN && p[4]) {
+        reply_error(c, req, "screen: %s", strerror(ENOTSUP));
+        return;
+    }
+    shard_call(s->shard, &session_op_new(s, p[4] != 0, screen_toggled)->task);
+    reply_ok(c, req, NULL, 0);
+}
+
+static void rate_set(EvTask *t) {
+    SessionOp *op = CONTAINER_OF(t, SessionOp, task);
+    Session *s = op->session;
+    s->rate = op->rate;
+    if (s->scrollback.file) s->scrollback.file->rate = op->rate;
+    session_update_interest(s);
+    free(op);
+}
+
+// Cap how fast s's pty is read, on its shard.
+static void session_set_rate(Session *s, uint32_t rate) {
+    SessionOp *op = session_op_new(s, 1, rate_set);
+    op->rate = rate;
+    shard_call(s->shard, &op->task);
+}
+
+static void op_limit(Conn *c, const FrameHeader *req, const char *p) {
+    Session *s = req->len >= 4 + LIMITS_SIZE ? find_live_session(get_u32(p)) : NULL;
+    if (!s) {
+        reply_error(c, req, "no such session");
+        return;
+    }
+    Limits limits;
+    get_limits(p + 4, &limits);
+    if (limits_cgroup(&limits) && session_set_cgroup(s, &limits) < 0) {
+        reply_error(c, req, "cgroup: %s", strerror(errno));
+        return;
+    }
+    if (limits.rate) session_set_rate(s, limits.rate);
+    reply_ok(c, req, NULL, 0);
+}
+
+static void input_replied(EvTask *t) {
+    SessionOp *op = CONTAINER_OF(t, SessionOp, task);
+    if (op->conn->ev.fd >= 0) {
+        if (op->err) reply_error(op->conn, &op->req, "input full");
+        else reply_ok(op->conn, &op->req, NULL, 0);
+    }
+    if (op->async) conn_job_done(op->conn);
+    free(op);
+}
+
+// Queue OP_SEND input for the pty, unless a child that is not reading
+// its terminal has left INPUT_LIMIT unread already: that input would
+// sit in the daemon's memory, outside NIMT_MEMORY.
+static void input_sent(EvTask *t) {
+    SessionOp *op = CONTAINER_OF(t, SessionOp, task);
+    Session *s = op->session;
+    session_wake(s);
+    size_t len = buf_pending(&op->data);
+    if (s->master_fd >= 0 && buf_pending(&s->input) + len > INPUT_LIMIT) {
+        op->err = ENOBUFS;
+    } else if (s->master_fd >= 0) {
+        stat_add(&s->input_bytes, len);
+        stat_add(&s->shard->stats.input_bytes, len);
+        s->keystroke = 1;
+        buf_append(&s->input, op->data.data + op->data.off, len);
+        if (buf_flush(&s->input, &s->ev, 0) < 0) buf_free(&s->input);
+        session_update_interest(s);
+    }
+    buf_free(&op->data);
+    t->cb = input_replied;
+    if (op->async) ev_post(&g_main.loop, t);
+    else input_replied(t);
+}
+
+static void op_send(Conn *c, const FrameHeader *req, const char *p) {
+    Session *s = req->len >= 4 ? find_live_session(get_u32(p)) : NULL;
+    if (!s) {
+        reply_error(c, req, "no such session");
+        return;
+    }
+    SessionOp *op = session_op_new(s, 1, input_sent);
+    buf_append(&op->data, p + 4, req->len - 4);
+    op->conn = c;
+    op->req = *req;
+    op->async = s->shard != &g_main;
+    c->jobs += op->async;
+    shard_call(s->shard, &op->task);
+}
+
+static void output_replied(EvTask *t) {
+    SessionOp *op = CONTAINER_OF(t, SessionOp, task);
+    if (op->conn->ev.fd >= 0) reply_ok(op->conn, &op->req, op->data.data, op->data.len);
+    if (op->async) conn_job_done(op->conn);
+    buf_free(&op->data);
+    free(op);
+}
+
+// Copy the scrollback out on the session's shard, where the pty is read
+// into it; the reply goes out from the main thread.
+static void output_read(EvTask *t) {
+    SessionOp *op = CONTAINER_OF(t, SessionOp, task);
+    Session *s = op->session;
+    Ring *r = &s->scrollback;
+    session_wake(s);
+    uint64_t from = op->offset, tail = session_tail(s, from);
+    if (from < tail) from = tail;
+    if (from > r->head) from = r->head;
+    char hdr[16];
+    put_u64(hdr, from);
+    put_u64(hdr + 8, r->head);
+    buf_append(&op->data, hdr, sizeof(hdr));
+    struct iovec iov[2];
+    int n = ring_iov(r, from, iov);
+    size_t left = READ_MAX;
+    for (int i = 0; i < n && left; i++) {
+        size_t len = iov[i].iov_len < left ? iov[i].iov_len : left;
+        buf_append(&op->data, iov[i].iov_base, len);
+        left -= len;
+    }
+    t->cb = output_replied;
+    if (op->async) ev_post(&g_main.loop, t);
+    else output_replied(t);
+}
+
+static void op_read(Conn *c, const FrameHeader *req, const char *p) {
+    Session *s = req->len >= 4 ? find_session(get_u32(p)) : NULL;
+    if (!s) {
+        reply_error(c, req, "no such session");
+        return;
+    }
+    SessionOp *op = session_op_new(s, 0, output_read);
+    op->offset = req->len >= 12 ? get_u64(p + 4) : 0;
+    op->conn = c;
+    op->req = *req;
+    op->async = s->shard != &g_main;
+    c->jobs += op->async;
+    shard_call(s->shard, &op->task);
+}
+
+static void wait_replied(EvTask *t) {
+    Wait *w = CONTAINER_OF(t, Wait, task);
+    Wait **pp = &w->conn->waits;
+    while (*pp != w) pp = &(*pp)->conn_next;
+    *pp = w->conn_next;
+    if (w->conn->ev.fd >= 0) {
+        if (w->err) {
+            reply_error(w->conn, &w->req, "%s", w->err);
+        } else {
+            char off[8];
+            put_u64(off, w->offset);
+            reply_ok(w->conn, &w->req, off, sizeof(off));
+        }
+    }
+    conn_job_done(w->conn);
+    if (!w->cancelled) free(w);
+}
+
+// Match the scrollback from from on. Returns 1 once the pattern has
+// turned up, with w->offset just past it.
+static int wait_feed(Wait *w, uint64_t from) {
+    if (w->pat.matched) return 1;
+    struct iovec iov[2];
+    int n = ring_iov(&w->session->scrollback, from, iov);
+    w->offset = from;
+    for (int i = 0; i < n; i++) {
+        ssize_t len = pat_feed(&w->pat, iov[i].iov_base, iov[i].iov_len);
+        if (len >= 0) {
+            w->offset += len;
+            return 1;
+        }
+        w->offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+// Answer a wait, err NULL for a match, and drop it from its session.
+static void wait_done(Wait *w, const char *err) {
+    Session *s = w->session;
+    Wait **pp = &s->waits;
+    while (*pp && *pp != w) pp = &(*pp)->next;
+    if (*pp) *pp = w->next;
+    w->waiting = 0;
+    ev_timer_stop(&s->shard->loop, &w->timer);
+    pat_free(&w->pat);
+    w->err = err;
+    w->task.cb = wait_replied;
+    ev_post(&g_main.loop, &w->task);
+}
+
+static void wait_timed_out(EvTimer *t) {
+    wait_done(CONTAINER_OF(t, Wait, timer), "timed out");
+}
+
+// On the session's shard: look through what the scrollback still holds
+// from the offset asked for, then through output as it comes in.
+static void wait_start(EvTask *t) {
+    Wait *w = CONTAINER_OF(t, Wait, task);
+    Session *s = w->session;
+    Ring *r = &s->scrollback;
+    session_wake(s);
+    uint64_t from = w->offset, tail = session_tail(s, from);
+    if (from < tail) from = tail;
+    if (from > r->head) from = r->head;
+    pat_begin(&w->pat, from == 0 || (from > tail && r->data[(from - 1) & (r->size - 1)] == '\n'));
+    if (wait_feed(w, from)) {
+        wait_done(w, NULL);
+    } else if (s->master_fd < 0) {
+        wait_done(w, "session exited");
+    } else {
+        w->next = s->waits;
+        s->waits = w;
+        w->waiting = 1;
+        if (w->timeout_ms)
+            ev_timer_start(&s->shard->loop, &w->timer,
+                           now_us(CLOCK_MONOTONIC) + (uint64_t)w->timeout_ms * 1000);
+    }
+}
+
+static void wait_cancelled(EvTask *t) {
+    free(CONTAINER_OF(t, Wait, cancel));
+}
+
+// On the session's shard: give up a wait whose client is gone, and hand
+// it back to the main thread. Its reply, there already or posted here,
+// goes ahead of it, so the last of the two frees it.
+static void wait_cancel(EvTask *t) {
+    Wait *w = CONTAINER_OF(t, Wait, cancel);
+    if (w->waiting) wait_done(w, "cancelled");
+    t->cb = wait_cancelled;
+    ev_post(&g_main.loop, t);
+}
+
+// The client of these waits is gone: stop them instead of keeping the
+// Conn until the session exits, or forever with no timeout.
+static void wait_cancel_all(Wait *w) {
+    for (; w; w = w->conn_next) {
+        if (w->cancelled) continue;
+        w->cancelled = 1;
+        w->cancel.cb = wait_cancel;
+        shard_call(w->shard, &w->cancel);
+    }
+}
+
+static void op_wait(Conn *c, const FrameHeader *req, const char *p) {
+    Session *s = req->len >= 16 ? find_session(get_u32(p)) : NULL;
+    if (!s) {
+        reply_error(c, req, "no such session");
+        return;
+    }
+    if (req->len - 16 > PAT_MAX) {
+        reply_error(c, req, "pattern longer than %d bytes", PAT_MAX);
+        return;
+    }
+    Wait *w = calloc(1, sizeof(Wait));
+    if (!w) perror_exit("calloc");
+    const char *err;
+    if (pat_compile(&w->pat, p + 16, req->len - 16, &err) < 0) {
+        reply_error(c, req, "pattern: %s", err);
+        free(w);
+        return;
+    }
+    w->session = s;
+    w->shard = s->shard;
+    w->timeout_ms = get_u32(p + 4);
+    w->offset = get_u64(p + 8);
+    ev_timer_init(&w->timer, wait_timed_out);
+    w->conn = c;
+    w->req = *req;
+    w->conn_next = c->waits;
+    c->waits = w;
+    c->jobs++;
+    w->task.cb = wait_start;
+    shard_call(s->shard, &w->task);
+}
+
+static void op_upgrade(Conn *c, const FrameHeader *req) {
+    if (g_state_dir < 0) {
+        reply_error(c, req, "no state directory, sessions would be lost");
+        return;
+    }
+    reply_ok(c, req, NULL, 0);
+    g_upgrade_pending = 1;
+}
+
+// The whole listing goes out as one frame, in one write if the client
+// keeps up.
+static void op_list(Conn *c, const FrameHeader *req, const char *p) {
+    ListFilter f;
+    memset(&f, 0, sizeof(f));
+    uint8_t flags = 0;
+    if (req->len >= 10) {
+        flags = p[0];
+        f.states = p[1];
+        f.min_age = get_u32(p + 2);
+        f.max_age = get_u32(p + 6);
+        size_t len = req->len - 10;
+        if (len >= sizeof(f.command)) len = sizeof(f.command) - 1;
+        memcpy(f.command, p + 10, len);
+    }
+    f.req_id = req->req_id;
+
+    Buf payload = {0};
+    uint64_t now = time(NULL);
+    for (int i = 0; i < g_nslots; i++) {
+        Session *s = g_slots[i].session;
+        if (!s || !list_match(&f, s, now)) continue;
+        if (flags & LIST_DETAIL) {
+            list_record(&payload, s);
+            continue;
+        }
+        char rec[8];
+        put_u32(rec, s->id);
+        put_u32(rec + 4, s->child_pid);
+        buf_append(&payload, rec, sizeof(rec));
+    }
+    reply_ok(c, req, payload.data, buf_pending(&payload));
+    buf_free(&payload);
+    if (!(flags & LIST_WATCH) || c->shard != &g_main) return;
+
+    c->watch = malloc(sizeof(f));
+    if (!c->watch) perror_exit("malloc");
+    *c->watch = f;
+    c->state = CONN_WATCHING;
+    c->watch_next = g_watchers;
+    g_watchers = c;
+    __atomic_add_fetch(&g_nwatchers, 1, __ATOMIC_RELAXED);
+}
+
+// Sum of every thread's counters, as they are now.
+static void stats_total(Stats *total) {
+    memset(total, 0, sizeof(*total));
+    uint64_t *t = (uint64_t *)total;
+    for (int i = -2; i < g_nshards; i++) {
+        Shard *sh = i == -2 ? &g_main : i == -1 ? &g_spawner : &g_shards[i];
+        const uint64_t *v = (const uint64_t *)&sh->stats;
+        for (size_t k = 0; k < sizeof(Stats) / sizeof(uint64_t); k++) t[k] += stat_get(&v[k]);
+    }
+}
+
+static void stats_metric(Buf *b, const char *name, const char *type, const char *help,
+                         uint64_t v) {
+    buf_printf(b, "# HELP nimt_%s %s\n# TYPE nimt_%s %s\nnimt_%s %llu\n", name, help, name,
+               type, name, (unsigned long long)v);
+}
+
+// scale turns observations into the metric's unit.
+static void stats_histogram(Buf *b, const char *name, const char *help, const Histogram *h,
+                            const uint64_t *bounds, double scale) {
+    buf_printf(b, "# HELP nimt_%s %s\n# TYPE nimt_%s histogram\n", name, help, name);
+    uint64_t n = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        n += h->count[i];
+        if (i < HIST_BUCKETS - 1)
+            buf_printf(b, "nimt_%s_bucket{le=\"%g\"} %llu\n", name, bounds[i] * scale,
+                       (unsigned long long)n);
+        else
+            buf_printf(b, "nimt_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)n);
+    }
+    buf_printf(b, "nimt_%s_sum %.15g\nnimt_%s_count %llu\n", name, h->sum * scale, name,
+               (unsigned long long)n);
+}
+
+// Per-session lines, as many as fit in a reply.
+static void stats_sessions(Buf *b) {
+    static const struct { const char *name, *type, *help; } m[] = {
+        {"session_output_bytes_total", "counter", "Output read from the pty."},
+        {"session_input_bytes_total", "counter", "Keystrokes from clients."},
+        {"session_dropped_bytes_total", "counter", "Output skipped for lagging clients."},
+        {"session_scrollback_bytes", "gauge", "Scrollback ring size."},
+        {"session_scrollback_used_bytes", "gauge", "Output held in the scrollback."},
+        {"session_attached", "gauge", "Attached clients."},
+    };
+    for (size_t k = 0; k < sizeof(m) / sizeof(m[0]); k++) {
+        buf_printf(b, "# HELP nimt_%s %s\n# TYPE nimt_%s %s\n", m[k].name, m[k].help, m[k].name,
+                   m[k].type);
+        for (int i = 0; i < g_nslots; i++) {
+            Session *s = g_slots[i].session;
+            if (!s) continue;
+            if (buf_pending(b) > FRAME_MAX_PAYLOAD - 256) return;
+            uint64_t head = stat_get(&s->scrollback.head);
+            uint64_t v[] = {
+                head,
+                stat_get(&s->input_bytes),
+                stat_get(&s->dropped),
+                s->ring_size,
+                head < s->ring_size ? head : s->ring_size,
+                stat_get(&s->attached),
+            };
+            buf_printf(b, "nimt_%s{id=\"%d\"} %llu\n", m[k].name, s->id,
+                       (unsigned long long)v[k]);
+        }
+    }
+}
+
+static void op_stats(Conn *c, const FrameHeader *req, const char *p) {
+    int flags = req->len >= 1 ? p[0] : 0;
+    Stats t;
+    stats_total(&t);
+    int sessions = 0;
+    for (int i = 0; i < g_nslots; i++) sessions += g_slots[i].session != NULL;
+    Buf b = {0};
+    stats_metric(&b, "sessions", "gauge", "Sessions.", sessions);
+    stats_metric(&b, "connections", "gauge", "Client connections.", t.conns);
+    stats_metric(&b, "attached", "gauge", "Attached clients.", t.attached);
+    stats_metric(&b, "spawns_queued", "gauge", "Spawn requests with the spawner.", g_spawns_queued);
+    stats_metric(&b, "memory_used_bytes", "gauge", "Slabs, buffers and scrollback.", mem_used());
+    stats_metric(&b, "memory_budget_bytes", "gauge", "NIMT_MEMORY, 0 for none.", g_mem_budget);
+    stats_metric(&b, "hibernating", "gauge", "Sessions hibernating.", t.hibernating);
+    stats_metric(&b, "hibernated_bytes", "gauge", "Their scrollback, compressed.", t.packed_bytes);
+    stats_metric(&b, "pty_reads_total", "counter", "Reads from ptys.", t.pty_reads);
+    stats_metric(&b, "pty_read_bytes_total", "counter", "Output read from ptys.", t.pty_bytes);
+    stats_metric(&b, "input_bytes_total", "counter", "Keystrokes for ptys.", t.input_bytes);
+    stats_metric(&b, "relay_bytes_total", "counter", "Output sent to attached clients.",
+                 t.relay_bytes);
+    stats_metric(&b, "dropped_bytes_total", "counter", "Output skipped for lagging clients.",
+                 t.dropped_bytes);
+    if (NIMT_WITH_METRICS) {
+        stats_histogram(&b, "pty_read_size_bytes", "Bytes per pty read.", &t.read_size,
+                        READ_SIZE_BOUNDS, 1);
+        stats_histogram(&b, "relay_latency_seconds", "Pty read to attached clients' sockets.",
+                        &t.relay_latency, LATENCY_BOUNDS_US, 1e-6);
+        stats_histogram(&b, "spawn_seconds", "Spawn request to reply.", &t.spawn_time,
+                        LATENCY_BOUNDS_US, 1e-6);
+    }
+    if (g_nshards)
+        buf_printf(&b, "# HELP nimt_shard_sessions Sessions per I/O shard.\n"
+                       "# TYPE nimt_shard_sessions gauge\n");
+    for (int i = 0; i < g_nshards; i++)
+        buf_printf(&b, "nimt_shard_sessions{shard=\"%d\"} %d\n", i, g_shards[i].sessions);
+    if (flags & STATS_SESSIONS) stats_sessions(&b);
+    reply_ok(c, req, b.data, buf_pending(&b));
+    buf_free(&b);
+}
+
+static void op_kill(Conn *c, const FrameHeader *req, const char *p) {
+    Session *s = req->len >= 4 ? find_session(get_u32(p)) : NULL;
+    if (!s) {
+        reply_error(c, req, "no such session");
+        return;
+    }
+    session_kill(s);
+    reply_ok(c, req, NULL, 0);
+}
+
+static void op_kill_batch(Conn *c, const FrameHeader *req, const char *p) {
+    Buf killed = {0};
+    for (uint32_t off = 0; off + 8 <= req->len; off += 8) {
+        uint32_t first = get_u32(p + off), last = get_u32(p + off + 4);
+        // Only IDs that can exist: a huge range costs what the table holds.
+        if (first < 1) first = 1;
+        if (last > (uint32_t)g_nslots) last = g_nslots;
+        for (uint32_t id = first; id <= last; id++) {
+            Session *s = find_session(id);
+            if (!s) continue;
+            session_kill(s);
+            char rec[4];
+            put_u32(rec, id);
+            buf_append(&killed, rec, sizeof(rec));
+        }
+    }
+    reply_ok(c, req, killed.data, buf_pending(&killed));
+    buf_free(&killed);
+}
+
+static void op_attach(Conn *c, const FrameHeader *req, const char *p) {
+    Session *s = req->len >= 9 ? find_session(get_u32(p)) : NULL;
+    if (!s) {
+        reply_error(c, req, "no such session");
+        return;
+    }
+    AttachPolicy policy = (AttachPolicy)(unsigned char)p[4];
+    if (policy > POLICY_DISCONNECT) policy = POLICY_BLOCK;
+    struct winsize ws = {get_u16(p + 5), get_u16(p + 7), 0, 0};
+    session_attach(s, c, req, policy, &ws, req->len >= 10 ? p[9] : 0);
+}
+
+static void handle_frame(Conn *c, const FrameHeader *req, const char *payload) {
+    switch (req->opcode) {
+    case OP_SPAWN:
+        op_spawn(c, req, payload);
+        break;
+    case OP_LIST:
+        op_list(c, req, payload);
+        break;
+    case OP_KILL:
+        op_kill(c, req, payload);
+        break;
+    case OP_ATTACH:
+        op_attach(c, req, payload);
+        break;
+    case OP_SPAWN_BATCH:
+        op_spawn_batch(c, req, payload);
+        break;
+    case OP_KILL_BATCH:
+        op_kill_batch(c, req, payload);
+        break;
+    case OP_POOL:
+        op_pool(c, req, payload);
+        break;
+    case OP_UPGRADE:
+        op_upgrade(c, req);
+        break;
+    case OP_RECORD:
+        op_record(c, req, payload);
+        break;
+    case OP_SCREEN:
+        op_screen(c, req, payload);
+        break;
+    case OP_LIMIT:
+        op_limit(c, req, payload);
+        break;
+    case OP_STATS:
+        op_stats(c, req, payload);
+        break;
+    case OP_SEND:
+        op_send(c, req, payload);
+        break;
+    case OP_READ:
+        op_read(c, req, payload);
+        break;
+    case OP_WAIT:
+        op_wait(c, req, payload);
+        break;
+    case OP_SPAWN_LIMITED:
+        op_spawn_limited(c, req, payload);
+        break;
+    default:
+        reply_error(c, req, "unknown opcode %u", req->opcode);
+        break;
+    }
+}
+
+/**********************************************************************
+ *                       CONNECTION STATE MACHINE
+ **********************************************************************/
+
+// Hand keystrokes to the session, stopping at the detach key.
+// Returns -1 once the client detached.
+static int conn_input(Conn *c, const char *buf, size_t n) {
+    Session *s = c->session;
+    size_t len = n;
+    int detach = 0;
+    for (size_t i = 0; i < n; i++) {
+        if ((unsigned char)buf[i] == ATTACH_DETACH_KEY) {
+            len = i;
+            detach = 1;
+            break;
+        }
+    }
+    stat_add(&s->input_bytes, len);
+    stat_add(&c->shard->stats.input_bytes, len);
+    if (len) s->keystroke = 1;
+    buf_append(&s->input, buf, len);
+    if (buf_flush(&s->input, &s->ev, 0) < 0) buf_free(&s->input);
+    return detach ? -1 : 0;
+}
+
+// Run every complete request in c->in. Text commands are only complete
+// once the client stops writing, so callers run those at EAGAIN or EOF.
+// Returns -1 on a protocol error.
+static int conn_process(Conn *c) {
+    if (c->proto == PROTO_TEXT) {
+        // Old clients send one unterminated command per connection, so
+        // a line also ends where the client stopped writing.
+        while (c->state == CONN_COMMAND && !c->jobs && buf_pending(&c->in) > 0) {
+            char *line = c->in.data + c->in.off;
+            char *nl = memchr(line, '\n', buf_pending(&c->in));
+            size_t len = nl ? (size_t)(nl - line) : buf_pending(&c->in);
+            char cmd[4096];
+            if (len >= sizeof(cmd)) return -1;
+            memcpy(cmd, line, len);
+            cmd[len] = 0;
+            c->in.off += nl ? len + 1 : len;
+            handle_command(c, cmd);
+        }
+        if (c->state == CONN_COMMAND && !c->jobs) c->state = CONN_CLOSING;
+        return 0;
+    }
+
+    while (c->state == CONN_COMMAND && buf_pending(&c->in) >= FRAME_HEADER_SIZE) {
+        FrameHeader req;
+        const char *p = c->in.data + c->in.off;
+        frame_get_header(p, &req);
+        if (req.magic != PROTO_MAGIC || req.len > FRAME_MAX_PAYLOAD) return -1;
+        if (buf_pending(&c->in) < FRAME_HEADER_SIZE + req.len) break;
+        // Replies go out in request order. Only spawns can queue behind a
+        // job, as long as it is a spawn too: the spawner takes them in order.
+        if (c->jobs && (c->jobs != c->spawns ||
+                        (req.opcode != OP_SPAWN && req.opcode != OP_SPAWN_BATCH &&
+                         req.opcode != OP_SPAWN_LIMITED)))
+            break;
+        c->in.off += FRAME_HEADER_SIZE + req.len;
+        handle_frame(c, &req, p + FRAME_HEADER_SIZE);
+    }
+
+    // Bytes pipelined behind an ATTACH are the first keystrokes.
+    if (c->state == CONN_ATTACHED && buf_pending(&c->in) > 0) {
+        int rc = conn_input(c, c->in.data + c->in.off, buf_pending(&c->in));
+        buf_free(&c->in);
+        return rc;
+    }
+    // A client done sending still gets answers to frames held for jobs.
+    if (c->eof && c->state == CONN_COMMAND && !c->jobs) c->state = CONN_CLOSING;
+    return 0;
+}
+
+// Read requests until the socket is drained or replies pile up.
+// Returns -1 when the connection should be dropped.
+static int conn_read_requests(Conn *c) {
+    while (c->state == CONN_COMMAND && conn_wants_requests(c)) {
+        char buf[16384];
+        ssize_t n = read(c->ev.fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_clear(&c->ev, EV_READ);
+                // A text command is complete once the client pauses.
+                if (c->proto == PROTO_TEXT) return conn_process(c);
+                return 0;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            // The client is done sending; answer what it asked, then close.
+            c->eof = 1;
+            return conn_process(c);
+        }
+        buf_append(&c->in, buf, n);
+        if (c->proto == PROTO_UNKNOWN)
+            c->proto = (unsigned char)buf[0] == PROTO_MAGIC ? PROTO_BINARY : PROTO_TEXT;
+        if (c->proto == PROTO_BINARY && conn_process(c) < 0) return -1;
+        if (c->proto == PROTO_TEXT && buf_pending(&c->in) > 4096) return -1;
+    }
+    return 0;
+}
+
+// Keystrokes from an attached client go straight to the pty; whatever
+// it does not take right away is queued and the client is paused.
+static int conn_read_attached(Conn *c) {
+    Session *s = c->session;
+    while (c->session && buf_pending(&s->input) == 0) {
+        char buf[4096];
+        ssize_t n = read(c->ev.fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_clear(&c->ev, EV_READ);
+                return 0;
+            }
+            return -1;
+        }
+        if (n == 0) return -1;
+        if (conn_input(c, buf, n) < 0) return -1;
+    }
+    if (c->session) session_update_interest(s);
+    return 0;
+}
+
+// A watcher has nothing more to say: read until it hangs up.
+static int conn_read_watching(Conn *c) {
+    while (1) {
+        char buf[512];
+        ssize_t n = read(c->ev.fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            ev_clear(&c->ev, EV_READ);
+            return 0;
+        }
+        if (n <= 0) return -1;
+    }
+}
+
+// Whether a client done sending has closed its end altogether, so no
+// one is left to read the answers. kqueue reports the first as an error
+// as well.
+static int conn_hung_up(const Conn *c) {
+    struct pollfd pfd = {c->ev.fd, 0, 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR));
+}
+
+static void conn_event(EvHandle *h, unsigned revents) {
+    Conn *c = (Conn *)h;
+
+    if (revents & EV_WRITE || (revents & EV_ERROR && c->state == CONN_CLOSING)) {
+        if (conn_flush(c) < 0) {
+            conn_close(c);
+            return;
+        }
+        if (c->session) session_update_interest(c->session);
+    }
+
+    if (revents & (EV_READ | EV_ERROR)) {
+        int rc = 0;
+        if (c->state == CONN_COMMAND)
+            rc = conn_read_requests(c);
+        else if (c->state == CONN_ATTACHED)
+            rc = conn_read_attached(c);
+        else if (c->state == CONN_WATCHING)
+            rc = conn_read_watching(c);
+        if (rc < 0 || conn_flush(c) < 0) {
+            conn_close(c);
+            return;
+        }
+    }
+
+    // Hung up with jobs in flight: close now, or a wait would keep the
+    // Conn until its session exits.
+    if (revents & EV_ERROR && c->eof && c->jobs && conn_hung_up(c)) {
+        conn_close(c);
+        return;
+    }
+
+    if (c->state == CONN_CLOSING && !conn_has_output(c) && !c->jobs) {
+        conn_close(c);
+        return;
+    }
+    conn_update_interest(c);
+}
+
+// A job for c is done and has queued its reply: send it, and serve what
+// was held back behind it.
+static void conn_job_done(Conn *c) {
+    c->jobs--;
+    if (c->ev.fd < 0) {
+        if (!c->jobs) ev_defer_free(&c->shard->loop, c);
+        return;
+    }
+    if (conn_process(c) < 0 || conn_flush(c) < 0 ||
+        (c->state == CONN_CLOSING && !conn_has_output(c) && !c->jobs)) {
+        conn_close(c);
+        return;
+    }
+    conn_update_interest(c);
+}
+
+static void server_event(EvHandle *h, unsigned revents) {
+    (void)revents;
+    while (1) {
+        int client_sock = accept(h->fd, NULL, NULL);
+        if (client_sock < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                ev_clear(h, EV_READ);
+            else
+                perror("accept");
+            return;
+        }
+        conn_new(&g_main, client_sock);
+    }
+}
+
+/**********************************************************************
+ *                      PERSISTENCE & UPGRADE
+ **********************************************************************/
+
+static void open_state_dir(void) {
+#if NIMT_WITH_STATE
+    g_state_dir = open_private_dir(STATE_DIR);
+    if (g_state_dir < 0) perror("open STATE_DIR");
+#endif
+}
+
+// Take over one scrollback file. After an upgrade its child and pty
+// master are still ours; after a crash only the output is left, and the
+// session stays listed until it is killed.
+static void adopt_session(const char *name, int upgrade) {
+    Session *s = slab_calloc(&g_session_slab);
+    if (ring_adopt(&s->scrollback, name) < 0) {
+        unlinkat(g_state_dir, name, 0);
+        slab_free(s);
+        return;
+    }
+    RingFile *f = s->scrollback.file;
+    int fd = upgrade ? f->master_fd : -1;
+    f->master_fd = -1;
+    if (f->id == 0 || slot_adopt(f->id, s) < 0) {
+        // An idle pool session, or a file that lost its ID.
+        if (fd >= 0) close(fd);
+        if (upgrade) kill(f->pid, SIGKILL);
+        ring_free(&s->scrollback);
+        slab_free(s);
+        return;
+    }
+    s->id = f->id;
+    s->ring_size = s->scrollback.size;
+    s->master_fd = -1;
+    s->ev.fd = -1;
+    ev_timer_init(&s->notify_timer, session_notify_timer);
+    ev_timer_init(&s->rate_timer, session_rate_timer);
+    ev_timer_init(&s->idle_timer, session_idle_timer);
+    s->notified = s->scrollback.head;
+    s->rate = f->rate;
+    s->started = f->started;
+    if (f->command[0]) s->command = strndup(f->command, sizeof(f->command));
+    if (upgrade) {
+        s->child_pid = f->pid;
+        s->cgroup = f->cgroup;
+        pid_insert(s);
+    } else {
+        if (f->cgroup) {
+            char dir[256];
+            cgroup_session_dir(f->cgroup, dir, sizeof(dir));
+            rmdir(dir);
+            f->cgroup = 0;
+        }
+        // Named by ID now: a new child may reuse the old pid.
+        char dead[32];
+        snprintf(dead, sizeof(dead), "dead-%u.ring", f->id);
+        if (renameat(g_state_dir, f->name, g_state_dir, dead) == 0)
+            snprintf(f->name, sizeof(f->name), "%s", dead);
+    }
+    if (fd >= 0 && fcntl(fd, F_GETFD) >= 0) {
+        s->master_fd = fd;
+        set_nonblock_cloexec(fd);
+    }
+    // Shards are not running yet: the screen can be set up from here.
+    session_place(s);
+    if (f->screen) session_set_screen(s, 1);
+}
+
+static void adopt_sessions(int upgrade) {
+    int fd = dup(g_state_dir);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        size_t len = strlen(e->d_name);
+        if (len > 5 && strcmp(e->d_name + len - 5, ".ring") == 0) adopt_session(e->d_name, upgrade);
+    }
+    closedir(d);
+    // Children that exited while nobody was waiting.
+    if (upgrade) handle_sigchld();
+}
+
+// Replace the daemon image with the binary on disk, keeping the pid so
+// the sessions stay our children. Masters and the listening socket
+// survive exec; everything else is close-on-exec, so attached clients
+// see their connection end.
+static void daemon_upgrade(void) {
+    g_upgrade_pending = 0;
+    for (Pool *p = g_pools; p; p = p->next) pool_trim(p, 0);
+    // Sessions are touched below from this thread alone.
+    shards_stop();
+    for (int i = 0; i < g_nslots; i++) {
+        Session *s = g_slots[i].session;
+        if (s) session_wake(s);  // the scrollback files must hold it all
+        if (s && s->master_fd >= 0) {
+            // Output the kernel is reading for us would be lost with it.
+            ev_read_sync(&s->ev);
+            session_read_pty(s);
+        }
+        if (s) record_stop(s);  // closed, not carried over
+        if (!s || s->master_fd < 0 || !s->scrollback.file) continue;
+        s->scrollback.file->master_fd = s->master_fd;
+        fcntl(s->master_fd, F_SETFD, 0);
+    }
+    fcntl(g_server_sock, F_SETFD, 0);
+
+    char fd_str[16];
+    snprintf(fd_str, sizeof(fd_str), "%d", g_server_sock);
+    setenv("NIMT_UPGRADE_FD", fd_str, 1);
+    char *argv[] = {g_exe, NULL};
+    execv(g_exe, argv);
+    perror("upgrade: execv");
+
+    unsetenv("NIMT_UPGRADE_FD");
+    set_nonblock_cloexec(g_server_sock);
+    for (int i = 0; i < g_nslots; i++) {
+        Session *s = g_slots[i].session;
+        if (!s || s->master_fd < 0 || !s->scrollback.file) continue;
+        s->scrollback.file->master_fd = -1;
+        set_nonblock_cloexec(s->master_fd);
+    }
+    shards_start();
+    g_pools_short = 1;
+}
+
+/**********************************************************************
+ *                      DAEMON MAIN LOOP
+ **********************************************************************/
+
+// ready_fd gets one byte once the socket accepts connections. After an
+// upgrade the socket is inherited instead, and ready_fd is -1.
+static void daemon_loop(int ready_fd) {
+#if defined(__linux__)
+    ssize_t n = readlink("/proc/self/exe", g_exe, sizeof(g_exe) - 1);
+    if (n > 0) g_exe[n] = 0;
+    else
+#endif
+    if (!realpath(g_argv0, g_exe)) snprintf(g_exe, sizeof(g_exe), "%s", g_argv0);
+    const char *upgrade = getenv("NIMT_UPGRADE_FD");
+
+    umask(0177);
+    // A nimt run inside a session talks to this daemon, like $TMUX.
+    setenv("NIMT_SOCKET", SOCKET_PATH, 1);
+    if (pipe(g_signal_pipe) == -1) perror_exit("pipe");
+    set_nonblock_cloexec(g_signal_pipe[0]);
+    set_nonblock_cloexec(g_signal_pipe[1]);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    setup_signal_handlers();
+    // Inherited by every session, which must outlive its pty hanging up.
+    signal(SIGHUP, SIG_IGN);
+#ifdef NEED_SIGPIPE_IGNORE
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    if (upgrade) {
+        g_server_sock = atoi(upgrade);
+        unsetenv("NIMT_UPGRADE_FD");
+        set_nonblock_cloexec(g_server_sock);
+    } else {
+        unlink(SOCKET_PATH);
+        g_server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (g_server_sock < 0) perror_exit("socket");
+        set_nonblock_cloexec(g_server_sock);
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+        if (bind(g_server_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) perror_exit("bind");
+        if (listen(g_server_sock, 64) < 0) perror_exit("listen");
+        chmod(SOCKET_PATH, 0600);
+    }
+    if (ready_fd >= 0) {
+        if (write(ready_fd, "", 1) < 0) {
+            // The client gave up waiting; run anyway.
+        }
+        close(ready_fd);
+    }
+
+    ev_init(&g_main.loop);
+    ev_add(&g_main.loop, &g_server_ev, g_server_sock, EV_READ, server_event);
+    ev_add(&g_main.loop, &g_signal_ev, g_signal_pipe[0], EV_READ, signal_event);
+
+#if NIMT_WITH_SHARDS
+    // NIMT_SHARDS=N moves session I/O onto N threads; see SHARDS.
+    const char *shards = getenv("NIMT_SHARDS");
+    if (shards && *shards) {
+        int n = atoi(shards);
+        if (n > 0) shards_init(n < SHARD_MAX ? n : SHARD_MAX);
+    }
+#endif
+
+#if NIMT_WITH_HIBERNATE
+    // NIMT_HIBERNATE=SECONDS puts idle sessions to sleep; see HIBERNATION.
+    const char *hibernate = getenv("NIMT_HIBERNATE");
+    if (hibernate && *hibernate) g_hibernate_us = strtod(hibernate, NULL) * 1e6;
+    g_hibernate_stop = g_hibernate_us && getenv("NIMT_HIBERNATE_STOP") != NULL;
+#endif
+    open_state_dir();
+    if (g_state_dir >= 0) adopt_sessions(upgrade != NULL);
+
+    // NIMT_MEMORY=512M caps what sessions, clients and scrollback use.
+    const char *memory = getenv("NIMT_MEMORY");
+    if (memory && *memory) g_mem_budget = parse_size(memory);
+    g_record_all = NIMT_WITH_RECORD && getenv("NIMT_RECORD") != NULL;
+    g_screen_all = NIMT_WITH_SCREEN && getenv("NIMT_SCREEN") != NULL;
+    // NIMT_POOL=N keeps N default shells warm from the start.
+    const char *pool = getenv("NIMT_POOL");
+    if (pool && *pool) {
+        uint32_t n = strtoul(pool, NULL, 10);
+        pool_configure("bash", SCROLLBACK_DEFAULT, n < POOL_MAX ? n : POOL_MAX);
+    }
+    shards_start();
+
+    while (1) {
+        if (g_upgrade_pending && !g_shutdown) daemon_upgrade();
+        pool_refill();
+        mem_reclaim();
+        ev_run_once(&g_main.loop);
+    }
+}
+
+/**********************************************************************
+ *                         CLIENT FUNCTIONS
+ **********************************************************************/
+
+static int connect_to_daemon(void) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Fork the daemon and wait until it listens (or dies trying). lock_fd
+// is the caller's start lock, which the daemon must not keep holding.
+// Returns the daemon's pid.
+static pid_t start_daemon(int lock_fd) {
+    int ready[2];
+    if (pipe(ready) < 0) perror_exit("pipe");
+    pid_t pid = fork();
+    if (pid < 0) perror_exit("fork");
+    if (pid == 0) {
+        close(lock_fd);
+        close(ready[0]);
+        fcntl(ready[1], F_SETFD, FD_CLOEXEC);
+        setsid();
+        // Don't hold the caller's stdout open, e.g. id=$(nimt spawn).
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            if (null_fd > STDERR_FILENO) close(null_fd);
+        }
+        // A leaf of its own: cgroup v2 hands controllers down to session
+        // groups only from a group that holds no processes.
+        mkdirp(CGROUP_FOLDER);
+        mkdirp(CGROUP_DAEMON);
+        move_to_cgroup(CGROUP_PATH);
+
+        daemon_loop(ready[1]);
+        exit(0);
+    }
+    close(ready[1]);
+    char byte;
+    while (read(ready[0], &byte, 1) < 0 && errno == EINTR);
+    close(ready[0]);
+    return pid;
+}
+
+// Connect, starting the daemon first if nobody is listening. Clients
+// that race to start it serialize on LOCK_PATH; the losers find the
+// winner's daemon listening once they get the lock.
+static int connect_with_retry(void) {
+    int sock = connect_to_daemon();
+    if (sock >= 0) return sock;
+
+    int lock_fd = open(LOCK_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd < 0) perror_exit("open lock");
+    while (flock(lock_fd, LOCK_EX) < 0) {
+        if (errno != EINTR) perror_exit("flock");
+    }
+    sock = connect_to_daemon();
+    if (sock < 0) {
+        start_daemon(lock_fd);
         sock = connect_to_daemon();
-        if (sock >= 0) return sock;
-        if (i == 0) start_daemon();
-        usleep(200000);
     }
+    close(lock_fd);
+    if (sock >= 0) return sock;
     fprintf(stderr, "Error: Failed to connect to daemon\n");
     exit(1);
 }
 
-static void client_spawn(int argc, char **argv) {
-    char buf[4096] = "SPAWN";
-    for (int i = 2; i < argc; i++) {
-        strncat(buf, " ", sizeof(buf) - strlen(buf) - 1);
-        strncat(buf, argv[i], sizeof(buf) - strlen(buf) - 1);
+static int read_full(int fd, void *buf, size_t count) {
+    size_t got = 0;
+    while (got < count) {
+        ssize_t n = read(fd, (char *)buf + got, count - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// Wait for one reply frame. The payload is returned NUL-terminated in
+// malloc'ed memory, or NULL if the daemon went away.
+static char *rpc_recv(int sock, FrameHeader *reply) {
+    char hdr[FRAME_HEADER_SIZE];
+    if (read_full(sock, hdr, sizeof(hdr)) < 0) return NULL;
+    frame_get_header(hdr, reply);
+    if (reply->magic != PROTO_MAGIC || reply->len > FRAME_MAX_PAYLOAD) return NULL;
+    char *payload = malloc(reply->len + 1);
+    if (!payload) perror_exit("malloc");
+    if (read_full(sock, payload, reply->len) < 0) {
+        free(payload);
+        return NULL;
     }
+    payload[reply->len] = 0;
+    return payload;
+}
+
+static void rpc_send(int sock, uint8_t opcode, uint32_t req_id, const void *payload, uint32_t len) {
+    Buf b = {0};
+    frame_append(&b, opcode, STATUS_OK, req_id, payload, len);
+    write_all(sock, b.data, b.len);
+    buf_free(&b);
+}
 
+// One request, one reply, on a fresh connection.
+static char *rpc_call(uint8_t opcode, const void *payload, uint32_t len, FrameHeader *reply) {
     int sock = connect_with_retry();
-    write_all(sock, buf, strlen(buf));
+    rpc_send(sock, opcode, 1, payload, len);
+    char *res = rpc_recv(sock, reply);
+    close(sock);
+    if (!res) {
+        fprintf(stderr, "Error: daemon closed the connection\n");
+        exit(1);
+    }
+    return res;
+}
 
-    char line[256];
-    ssize_t n = read(sock, line, sizeof(line)-1);
-    if (n > 0) {
-        line[n] = 0;
-        printf("%s", line);
+// Append argv[first..] to buf[len..size) joined by spaces; returns the new length.
+static size_t join_command(char *buf, size_t len, size_t size, int first, int argc, char **argv) {
+    for (int i = first; i < argc; i++) {
+        int n = snprintf(buf + len, size - len, "%s%s", i > first ? " " : "", argv[i]);
+        if (n < 0 || (size_t)n >= size - len) return size - 1;
+        len += n;
     }
-    close(sock);
+    return len;
 }
 
-static void client_list(void) {
-    int sock = connect_with_retry();
-    write_all(sock, "LIST", 4);
+// OP_RECORD or OP_SCREEN for one session.
+static int client_set_flag(uint8_t op, uint32_t id, int on) {
+    char buf[5];
+    put_u32(buf, id);
+    buf[4] = on;
+    FrameHeader reply;
+    char *res = rpc_call(op, buf, sizeof(buf), &reply);
+    if (reply.status != STATUS_OK) printf("ERROR %s\n", res);
+    free(res);
+    return reply.status == STATUS_OK ? 0 : -1;
+}
+
+static void client_spawn(int argc, char **argv) {
+    char buf[4096];
+    int first = 2;
+    uint32_t count = 1;
+    int record = 0, screen = 0;
+    char limit[LIMITS_SIZE] = {0};
+    int limited = 0;
+    put_u32(buf, 0);
+    while (first < argc) {
+        if (strcmp(argv[first], "-r") == 0) {
+            record = 1;
+            first++;
+            continue;
+        }
+        if (strcmp(argv[first], "-s") == 0) {
+            screen = 1;
+            first++;
+            continue;
+        }
+        if (first + 1 >= argc) break;
+        if (strcmp(argv[first], "-b") == 0) {
+            put_u32(buf, parse_size(argv[first + 1]));
+        } else if (strcmp(argv[first], "-n") == 0 || strcmp(argv[first], "--count") == 0) {
+            count = strtoul(argv[first + 1], NULL, 10);
+        } else if (strcmp(argv[first], "-C") == 0) {
+            put_u32(limit, strtoul(argv[first + 1], NULL, 10));
+            limited = 1;
+        } else if (strcmp(argv[first], "-M") == 0) {
+            put_u32(limit + 4, parse_size(argv[first + 1]) >> 10);
+            limited = 1;
+        } else if (strcmp(argv[first], "-I") == 0) {
+            put_u16(limit + 8, strtoul(argv[first + 1], NULL, 10));
+            limited = 1;
+        } else if (strcmp(argv[first], "-o") == 0) {
+            put_u32(limit + 10, parse_size(argv[first + 1]));
+            limited = 1;
+        } else {
+            break;
+        }
+        first += 2;
+    }
+    put_u32(buf + 4, count);
+    // Limits go with the spawn: the child must not run a moment without.
+    memcpy(buf + 8, limit, sizeof(limit));
+    size_t len = join_command(buf, limited ? 8 + sizeof(limit) : 8, sizeof(buf), first, argc, argv);
+
+    FrameHeader reply;
+    char *res;
+    if (limited) {
+        res = rpc_call(OP_SPAWN_LIMITED, buf, len, &reply);
+    } else if (count == 1) {
+        // Plain OP_SPAWN has no count field.
+        memmove(buf + 4, buf + 8, len - 8);
+        res = rpc_call(OP_SPAWN, buf, len - 4, &reply);
+    } else {
+        res = rpc_call(OP_SPAWN_BATCH, buf, len, &reply);
+    }
+    if (reply.status != STATUS_OK) {
+        printf("ERROR %s\n", res);
+    } else {
+        for (uint32_t off = 0; off + 4 <= reply.len; off += 4) {
+            uint32_t id = get_u32(res + off);
+            if (!id) printf("ERROR spawn failed\n");
+            else if ((!record || client_set_flag(OP_RECORD, id, 1) == 0) &&
+                     (!screen || client_set_flag(OP_SCREEN, id, 1) == 0))
+                printf("OK %u\n", id);
+        }
+    }
+    free(res);
+}
+
+// pool [-b SIZE] COUNT [CMD...]
+static void client_pool(int argc, char **argv) {
+    char buf[4096];
+    int first = 2;
+    put_u32(buf, 0);
+    if (argc > 3 && strcmp(argv[2], "-b") == 0) {
+        put_u32(buf, parse_size(argv[3]));
+        first = 4;
+    }
+    if (first >= argc) {
+        printf("ERROR missing count\n");
+        return;
+    }
+    put_u32(buf + 4, strtoul(argv[first], NULL, 10));
+    size_t len = join_command(buf, 8, sizeof(buf), first + 1, argc, argv);
+
+    FrameHeader reply;
+    char *res = rpc_call(OP_POOL, buf, len, &reply);
+    if (reply.status == STATUS_OK)
+        printf("OK\n");
+    else
+        printf("ERROR %s\n", res);
+    free(res);
+}
+
+// record|screen <ID> [on|off]
+static void client_toggle(uint8_t op, int argc, char **argv) {
+    int on = !(argc > 3 && strcmp(argv[3], "off") == 0);
+    if (client_set_flag(op, atoi(argv[2]), on) == 0) printf("OK\n");
+}
+
+// send [-n] <ID> [TEXT...]: TEXT, or else stdin, as input; -n: then Enter.
+static void client_send(int argc, char **argv) {
+    int arg = 2, enter = 0;
+    if (arg < argc && strcmp(argv[arg], "-n") == 0) {
+        enter = 1;
+        arg++;
+    }
+    if (arg >= argc) {
+        fprintf(stderr, "Error: no session ID\n");
+        exit(1);
+    }
+    Buf input = {0};
+    char id[4];
+    put_u32(id, strtoul(argv[arg++], NULL, 10));
+    buf_append(&input, id, sizeof(id));
+    if (arg < argc) {
+        for (int i = arg; i < argc; i++) {
+            if (i > arg) buf_append(&input, " ", 1);
+            buf_append(&input, argv[i], strlen(argv[i]));
+        }
+    } else {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+            if (n > 0) buf_append(&input, buf, n);
+        }
+    }
+    if (enter) buf_append(&input, "\r", 1);
+    if (input.len > FRAME_MAX_PAYLOAD) {
+        fprintf(stderr, "Error: input too long\n");
+        exit(1);
+    }
+    FrameHeader reply;
+    char *res = rpc_call(OP_SEND, input.data, input.len, &reply);
+    if (reply.status != STATUS_OK) printf("ERROR %s\n", res);
+    free(res);
+    buf_free(&input);
+}
 
-    char line[4096];
-    while (read(sock, line, sizeof(line)-1) > 0) {
-        printf("%s", line);
+// read [--since OFFSET] <ID>: output from OFFSET on to stdout, and the
+// offset to go on from to stderr.
+static void client_read(int argc, char **argv) {
+    int arg = 2;
+    uint64_t since = 0;
+    if (arg + 1 < argc && strcmp(argv[arg], "--since") == 0) {
+        since = strtoull(argv[arg + 1], NULL, 10);
+        arg += 2;
+    }
+    if (arg >= argc) {
+        fprintf(stderr, "Error: no session ID\n");
+        exit(1);
     }
+    char req[12];
+    put_u32(req, strtoul(argv[arg], NULL, 10));
+    int sock = connect_with_retry();
+    uint64_t until = 0;
+    // What was there when asked, a reply at a time.
+    do {
+        put_u64(req + 4, since);
+        rpc_send(sock, OP_READ, 1, req, sizeof(req));
+        FrameHeader reply;
+        char *res = rpc_recv(sock, &reply);
+        if (!res) {
+            fprintf(stderr, "Error: daemon closed the connection\n");
+            exit(1);
+        }
+        if (reply.status != STATUS_OK || reply.len < 16) {
+            printf("ERROR %s\n", res);
+            free(res);
+            exit(1);
+        }
+        if (!until) until = get_u64(res + 8);
+        write_all(STDOUT_FILENO, res + 16, reply.len - 16);
+        since = get_u64(res) + reply.len - 16;
+        free(res);
+    } while (since < until);
     close(sock);
+    fprintf(stderr, "%llu\n", (unsigned long long)since);
+}
+
+// wait [-t SECONDS] [--since OFFSET] <ID> <PATTERN>: block until
+// PATTERN turns up in the session's output, then print the offset just
+// past the match. Without --since only output yet to come counts.
+static void client_wait(int argc, char **argv) {
+    int arg = 2;
+    uint32_t timeout_ms = 0;
+    uint64_t since = UINT64_MAX;
+    while (arg + 1 < argc) {
+        if (strcmp(argv[arg], "-t") == 0) timeout_ms = strtod(argv[arg + 1], NULL) * 1000;
+        else if (strcmp(argv[arg], "--since") == 0) since = strtoull(argv[arg + 1], NULL, 10);
+        else break;
+        arg += 2;
+    }
+    if (arg + 1 >= argc) {
+        fprintf(stderr, "Error: need a session ID and a pattern\n");
+        exit(1);
+    }
+    size_t len = strlen(argv[arg + 1]);
+    if (len > PAT_MAX) {
+        fprintf(stderr, "Error: pattern too long\n");
+        exit(1);
+    }
+    char req[16 + PAT_MAX];
+    put_u32(req, strtoul(argv[arg], NULL, 10));
+    put_u32(req + 4, timeout_ms);
+    put_u64(req + 8, since);
+    memcpy(req + 16, argv[arg + 1], len);
+    FrameHeader reply;
+    char *res = rpc_call(OP_WAIT, req, 16 + len, &reply);
+    if (reply.status != STATUS_OK || reply.len < 8) {
+        printf("ERROR %s\n", res);
+        free(res);
+        exit(1);
+    }
+    printf("%llu\n", (unsigned long long)get_u64(res));
+    free(res);
+}
+
+// Offset of the last indexed frame at or before from_us.
+static uint64_t replay_seek(int index_fd, uint64_t from_us) {
+    uint64_t off = RECORD_HEADER_SIZE;
+    struct stat st;
+    if (index_fd < 0 || fstat(index_fd, &st) < 0) return off;
+    size_t lo = 0, hi = st.st_size / RECORD_INDEX_ENTRY;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        char e[RECORD_INDEX_ENTRY];
+        if (pread(index_fd, e, sizeof(e), (off_t)mid * RECORD_INDEX_ENTRY) != (ssize_t)sizeof(e)) break;
+        if (get_u64(e) <= from_us) {
+            off = get_u64(e + 8);
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return off;
+}
+
+// replay <ID|FILE.nrec> [--from SECONDS] [--to SECONDS]
+static void client_replay(int argc, char **argv) {
+    char path[4096], index_path[4096];
+    const char *arg = argv[2];
+    if (strspn(arg, "0123456789") == strlen(arg))
+        snprintf(path, sizeof(path), "%s/%s.nrec", RECORD_DIR, arg);
+    else
+        snprintf(path, sizeof(path), "%s", arg);
+    snprintf(index_path, sizeof(index_path), "%s", path);
+    size_t n = strlen(index_path);
+    if (n > 5 && strcmp(index_path + n - 5, ".nrec") == 0) memcpy(index_path + n - 4, "nidx", 4);
+
+    uint64_t from_us = 0, to_us = UINT64_MAX;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--from") == 0) from_us = strtod(argv[i + 1], NULL) * 1e6;
+        else if (strcmp(argv[i], "--to") == 0) to_us = strtod(argv[i + 1], NULL) * 1e6;
+    }
+
+    int fd = open(path, O_RDONLY);
+    char hdr[RECORD_HEADER_SIZE];
+    if (fd < 0 || read_full(fd, hdr, sizeof(hdr)) < 0 || memcmp(hdr, "NREC", 4) != 0) {
+        fprintf(stderr, "Error: %s is not a recording\n", path);
+        exit(1);
+    }
+    int index_fd = open(index_path, O_RDONLY);
+    uint64_t off = replay_seek(index_fd, from_us);
+    if (index_fd >= 0) close(index_fd);
+
+    char *data = NULL;
+    size_t cap = 0;
+    char fh[RECORD_FRAME_HEADER];
+    while (pread(fd, fh, sizeof(fh), off) == (ssize_t)sizeof(fh)) {
+        uint64_t t = get_u64(fh);
+        uint32_t len = get_u32(fh + 8);
+        if (t > to_us) break;
+        off += sizeof(fh);
+        if (t >= from_us) {
+            if (len > cap) {
+                cap = len;
+                data = realloc(data, cap);
+                if (!data) perror_exit("realloc");
+            }
+            if (pread(fd, data, len, off) != (ssize_t)len) break;
+            if (write_all(STDOUT_FILENO, data, len) < 0) break;
+        }
+        off += len;
+    }
+    free(data);
+    close(fd);
+}
+
+static void client_upgrade(void) {
+    FrameHeader reply;
+    char *res = rpc_call(OP_UPGRADE, NULL, 0, &reply);
+    if (reply.status == STATUS_OK)
+        printf("OK\n");
+    else
+        printf("ERROR %s\n", res);
+    free(res);
+}
+
+// stats [-s]: the daemon's counters, per session too with -s.
+static void client_stats(int argc, char **argv) {
+    char flags = argc > 2 && strcmp(argv[2], "-s") == 0 ? STATS_SESSIONS : 0;
+    FrameHeader reply;
+    char *res = rpc_call(OP_STATS, &flags, 1, &reply);
+    if (reply.status == STATUS_OK)
+        fwrite(res, 1, reply.len, stdout);
+    else
+        printf("ERROR %s\n", res);
+    free(res);
+}
+
+enum { LIST_PLAIN, LIST_LONG, LIST_JSON };
+
+static const char *list_state_name(uint8_t state) {
+    switch (state) {
+    case LIST_ATTACHED: return "attached";
+    case LIST_EXITED: return "exited";
+    default: return "running";
+    }
+}
+
+static void json_string(const char *p, size_t len) {
+    putchar('"');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = p[i];
+        if (ch == '"' || ch == '\\') printf("\\%c", ch);
+        else if (ch < 0x20) printf("\\u%04x", ch);
+        else putchar(ch);
+    }
+    putchar('"');
+}
+
+// Print one LIST_DETAIL record; event is 0 in the listing itself, else
+// WATCH_*. Returns its length, 0 if it is cut short.
+static size_t list_print(const char *p, size_t avail, int format, uint8_t event) {
+    static const char *events[] = {"session", "spawned", "exited", "attached", "detached"};
+    static const char *words[] = {"SESSION", "SPAWNED", "EXITED", "ATTACHED", "DETACHED"};
+    if (event > WATCH_DETACHED) return 0;
+    if (avail < LIST_RECORD || avail < LIST_RECORD + (size_t)get_u16(p + 29)) return 0;
+    uint32_t id = get_u32(p), pid = get_u32(p + 4), clients = get_u32(p + 9);
+    uint64_t started = get_u64(p + 13), output = get_u64(p + 21);
+    size_t len = get_u16(p + 29);
+    const char *state = list_state_name(p[8]), *command = p + LIST_RECORD;
+    uint64_t now = time(NULL), age = now > started ? now - started : 0;
+    if (format == LIST_JSON) {
+        printf("{");
+        if (event) printf("\"event\":\"%s\",", events[event]);
+        printf("\"id\":%u,\"pid\":%u,\"state\":\"%s\",\"clients\":%u,\"started\":%llu,"
+               "\"output\":%llu,\"command\":",
+               id, pid, state, clients, (unsigned long long)started, (unsigned long long)output);
+        json_string(command, len);
+        printf("}\n");
+    } else {
+        printf("%s %u pid=%u", words[event], id, pid);
+        if (format == LIST_LONG)
+            printf(" state=%s clients=%u age=%llu output=%llu command=%.*s", state, clients,
+                   (unsigned long long)age, (unsigned long long)output, (int)len, command);
+        printf("\n");
+    }
+    return LIST_RECORD + len;
+}
+
+static uint8_t list_parse_state(const char *name) {
+    if (strcmp(name, "running") == 0) return LIST_RUNNING;
+    if (strcmp(name, "attached") == 0) return LIST_ATTACHED;
+    if (strcmp(name, "exited") == 0) return LIST_EXITED;
+    fprintf(stderr, "Error: unknown state %s\n", name);
+    exit(1);
 }
 
-static void client_kill(int id) {
+// list [-l|-j] [-w] [-s STATE]... [-c TEXT] [-o SECONDS] [-n SECONDS]
+static void client_list(int argc, char **argv) {
+    int format = LIST_PLAIN, watch = 0;
+    char req[10 + 256] = {0};
+    size_t len = 0;  // plain request unless something is asked for
+    for (int i = 2; i < argc; i++) {
+        const char *arg = argv[i];
+        if (!len) len = 10;
+        if (strcmp(arg, "-l") == 0) {
+            format = LIST_LONG;
+            continue;
+        }
+        if (strcmp(arg, "-j") == 0) {
+            format = LIST_JSON;
+            continue;
+        }
+        if (strcmp(arg, "-w") == 0) {
+            watch = 1;
+            continue;
+        }
+        const char *val = ++i < argc ? argv[i] : NULL;
+        if (val && strcmp(arg, "-s") == 0) {
+            req[1] |= list_parse_state(val);
+        } else if (val && strcmp(arg, "-o") == 0) {
+            put_u32(req + 2, strtoul(val, NULL, 10));
+        } else if (val && strcmp(arg, "-n") == 0) {
+            put_u32(req + 6, strtoul(val, NULL, 10));
+        } else if (val && strcmp(arg, "-c") == 0) {
+            len = 10 + snprintf(req + 10, sizeof(req) - 10, "%s", val);
+            if (len > sizeof(req) - 1) len = sizeof(req) - 1;
+        } else {
+            fprintf(stderr, "Error: bad list option %s\n", arg);
+            exit(1);
+        }
+    }
+    req[0] = (format != LIST_PLAIN || watch ? LIST_DETAIL : 0) | (watch ? LIST_WATCH : 0);
+
     int sock = connect_with_retry();
-    char buf[64];
-    snprintf(buf, sizeof(buf), "KILL %d", id);
-    write_all(sock, buf, strlen(buf));
+    rpc_send(sock, OP_LIST, 1, req, len);
+    FrameHeader reply;
+    char *res = rpc_recv(sock, &reply);
+    if (!res) {
+        fprintf(stderr, "Error: daemon closed the connection\n");
+        exit(1);
+    }
+    if (reply.status != STATUS_OK) {
+        printf("ERROR %s\n", res);
+    } else if (req[0] & LIST_DETAIL) {
+        size_t n;
+        for (uint32_t off = 0; (n = list_print(res + off, reply.len - off, format, 0)); off += n);
+    } else {
+        for (uint32_t off = 0; off + 8 <= reply.len; off += 8)
+            printf("SESSION %u pid=%u\n", get_u32(res + off), get_u32(res + off + 4));
+    }
+    if (format != LIST_JSON) printf("DONE\n");
+    fflush(stdout);
+    free(res);
 
-    char line[256];
-    ssize_t n = read(sock, line, sizeof(line)-1);
-    if (n > 0) printf("%s", line);
+    while (watch && reply.status == STATUS_OK && (res = rpc_recv(sock, &reply))) {
+        if (reply.len && res[0]) list_print(res + 1, reply.len - 1, format, res[0]);
+        fflush(stdout);
+        free(res);
+    }
     close(sock);
 }
 
-static void client_attach(int id) {
-    int sock = connect_with_retry();
-    char buf[64];
-    snprintf(buf, sizeof(buf), "ATTACH %d", id);
-    write_all(sock, buf, strlen(buf));
+// Arguments are session IDs or ID ranges ("3", "1-500", "2,7-9").
+static void client_kill(int argc, char **argv) {
+    Buf ranges = {0};
+    for (int i = 2; i < argc; i++) {
+        char *p = argv[i];
+        while (*p) {
+            char rec[8];
+            unsigned long first = strtoul(p, &p, 10), last = first;
+            if (*p == '-') last = strtoul(p + 1, &p, 10);
+            put_u32(rec, first);
+            put_u32(rec + 4, last);
+            buf_append(&ranges, rec, sizeof(rec));
+            while (*p == ',') p++;
+            if (*p && (*p < '0' || *p > '9')) break;
+        }
+    }
+
+    FrameHeader reply;
+    if (ranges.len == 8 && get_u32(ranges.data) == get_u32(ranges.data + 4)) {
+        int id = get_u32(ranges.data);
+        char *res = rpc_call(OP_KILL, ranges.data, 4, &reply);
+        if (reply.status == STATUS_OK)
+            printf("OK killing session %d\n", id);
+        else
+            printf("ERROR %s\n", res);
+        free(res);
+    } else {
+        char *res = rpc_call(OP_KILL_BATCH, ranges.data, ranges.len, &reply);
+        if (reply.status != STATUS_OK || reply.len == 0)
+            printf("ERROR %s\n", reply.len ? res : "no such session");
+        for (uint32_t off = 0; reply.status == STATUS_OK && off + 4 <= reply.len; off += 4)
+            printf("OK killing session %u\n", get_u32(res + off));
+        free(res);
+    }
+    buf_free(&ranges);
+}
+
+#ifdef __linux__
+// Session output on its way to stdout. On Linux it is spliced through a
+// pipe so it never enters user space; where either end cannot splice
+// (EINVAL) we drop back to read()/write() for good.
+typedef struct Relay {
+    int pipefd[2];
+    int spliced;
+} Relay;
+
+static void relay_init(Relay *r) {
+    r->spliced = pipe2(r->pipefd, O_CLOEXEC) == 0;
+}
+
+static void relay_close(Relay *r) {
+    if (!r->spliced) return;
+    close(r->pipefd[0]);
+    close(r->pipefd[1]);
+    r->spliced = 0;
+}
 
-    char line[256];
-    ssize_t n = read(sock, line, sizeof(line)-1);
-    if (n <= 0 || strncmp(line, "OK ATTACH", 9) != 0) {
-        if (n > 0) printf("%s", line);
+// Returns bytes moved, 0 on EOF, -1 on error or when out_fd is gone.
+static ssize_t relay_once(Relay *r, int in_fd, int out_fd) {
+    while (r->spliced) {
+        ssize_t n = splice(in_fd, NULL, r->pipefd[1], NULL, SPLICE_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL) {
+            relay_close(r);
+            break;
+        }
+        if (n <= 0) return n;
+
+        size_t left = n;
+        while (left > 0) {
+            ssize_t m = splice(r->pipefd[0], NULL, out_fd, NULL, left, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m < 0 && errno == EINVAL) {
+                // Empty the pipe by hand before giving up on splice.
+                char buf[4096];
+                while (left > 0) {
+                    ssize_t k = read(r->pipefd[0], buf, left < sizeof(buf) ? left : sizeof(buf));
+                    if (k <= 0 || write_all(out_fd, buf, k) < 0) return -1;
+                    left -= k;
+                }
+                relay_close(r);
+                break;
+            }
+            if (m <= 0) return -1;
+            left -= m;
+        }
+        return n;
+    }
+
+    char buf[4096];
+    ssize_t n = read(in_fd, buf, sizeof(buf));
+    if (n > 0 && write_all(out_fd, buf, n) < 0) return -1;
+    return n;
+}
+#endif
+
+// Local echo for slow links (attach -e). A printable keystroke is shown
+// at once, ahead of its echo, but only while the session is seen to
+// echo: the first keystroke after anything else (Enter, a control key,
+// a password prompt) is a probe that is not shown. Output that confirms
+// the guess is not drawn twice; where it differs, the rest of the guess
+// is erased and the output drawn as it came.
+typedef struct Predict {
+    int confirmed;      // the last probe came back as its echo
+    char probe;         // keystroke sent unshown, 0 for none
+    char shown[16];     // shown, echo not seen yet
+    int nshown;
+} Predict;
+
+static void predict_input(Predict *p, const char *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned char ch = buf[i];
+        if (ch < 0x20 || ch > 0x7e || (p->confirmed && p->nshown == (int)sizeof(p->shown))) {
+            p->confirmed = 0;
+            p->probe = 0;
+        } else if (p->confirmed) {
+            p->shown[p->nshown++] = ch;
+            write_all(STDOUT_FILENO, &buf[i], 1);
+        } else if (!p->probe && !p->nshown) {
+            p->probe = ch;
+        }
+    }
+}
+
+static int predict_output(Predict *p, const char *data, size_t len) {
+    if (p->probe) {
+        p->confirmed = data[0] == p->probe;
+        p->probe = 0;
+    }
+    size_t k = 0;
+    while (k < len && k < (size_t)p->nshown && data[k] == p->shown[k]) k++;
+    if (k < len && k < (size_t)p->nshown) {
+        char undo[32];
+        int n = snprintf(undo, sizeof(undo), "\x1b[%dD\x1b[%dX", p->nshown - (int)k,
+                         p->nshown - (int)k);
+        write_all(STDOUT_FILENO, undo, n);
+        p->nshown = 0;
+        p->confirmed = 0;
+    } else {
+        memmove(p->shown, p->shown + k, p->nshown - k);
+        p->nshown -= k;
+    }
+    return write_all(STDOUT_FILENO, data + k, len - k);
+}
+
+// Session output to the terminal, past local echo if there is any.
+static int attach_output(Predict *p, const char *data, size_t len) {
+    return p ? predict_output(p, data, len) : write_all(STDOUT_FILENO, data, len);
+}
+
+// Take compressed output off the socket and write out each block that
+// is complete. Returns -1 once the daemon hung up or sent garbage.
+static int attach_inflate(Lz *z, Buf *in, int sock, Predict *predict) {
+    char chunk[64 * 1024];
+    ssize_t nr = read(sock, chunk, sizeof(chunk));
+    if (nr < 0 && errno == EINTR) return 0;
+    if (nr <= 0) return -1;
+    buf_append(in, chunk, nr);
+    while (buf_pending(in) >= 8) {
+        const char *p = in->data + in->off;
+        uint32_t raw = get_u32(p), body = get_u32(p + 4);
+        size_t len = body & ~LZ_STORED;
+        if (len > LZ_BOUND) return -1;
+        if (buf_pending(in) < 8 + len) break;
+        const char *out = lz_decompress(z, p + 8, body, raw);
+        if (!out || (raw && attach_output(predict, out, raw) < 0)) return -1;
+        in->off += 8 + len;
+    }
+    return 0;
+}
+
+static void client_attach(int id, AttachPolicy policy, int flags, int echo) {
+    char buf[10];
+    struct winsize ws;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) != 0) memset(&ws, 0, sizeof(ws));
+    put_u32(buf, id);
+    buf[4] = policy;
+    put_u16(buf + 5, ws.ws_row);
+    put_u16(buf + 7, ws.ws_col);
+    buf[9] = flags;
+
+    int sock = connect_with_retry();
+    rpc_send(sock, OP_ATTACH, 1, buf, sizeof(buf));
+    FrameHeader reply;
+    char *res = rpc_recv(sock, &reply);
+    if (!res || reply.status != STATUS_OK) {
+        if (res) printf("ERROR %s\n", res);
+        free(res);
         close(sock);
         return;
     }
+    Lz *lz = reply.len >= 1 && (res[0] & ATTACH_COMPRESS) ? lz_new() : NULL;
+    Buf packed = {0};
+    Predict local = {0}, *predict = echo ? &local : NULL;
+    free(res);
 
     struct termios orig_term, raw_term;
     tcgetattr(STDIN_FILENO, &orig_term);
@@ -551,23 +7308,31 @@ static void client_attach(int id) {
     cfmakeraw(&raw_term);
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw_term);
 
+#ifdef __linux__
+    Relay relay;
+    relay_init(&relay);
+#endif
+    // Two descriptors, and stdin must stay blocking (the terminal is
+    // shared with the parent shell), so plain poll() is all this needs.
+    struct pollfd pfd[2] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {sock, POLLIN, 0},
+    };
     while (1) {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(STDIN_FILENO, &rfds);
-        FD_SET(sock, &rfds);
-        int maxfd = (sock > STDIN_FILENO) ? sock : STDIN_FILENO;
-
-        int rv = select(maxfd + 1, &rfds, NULL, NULL, NULL);
+        int rv = poll(pfd, 2, -1);
         if (rv < 0) {
             if (errno == EINTR) continue;
             break;
         }
 
-        if (FD_ISSET(STDIN_FILENO, &rfds)) {
+        if (pfd[0].revents) {
             char buf2[4096];
             ssize_t nr = read(STDIN_FILENO, buf2, sizeof(buf2));
-            if (nr <= 0) break;
+            if (nr <= 0) {
+                // Keep watching output: "nimt attach 1 </dev/null >log" taps.
+                pfd[0].fd = -1;
+                continue;
+            }
 
             for (int i = 0; i < nr; i++) {
                 if ((unsigned char)buf2[i] == ATTACH_DETACH_KEY) {
@@ -576,18 +7341,295 @@ static void client_attach(int id) {
                 }
             }
             write_all(sock, buf2, nr);
+            if (predict) predict_input(predict, buf2, nr);
         }
 
-        if (FD_ISSET(sock, &rfds)) {
+        if (pfd[1].revents && lz) {
+            if (attach_inflate(lz, &packed, sock, predict) < 0) break;
+        } else if (pfd[1].revents && predict) {
             char buf2[4096];
             ssize_t nr = read(sock, buf2, sizeof(buf2));
+            if (nr < 0 && errno == EINTR) continue;
+            if (nr <= 0 || predict_output(predict, buf2, nr) < 0) break;
+        } else if (pfd[1].revents) {
+#ifdef __linux__
+            ssize_t nr = relay_once(&relay, sock, STDOUT_FILENO);
+            if (nr < 0 && (errno == EAGAIN || errno == EINTR)) continue;
             if (nr <= 0) break;
-            write_all(STDOUT_FILENO, buf2, nr);
+#else
+            char buf2[4096];
+            ssize_t nr = read(sock, buf2, sizeof(buf2));
+            if (nr <= 0 || write_all(STDOUT_FILENO, buf2, nr) < 0) break;
+#endif
         }
     }
 
 detach:
+#ifdef __linux__
+    relay_close(&relay);
+#endif
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_term);
+    buf_free(&packed);
+    lz_free(lz);
+    close(sock);
+}
+
+/**********************************************************************
+ *                            BENCHMARKS
+ **********************************************************************/
+
+// `nimt bench` starts a daemon of its own under a private name and measures
+// it from the outside, the way clients see it. Each result is one JSON
+// line on stdout, so runs on different machines and builds can be
+// compared by script; "profile" names the build's, see the top of the
+// file. NIMT_SHARDS and friends reach the daemon as usual.
+
+static pid_t g_bench_daemon;
+
+// atexit: take the private daemon down with us, failed runs included.
+static void bench_stop(void) {
+    kill(g_bench_daemon, SIGTERM);
+    while (waitpid(g_bench_daemon, NULL, 0) < 0 && errno == EINTR);
+    rmdir(STATE_DIR);
+    rmdir(RECORD_DIR);
+}
+
+// CPU time the daemon has used so far, in nanoseconds; 0 where the
+// system will not tell.
+static uint64_t bench_daemon_cpu(void) {
+    clockid_t clock;
+    struct timespec ts;
+    if (clock_getcpuclockid(g_bench_daemon, &clock) != 0 || clock_gettime(clock, &ts) < 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// One latency result: n samples in microseconds, sorted in place.
+static void bench_latency(const char *name, uint64_t *us, size_t n) {
+    if (!n) return;
+    qsort(us, n, sizeof(*us), bench_cmp);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) sum += us[i];
+    struct utsname u;
+    if (uname(&u) < 0) snprintf(u.machine, sizeof(u.machine), "unknown");
+    printf("{\"bench\":\"%s\",\"arch\":\"%s\",\"profile\":\"%s\",\"samples\":%zu,"
+           "\"mean_us\":%.1f,\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu}\n",
+           name, u.machine, NIMT_PROFILE, n, (double)sum / n, (unsigned long long)us[(n - 1) / 2],
+           (unsigned long long)us[(n - 1) * 9 / 10], (unsigned long long)us[(n - 1) * 99 / 100],
+           (unsigned long long)us[n - 1]);
+    fflush(stdout);
+}
+
+// cpu_ns is what the daemon spent on it: the relay's cost per byte.
+static void bench_throughput(const char *name, uint32_t sessions, uint64_t bytes, uint64_t us,
+                             uint64_t cpu_ns) {
+    struct utsname u;
+    if (uname(&u) < 0) snprintf(u.machine, sizeof(u.machine), "unknown");
+    printf("{\"bench\":\"%s\",\"arch\":\"%s\",\"profile\":\"%s\",\"sessions\":%u,"
+           "\"bytes\":%llu,\"us\":%llu,\"mb_per_s\":%.1f,\"daemon_ns_per_byte\":%.3f}\n",
+           name, u.machine, NIMT_PROFILE, sessions, (unsigned long long)bytes,
+           (unsigned long long)us, us ? (double)bytes / us : 0.0,
+           bytes ? (double)cpu_ns / bytes : 0.0);
+    fflush(stdout);
+}
+
+// One request on a connection that is kept open, so the connect does
+// not count.
+static char *bench_call(int sock, uint8_t opcode, const void *payload, uint32_t len,
+                        FrameHeader *reply) {
+    rpc_send(sock, opcode, 1, payload, len);
+    char *res = rpc_recv(sock, reply);
+    if (!res) {
+        fprintf(stderr, "Error: daemon closed the connection\n");
+        exit(1);
+    }
+    return res;
+}
+
+// Spawn count sessions of command into ids[].
+static void bench_spawn(int sock, uint32_t count, const char *command, uint32_t *ids) {
+    char buf[256];
+    put_u32(buf, 0);
+    put_u32(buf + 4, count);
+    size_t len = 8 + snprintf(buf + 8, sizeof(buf) - 8, "%s", command);
+    FrameHeader reply;
+    char *res = bench_call(sock, OP_SPAWN_BATCH, buf, len, &reply);
+    for (uint32_t i = 0; i < count; i++) {
+        ids[i] = reply.status == STATUS_OK && 4 * i + 4 <= reply.len ? get_u32(res + 4 * i) : 0;
+        if (!ids[i]) {
+            fprintf(stderr, "Error: bench: spawn %s failed\n", command);
+            exit(1);
+        }
+    }
+    free(res);
+}
+
+static void bench_kill(int sock, const uint32_t *ids, uint32_t count) {
+    Buf ranges = {0};
+    for (uint32_t i = 0; i < count; i++) {
+        char rec[8];
+        put_u32(rec, ids[i]);
+        put_u32(rec + 4, ids[i]);
+        buf_append(&ranges, rec, sizeof(rec));
+    }
+    FrameHeader reply;
+    free(bench_call(sock, OP_KILL_BATCH, ranges.data, ranges.len, &reply));
+    buf_free(&ranges);
+}
+
+// Attach with the block policy, the one that never loses output.
+static int bench_attach(uint32_t id) {
+    char buf[9];
+    put_u32(buf, id);
+    buf[4] = POLICY_BLOCK;
+    put_u16(buf + 5, 0);
+    put_u16(buf + 7, 0);
+    int sock = connect_to_daemon();
+    if (sock < 0) perror_exit("connect");
+    FrameHeader reply;
+    char *res = bench_call(sock, OP_ATTACH, buf, sizeof(buf), &reply);
+    if (reply.status != STATUS_OK) {
+        fprintf(stderr, "Error: bench: attach %u: %s\n", id, res);
+        exit(1);
+    }
+    free(res);
+    return sock;
+}
+
+// Spawn-to-reply latency of OP_SPAWN, one request at a time.
+static void bench_spawn_latency(int sock, uint32_t iterations) {
+    uint64_t *us = calloc(iterations, sizeof(*us));
+    uint32_t *ids = calloc(iterations, sizeof(*ids));
+    if (!us || !ids) perror_exit("calloc");
+    char buf[64];
+    put_u32(buf, 0);
+    size_t len = 4 + snprintf(buf + 4, sizeof(buf) - 4, "cat");
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint64_t start = now_us(CLOCK_MONOTONIC);
+        FrameHeader reply;
+        char *res = bench_call(sock, OP_SPAWN, buf, len, &reply);
+        us[i] = now_us(CLOCK_MONOTONIC) - start;
+        if (reply.status != STATUS_OK || reply.len < 4) {
+            fprintf(stderr, "Error: bench: spawn: %s\n", res);
+            exit(1);
+        }
+        ids[i] = get_u32(res);
+        free(res);
+    }
+    bench_latency("spawn", us, iterations);
+    bench_kill(sock, ids, iterations);
+    free(ids);
+    free(us);
+}
+
+// Keystroke to echo: a byte written to an attached cat comes back from
+// the pty's line discipline. Stays below the canonical line limit.
+static void bench_echo_latency(int sock, uint32_t iterations) {
+    if (iterations > 4000) iterations = 4000;
+    uint64_t *us = calloc(iterations, sizeof(*us));
+    if (!us) perror_exit("calloc");
+    uint32_t id;
+    bench_spawn(sock, 1, "cat", &id);
+    int a = bench_attach(id);
+    size_t n = 0;
+    for (; n < iterations; n++) {
+        uint64_t start = now_us(CLOCK_MONOTONIC);
+        if (write_all(a, "x", 1) < 0) break;
+        char buf[256];
+        ssize_t got;
+        while ((got = read(a, buf, sizeof(buf))) > 0 && !memchr(buf, 'x', got));
+        if (got <= 0) break;
+        us[n] = now_us(CLOCK_MONOTONIC) - start;
+    }
+    close(a);
+    bench_latency("echo", us, n);
+    bench_kill(sock, &id, 1);
+    free(us);
+}
+
+// sessions sessions each writing bytes to its pty as fast as it can,
+// every one attached: the pty-to-client rate they sustain together.
+// Each waits for a line of input, so the clock starts with all output
+// still to come.
+static void bench_relay(int sock, uint32_t sessions, uint64_t bytes) {
+    char command[96];
+    snprintf(command, sizeof(command), "read line; exec head -c %llu /dev/zero",
+             (unsigned long long)bytes);
+    uint32_t *ids = calloc(sessions, sizeof(*ids));
+    struct pollfd *pfd = calloc(sessions, sizeof(*pfd));
+    if (!ids || !pfd) perror_exit("calloc");
+    bench_spawn(sock, sessions, command, ids);
+    for (uint32_t i = 0; i < sessions; i++) {
+        pfd[i].fd = bench_attach(ids[i]);
+        pfd[i].events = POLLIN;
+    }
+    for (uint32_t i = 0; i < sessions; i++) write_all(pfd[i].fd, "\n", 1);
+
+    uint64_t total = 0, start = now_us(CLOCK_MONOTONIC), cpu = bench_daemon_cpu();
+    uint32_t open_fds = sessions;
+    char buf[64 * 1024];
+    while (open_fds > 0) {
+        if (poll(pfd, sessions, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror_exit("poll");
+        }
+        for (uint32_t i = 0; i < sessions; i++) {
+            if (!pfd[i].revents) continue;
+            ssize_t n = read(pfd[i].fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n > 0) {
+                total += n;
+                continue;
+            }
+            close(pfd[i].fd);
+            pfd[i].fd = -1;
+            open_fds--;
+        }
+    }
+    bench_throughput("relay", sessions, total, now_us(CLOCK_MONOTONIC) - start,
+                     bench_daemon_cpu() - cpu);
+    bench_kill(sock, ids, sessions);
+    free(pfd);
+    free(ids);
+}
+
+// bench [-i ITERATIONS] [-n SESSIONS] [-b BYTES]
+static void client_bench(int argc, char **argv) {
+    uint32_t iterations = 200, sessions = 64;
+    uint64_t bytes = 64 * 1024 * 1024;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-i") == 0) iterations = strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "-n") == 0) sessions = strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "-b") == 0) bytes = parse_size(argv[i + 1]);
+    }
+    if (!iterations) iterations = 1;
+    if (!sessions) sessions = 1;
+
+    char name[32];
+    snprintf(name, sizeof(name), "bench.%d", (int)getpid());
+    daemon_paths(name);
+
+    fflush(stdout);
+    g_bench_daemon = start_daemon(-1);
+    atexit(bench_stop);
+    int sock = connect_to_daemon();
+    if (sock < 0) perror_exit("connect");
+    // The daemon's children are its own; only our sockets can break.
+    signal(SIGPIPE, SIG_IGN);
+
+    bench_spawn_latency(sock, iterations);
+    bench_echo_latency(sock, iterations * 5);
+    // The same output spread over ever more sessions.
+    for (uint32_t n = 1; n <= sessions; n *= 2) {
+        bench_relay(sock, n, bytes / n > 1024 * 1024 ? bytes / n : 1024 * 1024);
+        if (n < sessions && n * 2 > sessions) n = sessions / 2;
+    }
+
     close(sock);
 }
 
@@ -597,16 +7639,78 @@ detach:
 
 static void usage(const char *prog) {
     fprintf(stderr,
-        "Usage: %s <command> [args...]\n"
+        "Usage: %s [-S NAME|PATH] <command> [args...]\n"
+        "  -S: the daemon to use, one per name or socket path (default: NIMT_SOCKET,\n"
+        "      else the default daemon; names live in XDG_RUNTIME_DIR or /tmp)\n"
         "Commands:\n"
-        "  spawn [CMD...]   Spawn a new session\n"
-        "  list             List sessions\n"
-        "  attach <ID>      Attach to session\n"
-        "  kill <ID>        Kill session\n",
+        "  spawn [-b SIZE] [-n COUNT] [-r] [-s] [-C PERCENT] [-M SIZE] [-I WEIGHT]\n"
+        "        [-o RATE] [CMD...]\n"
+        "                            Spawn COUNT new sessions (SIZE: scrollback bytes,\n"
+        "                            -r: record their output, -s: emulate the screen;\n"
+        "                            each in a cgroup of its own with -C: CPU percent,\n"
+        "                            -M: memory, -I: IO weight; -o: output bytes/s)\n"
+        "  list [-l|-j] [-w] [-s STATE]... [-c TEXT] [-o SECONDS] [-n SECONDS]\n"
+        "                            List sessions, -l: with details, -j: as JSON\n"
+        "                            lines; only those in STATE (running, attached,\n"
+        "                            exited), whose command has TEXT, older (-o) or\n"
+        "                            newer (-n) than SECONDS; -w: then print changes\n"
+        "  attach [-p POLICY] [-z] [-e] <ID>\n"
+        "                            Attach to session; POLICY for falling behind:\n"
+        "                            block (default), drop or disconnect;\n"
+        "                            -z: compress output, -e: echo typing locally\n"
+        "                            (slow links)\n"
+        "  kill <ID|FIRST-LAST>...   Kill sessions\n"
+        "  pool [-b SIZE] COUNT [CMD...]\n"
+        "                            Keep COUNT idle sessions of CMD ready to spawn\n"
+        "  upgrade                   Restart the daemon from its binary, keeping sessions\n"
+        "  bench [-i ITERATIONS] [-n SESSIONS] [-b BYTES]\n"
+        "                            Benchmark a private daemon; JSON lines on stdout\n"
+        "  send [-n] <ID> [TEXT...]  Type TEXT (else stdin) into a session, -n: and Enter\n"
+        "  read [--since OFFSET] <ID>\n"
+        "                            Print a session's output from OFFSET on (default:\n"
+        "                            all there is), and on stderr the offset to go on\n"
+        "                            from\n"
+        "  wait [-t SECONDS] [--since OFFSET] <ID> <PATTERN>\n"
+        "                            Wait for PATTERN (a regex) in a session's output\n"
+        "                            from OFFSET on (default: new output only), print\n"
+        "                            the offset past the match; fails after SECONDS\n"
+        "  stats [-s]                Print counters in the Prometheus text format\n"
+        "                            (-s: per session too)\n"
+        "  record <ID> [on|off]      Start or stop recording a session's output\n"
+        "  screen <ID> [on|off]      Repaint the screen on attach, not the scrollback\n"
+        "  replay <ID|FILE> [--from SECONDS] [--to SECONDS]\n"
+        "                            Print recorded output\n",
         prog);
 }
 
+// The socket an upgraded daemon inherited tells it which daemon it is.
+static void upgrade_paths(const char *fd_str) {
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    if (getsockname(atoi(fd_str), (struct sockaddr *)&addr, &len) == 0 && addr.sun_path[0])
+        daemon_paths(addr.sun_path);
+    else
+        daemon_paths(getenv("NIMT_SOCKET"));
+}
+
 int main(int argc, char **argv) {
+    g_argv0 = argv[0];
+    const char *upgrade = getenv("NIMT_UPGRADE_FD");
+    if (upgrade) {
+        upgrade_paths(upgrade);
+        daemon_loop(-1);
+        return 0;
+    }
+    // -S NAME|PATH before the command picks the daemon, see daemon_paths().
+    const char *where = getenv("NIMT_SOCKET");
+    if (argc > 2 && strcmp(argv[1], "-S") == 0) {
+        where = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    daemon_paths(where);
     if (argc < 2) {
         usage(argv[0]);
         return 1;
@@ -614,19 +7718,90 @@ int main(int argc, char **argv) {
     if (strcmp(argv[1], "spawn") == 0) {
         client_spawn(argc, argv);
     } else if (strcmp(argv[1], "list") == 0) {
-        client_list();
-    } else if (strcmp(argv[1], "attach") == 0) {
+        client_list(argc, argv);
+    } else if (strcmp(argv[1], "pool") == 0) {
+        client_pool(argc, argv);
+    } else if (strcmp(argv[1], "upgrade") == 0) {
+        client_upgrade();
+    } else if (strcmp(argv[1], "stats") == 0) {
+        client_stats(argc, argv);
+    } else if (strcmp(argv[1], "send") == 0) {
+        if (argc < 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        client_send(argc, argv);
+    } else if (strcmp(argv[1], "read") == 0) {
+        if (argc < 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        client_read(argc, argv);
+    } else if (strcmp(argv[1], "wait") == 0) {
+        if (argc < 4) {
+            usage(argv[0]);
+            return 1;
+        }
+        client_wait(argc, argv);
+    } else if (strcmp(argv[1], "bench") == 0) {
+        client_bench(argc, argv);
+    } else if (strcmp(argv[1], "record") == 0) {
+        if (argc < 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        client_toggle(OP_RECORD, argc, argv);
+    } else if (strcmp(argv[1], "screen") == 0) {
+        if (argc < 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        client_toggle(OP_SCREEN, argc, argv);
+    } else if (strcmp(argv[1], "replay") == 0) {
         if (argc < 3) {
             usage(argv[0]);
             return 1;
         }
-        client_attach(atoi(argv[2]));
+        client_replay(argc, argv);
+    } else if (strcmp(argv[1], "attach") == 0) {
+        AttachPolicy policy = POLICY_BLOCK;
+        int flags = 0, echo = 0;
+        int arg = 2;
+        while (arg < argc - 1) {
+            if (strcmp(argv[arg], "-z") == 0) {
+                if (!NIMT_WITH_COMPRESS) {
+                    fprintf(stderr, "Error: attach -z: built without compression\n");
+                    return 1;
+                }
+                flags |= ATTACH_COMPRESS;
+                arg++;
+            } else if (strcmp(argv[arg], "-e") == 0) {
+                echo = 1;
+                arg++;
+            } else if (strcmp(argv[arg], "-p") == 0) {
+                const char *name = argv[arg + 1];
+                if (strcmp(name, "drop") == 0) policy = POLICY_DROP;
+                else if (strcmp(name, "disconnect") == 0) policy = POLICY_DISCONNECT;
+                else if (strcmp(name, "block") != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                arg += 2;
+            } else {
+                break;
+            }
+        }
+        if (argc <= arg) {
+            usage(argv[0]);
+            return 1;
+        }
+        client_attach(atoi(argv[arg]), policy, flags, echo);
     } else if (strcmp(argv[1], "kill") == 0) {
         if (argc < 3) {
             usage(argv[0]);
             return 1;
         }
-        client_kill(atoi(argv[2]));
+        client_kill(argc, argv);
     } else {
         usage(argv[0]);
         return 1;